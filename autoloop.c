@@ -1,34 +1,107 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
-#include <time.h>
 #include "parse_wav.h"
+#include "planar.h"
 #include "loop.h"
+#include "render.h"
 #include "autoloop.h"
+#include "settings.h"
+#include "report.h"
+#include "simd.h"
+#include "threadpool.h"
+#include "pyramid.h"
+#include "chroma.h"
+#include "fingerprint.h"
+#include "cache.h"
 
 /* #include <fftw3.h> */
+
+/* Compare every channel of every 100th frame of the windows in the candidate search */
+#define WINDOW_DIFF_STEP 100
+/* loop lengths proposed by the fingerprint votes, and how far apart they must be in seconds */
+#define FINGERPRINT_CANDIDATES 8
+#define FINGERPRINT_LAG_SPACING 1
+/* loop lengths (diagonals of the self-similarity) scored by one task of the window search */
+#define DIAGONAL_LAG_CHUNK 8UL
+/* tasks of the window search per thread between two progress reports and deadline checks */
+#define DIAGONAL_ROUND_CHUNKS 4UL
+/* candidates per window size refined by find_loop_points_auto_offsets */
+#define WINDOW_CANDIDATES 4
+/* window sizes of find_loop_points_auto_offsets, 10 to 25 seconds in steps of 5 */
+#define NUM_WINDOW_SIZES 4
+/* candidates per window size carried from the coarsest pyramid level into the refinement */
+#define PYRAMID_CANDIDATES 4
+/* search radius around the loop end found one level up, in samples of the level searched */
+#define PYRAMID_FINE_RADIUS 32
+/* candidates per window size carried from the feature search into the refinement */
+#define FEATURE_CANDIDATES 4
+/* loop lengths (diagonals of the self-similarity) scored by one task of the feature search */
+#define FEATURE_LAG_CHUNK 16UL
 #include <math.h>
 
 /**
- * Simple, fast algorithm to find the mean squares of the samples within the given window
+ * Simple, fast algorithm to find the mean absolute difference of the samples within the given window
  * @param buf1 - First buffer compared  
  * @param buf2 - Second buffer compared
  * @param window_size - Size of compared window
- * @param step_size - Step size of comparison. Higher means more precise
+ * @param step_size - Step size of comparison. Lower means more precise
  */
 unsigned long find_difference(short* buf1, short* buf2, int window_size, unsigned long step_size) 
 {
     unsigned long diff = 0;
+    unsigned long count = 0;
     unsigned long i;
     long d;
-    for (i = 0; i < window_size; i += step_size) {
-        d = (long)(buf1[i] - buf2[i]);
-        if (d != 0) {
-            diff += sqrt(d * d);
-            i ++;
+
+    if (step_size == 1) {
+        diff = sum_abs_diff_s16(buf1, buf2, window_size);
+        count = window_size;
+    } else {
+        for (i = 0; i < window_size; i += step_size) {
+            d = (long) buf1[i] - (long) buf2[i];
+            diff += d < 0 ? -d : d;
+            count++;
+        }
+    }
+    return count == 0 ? 0 : diff / count;
+}
+
+/**
+ * Mean absolute difference between two windows of planar samples. Every sampled frame
+ * compares all channels, so subsampling never favours one channel over another
+ * @param buf - The planar samples
+ * @param start - First frame of the first window
+ * @param end - First frame of the second window
+ * @param window_size - Size of compared window in frames
+ * @param step_size - Step between sampled frames
+ */
+unsigned long find_difference_planar(const planarbuf* buf, unsigned long start, unsigned long end, unsigned long window_size, unsigned long step_size)
+{
+    unsigned long diff = 0;
+    unsigned long count = 0;
+    unsigned long i;
+    short* start_ptr;
+    short* end_ptr;
+    long d;
+    int c;
+
+    for (c = 0; c < buf->num_channels; c++) {
+        start_ptr = buf->channels[c] + start;
+        end_ptr = buf->channels[c] + end;
+        if (step_size == 1) {
+            diff += sum_abs_diff_s16(start_ptr, end_ptr, window_size);
+            count += window_size;
+            continue;
+        }
+        for (i = 0; i < window_size; i += step_size) {
+            d = (long) start_ptr[i] - (long) end_ptr[i];
+            diff += d < 0 ? -d : d;
+            count++;
         }
     }
-    return (unsigned long)((float)diff / (float)i);
+    return count == 0 ? 0 : diff / count;
 }
 
 /*
@@ -80,50 +153,475 @@ unsigned long find_frequency_difference(short *start_buf, short *end_buf, int bu
 
 
 /**
- * Returns the best score, with the start and end offsets identified throughout buf,
- * with a given sliding window size
- * @param buf - Buffer of samples
- * @param start_offset_buf - Long buffer in which optimal start offset is returned
- * @param end_offset_buf - Long buffer in which optimal end offset is returned
- * @param num_channels - Number of channels for this audio track
- * @param sample_rate - Sample rate of this audio track
- * @param window_size size of the sliding window in offset
- * @param step_size step increment of sliding window for each comparison
-*/
-int get_window_score(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate, unsigned long window_size, unsigned long step_size) 
+ * Orders candidates the way the window search breaks ties: lower scores first, and among equal
+ * scores the pair that comes later in scan order (later start, then later end)
+ * @param a - The first candidate
+ * @param b - The second candidate
+ * @return Whether a is better than b
+ */
+int is_better_candidate(const LoopCandidate* a, const LoopCandidate* b)
 {
-    short *sample_data = buf->data;
-    unsigned long start, end;
-    unsigned long best_end = 0L;
-    unsigned long best_start = 0L;
-    unsigned long best_score = ULONG_MAX;
-    unsigned long score;
+    if (a->score != b->score) {
+        return a->score < b->score;
+    }
+    return a->start > b->start || (a->start == b->start && a->end > b->end);
+}
+
+/**
+ * Inserts a candidate into a list sorted best first, dropping the worst one when the list is full
+ * @param candidates - The sorted list of candidates
+ * @param num_candidates - The number of candidates in the list, updated in place
+ * @param max_candidates - The capacity of the list
+ * @param candidate - The candidate to insert
+ */
+void insert_candidate(LoopCandidate* candidates, int* num_candidates, int max_candidates, const LoopCandidate* candidate)
+{
+    int k = *num_candidates;
+
+    if (k == max_candidates) {
+        if (!is_better_candidate(candidate, &candidates[k - 1])) {
+            return;
+        }
+        k--;
+    } else {
+        (*num_candidates)++;
+    }
+
+    for (; k > 0 && is_better_candidate(candidate, &candidates[k - 1]); k--) {
+        candidates[k] = candidates[k - 1];
+    }
+    candidates[k] = *candidate;
+}
 
-    for (start = 0; start <= buf->size - window_size * num_channels; start += step_size * num_channels) {
-        printf("\rTesting window size %d -- %f%%", (int)window_size, (float)start * 100 / (float)(buf->size - window_size));
+/**
+ * Shared state of the window search of get_window_scores. A window's score is the mean of the
+ * absolute differences of every channel of every WINDOW_DIFF_STEP-th frame pair along one
+ * diagonal (fixed lag end - start) of the self-similarity, so one prefix sum per diagonal scores
+ * every start and every window size on it. Each channel is gathered onto the coarsest grid that
+ * holds all compared frames, and all offsets count frames
+ */
+typedef struct {
+    /* every grid_step-th frame, grid_length samples per channel one channel after the other */
+    short* grid;
+    unsigned long grid_length;
+    unsigned long grid_step;
+    int num_channels;
+    /* frames in the buffer and between window starts */
+    unsigned long size;
+    unsigned long stride;
+    /* window sizes in frames and number of compared frames per window */
+    int num_windows;
+    const unsigned long* window_sizes;
+    unsigned long* window_counts;
+    /* distinct lags of all window sizes in increasing order, the diagonals to score */
+    unsigned long* lags;
+    unsigned long num_lags;
+    /* chunk of the first task of the running round */
+    unsigned long first_chunk;
+    unsigned long num_chunks;
+    /* best pair of each window size on each lag, num_windows per lag */
+    LoopCandidate* lag_best;
+    int failed;
+} DiagonalScan;
+
+/**
+ * @return The greatest common divisor of a and b
+ */
+static unsigned long gcd(unsigned long a, unsigned long b)
+{
+    unsigned long t;
+
+    while (b != 0) {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/**
+ * Orders lags for qsort
+ */
+static int compare_lags(const void* a, const void* b)
+{
+    unsigned long x = *(const unsigned long*) a;
+    unsigned long y = *(const unsigned long*) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Scores one chunk of diagonals of a DiagonalScan: builds the strided prefix sums of the sample
+ * differences along each diagonal, then reads every window of every window size off them in O(1)
+ * @param arg - The pointer to the DiagonalScan
+ * @param index - The index of the chunk of lags in the running round
+ */
+static void scan_diagonals(void* arg, unsigned long index)
+{
+    DiagonalScan* scan = (DiagonalScan*) arg;
+    LoopCandidate* best;
+    LoopCandidate candidate;
+    unsigned long first = (scan->first_chunk + index) * DIAGONAL_LAG_CHUNK;
+    unsigned long last = first + DIAGONAL_LAG_CHUNK;
+    /* grid points between compared samples */
+    unsigned long q = WINDOW_DIFF_STEP / scan->grid_step;
+    unsigned long num_candidates = 0;
+    unsigned long* prefix;
+    unsigned long lag, shift, length, window, count, start, pos, sum;
+    unsigned long k, j;
+    const short* channel;
+    long d;
+    int w, c;
+
+    if (last > scan->num_lags) {
+        last = scan->num_lags;
+    }
+
+    prefix = (unsigned long*) malloc(scan->grid_length * sizeof(unsigned long));
+    if (prefix == NULL) {
+        for (k = first; k < last; k++) {
+            for (w = 0; w < scan->num_windows; w++) {
+                scan->lag_best[k * scan->num_windows + w].score = ULONG_MAX;
+            }
+        }
+        scan->failed = 1;
+        return;
+    }
+
+    for (k = first; k < last; k++) {
+        lag = scan->lags[k];
+        shift = lag / scan->grid_step;
+        best = scan->lag_best + k * scan->num_windows;
+        for (w = 0; w < scan->num_windows; w++) {
+            best[w].start = 0L;
+            best[w].end = 0L;
+            best[w].score = ULONG_MAX;
+        }
+        length = scan->grid_length - shift;
+
+        /* prefix[j] sums the differences of every channel at j, j - q, j - 2q, ... down to the first grid point */
+        for (j = 0; j < length; j++) {
+            sum = j >= q ? prefix[j - q] : 0;
+            for (c = 0, channel = scan->grid + j; c < scan->num_channels; c++, channel += scan->grid_length) {
+                d = (long) channel[0] - (long) channel[shift];
+                sum += (unsigned long) (d < 0 ? -d : d);
+            }
+            prefix[j] = sum;
+        }
+
+        for (w = 0; w < scan->num_windows; w++) {
+            window = scan->window_sizes[w];
+            count = scan->window_counts[w];
+            if (lag < window || (lag - window) % scan->stride != 0) {
+                /* not a lag of this window size */
+                continue;
+            }
+
+            for (start = 0; start + lag + window <= scan->size; start += scan->stride) {
+                pos = start / scan->grid_step;
+                sum = prefix[pos + (count - 1) * q] - (pos >= q ? prefix[pos - q] : 0);
+                num_candidates++;
+
+                /* Among equal scores the pair latest in scan order wins, to detect the furthest loop
+                (else may detect similar sections of same verse) */
+                candidate.start = start;
+                candidate.end = start + lag;
+                candidate.score = sum / (count * scan->num_channels);
+                if (is_better_candidate(&candidate, &best[w])) {
+                    best[w] = candidate;
+                }
+            }
+        }
+    }
+
+    free(prefix);
+    count_candidates(num_candidates);
+}
+
+/**
+ * Orders candidates best first for qsort, with the ordering of is_better_candidate
+ */
+static int compare_candidates(const void* a, const void* b)
+{
+    const LoopCandidate* x = (const LoopCandidate*) a;
+    const LoopCandidate* y = (const LoopCandidate*) b;
+
+    return is_better_candidate(x, y) ? -1 : is_better_candidate(y, x);
+}
+
+/**
+ * Picks the best candidates with distinct loop lengths: a candidate is dropped if its lag is
+ * at most min_lag_distance from the lag of a better candidate already picked
+ * @param candidates - The candidates, sorted best first
+ * @param num_candidates - The number of candidates
+ * @param min_lag_distance - The largest difference between the lags of two near-duplicates
+ * @param picked - The buffer for up to max_picked candidates, best first
+ * @param max_picked - The number of candidates to pick
+ * @return The number of candidates picked
+ */
+static int pick_distinct_candidates(const LoopCandidate* candidates, unsigned long num_candidates, unsigned long min_lag_distance, LoopCandidate* picked, int max_picked)
+{
+    unsigned long k;
+    unsigned long lag, other;
+    int num_picked = 0;
+    int j;
+
+    for (k = 0; k < num_candidates && num_picked < max_picked; k++) {
+        if (candidates[k].score == ULONG_MAX) {
+            break;
+        }
+        lag = candidates[k].end - candidates[k].start;
+        for (j = 0; j < num_picked; j++) {
+            other = picked[j].end - picked[j].start;
+            if ((lag > other ? lag - other : other - lag) <= min_lag_distance) {
+                break;
+            }
+        }
+        if (j == num_picked) {
+            picked[num_picked++] = candidates[k];
+        }
+    }
+    return num_picked;
+}
+
+/**
+ * Default progress callback of a loop search: prints the progress of the window scan, unless
+ * quiet. The refinement prints its own scores
+ * @param arg - Unused
+ * @param stage - The stage of the search, "search" or "refine"
+ * @param fraction - The fraction of the stage done, 1 once it is complete
+ * @return 0, never cancels the search
+ */
+int log_search_progress(void* arg, const char* stage, double fraction)
+{
+    (void) arg;
+    if (should_log() && strcmp(stage, "search") == 0) {
+        printf("\rTesting window sizes -- %f%%%s", fraction * 100, fraction >= 1.0 ? "     \n" : "");
         fflush(stdout);
+    }
+    return 0;
+}
 
-        for (end = start + window_size * num_channels; end <= buf->size - window_size * num_channels; end += step_size * num_channels) {
+/**
+ * Resets search limits to a search that runs to completion and logs its progress
+ * @param limits - The limits to initialise
+ */
+void init_search_limits(SearchLimits* limits)
+{
+    limits->deadline = 0.0;
+    limits->accept_score = 0;
+    limits->progress = log_search_progress;
+    limits->progress_arg = NULL;
+}
 
-            score = find_difference(
-                sample_data + start,
-                sample_data + end,
-                window_size * num_channels,
-                100);
+/**
+ * Reports the progress of a search and checks whether it has to stop
+ * @param limits - The limits of the search
+ * @param clock - The timer started with the search
+ * @param stage - The stage of the search
+ * @param fraction - The fraction of the stage done
+ * @return Whether the search was cancelled or ran past its deadline
+ */
+static int search_interrupted(const SearchLimits* limits, PhaseTimer* clock, const char* stage, double fraction)
+{
+    if (limits->progress != NULL && limits->progress(limits->progress_arg, stage, fraction) != 0) {
+        return 1;
+    }
+    return limits->deadline > 0 && get_elapsed_time(clock) >= limits->deadline;
+}
 
-            /* Check if this is the best score found so far
-            Equality to detect furthest loop (else may detect similar sections of same verse) */
-            if (score <= best_score) {
-                best_score = score;
-                best_start = start;
-                best_end = end;
+/**
+ * Finds the best start and end offsets throughout buf for several sliding window sizes in one
+ * pass over the diagonals. The diagonals are scored in parallel and the candidates picked in
+ * score order, so the result does not depend on the number of threads. The diagonals are scored
+ * in rounds, between which the progress is reported and the limits checked
+ * @param buf - Planar samples
+ * @param window_sizes - Sizes of the sliding windows in frames
+ * @param num_windows - Number of window sizes
+ * @param step_size - Step increment of the sliding window for each comparison in frames
+ * @param max_candidates - Number of candidates to find per window size
+ * @param candidates - Buffer for max_candidates candidates per window size, best first
+ * @param num_candidates - Buffer for the number of candidates of each window size
+ * @param limits - The limits of the search
+ * @param clock - The timer started with the search
+ * @param stopped - Int buffer set to 1 if the search stopped before scoring every diagonal,
+ *                  the candidates then come from the diagonals scored so far
+ * @return Whether the search could run (0 if success)
+ */
+static int scan_window_sizes(const planarbuf* buf, const unsigned long* window_sizes, int num_windows, unsigned long step_size, int max_candidates, LoopCandidate* candidates, int* num_candidates, const SearchLimits* limits, PhaseTimer* clock, int* stopped)
+{
+    DiagonalScan scan;
+    LoopCandidate* sorted;
+    unsigned long* sizes;
+    unsigned long max_lags = 0;
+    unsigned long lag, k, round, count;
+    int w, c;
+
+    *stopped = 0;
+    for (w = 0; w < num_windows; w++) {
+        num_candidates[w] = 0;
+    }
+
+    scan.size = buf->length;
+    scan.stride = step_size;
+    scan.num_channels = buf->num_channels;
+    scan.num_windows = num_windows;
+    if (scan.stride == 0 || num_windows <= 0) {
+        return 1;
+    }
+
+    /* The grid holds every window start and every compared sample of every window */
+    sizes = (unsigned long*) malloc(2 * num_windows * sizeof(unsigned long));
+    if (sizes == NULL) {
+        return 1;
+    }
+    scan.window_sizes = sizes;
+    scan.window_counts = sizes + num_windows;
+    scan.grid_step = gcd(scan.stride, WINDOW_DIFF_STEP);
+    for (w = 0; w < num_windows; w++) {
+        sizes[w] = window_sizes[w];
+        scan.window_counts[w] = (sizes[w] + WINDOW_DIFF_STEP - 1) / WINDOW_DIFF_STEP;
+        scan.grid_step = gcd(scan.grid_step, sizes[w]);
+        if (sizes[w] > 0 && 2 * sizes[w] <= scan.size) {
+            max_lags += (scan.size - 2 * sizes[w]) / scan.stride + 1;
+        }
+    }
+
+    /* Lags of a window size run from the window size up in steps of the stride */
+    scan.num_lags = 0;
+    scan.lags = (unsigned long*) malloc((max_lags + 1) * sizeof(unsigned long));
+    if (scan.lags == NULL) {
+        free(sizes);
+        return 1;
+    }
+    for (w = 0; w < num_windows; w++) {
+        for (lag = sizes[w]; lag > 0 && lag + sizes[w] <= scan.size; lag += scan.stride) {
+            scan.lags[scan.num_lags++] = lag;
+        }
+    }
+    qsort(scan.lags, scan.num_lags, sizeof(unsigned long), compare_lags);
+    for (k = 0, max_lags = 0; k < scan.num_lags; k++) {
+        if (max_lags == 0 || scan.lags[k] != scan.lags[max_lags - 1]) {
+            scan.lags[max_lags++] = scan.lags[k];
+        }
+    }
+    scan.num_lags = max_lags;
+    if (scan.num_lags == 0) {
+        /* track too short for every window size */
+        free(scan.lags);
+        free(sizes);
+        return 0;
+    }
+
+    scan.grid_length = (scan.size + scan.grid_step - 1) / scan.grid_step;
+    scan.grid = (short*) malloc(scan.grid_length * scan.num_channels * sizeof(short));
+    scan.num_chunks = (scan.num_lags + DIAGONAL_LAG_CHUNK - 1) / DIAGONAL_LAG_CHUNK;
+    scan.lag_best = (LoopCandidate*) malloc(scan.num_lags * num_windows * sizeof(LoopCandidate));
+    sorted = (LoopCandidate*) malloc(scan.num_lags * sizeof(LoopCandidate));
+    if (scan.grid == NULL || scan.lag_best == NULL || sorted == NULL) {
+        printf("ERROR: Failed to allocate the window search!\n");
+        free(scan.grid);
+        free(scan.lag_best);
+        free(sorted);
+        free(scan.lags);
+        free(sizes);
+        return 1;
+    }
+    for (c = 0; c < scan.num_channels; c++) {
+        for (k = 0; k < scan.grid_length; k++) {
+            scan.grid[c * scan.grid_length + k] = buf->channels[c][k * scan.grid_step];
+        }
+    }
+    for (k = 0; k < scan.num_lags * num_windows; k++) {
+        /* lags left unscored when the search stops */
+        scan.lag_best[k].score = ULONG_MAX;
+    }
+    scan.failed = 0;
+
+    /* Chunks are handed out shortest lag (longest diagonal) first, the short ones fill in the gaps */
+    round = DIAGONAL_ROUND_CHUNKS * get_num_threads();
+    for (scan.first_chunk = 0; scan.first_chunk < scan.num_chunks; scan.first_chunk += count) {
+        count = scan.num_chunks - scan.first_chunk < round ? scan.num_chunks - scan.first_chunk : round;
+        parallel_for(count, scan_diagonals, &scan);
+        if (search_interrupted(limits, clock, "search", (double) (scan.first_chunk + count) / scan.num_chunks)
+            && scan.first_chunk + count < scan.num_chunks) {
+            *stopped = 1;
+            break;
+        }
+    }
+
+    if (scan.failed) {
+        printf("ERROR: Failed to allocate the window search!\n");
+    } else {
+        /* Sorting is a total order over (score, start, end), so the picks do not depend on the
+        order the lags were scored in. Lags closer than a step would refine into the same seam */
+        for (w = 0; w < num_windows; w++) {
+            for (k = 0; k < scan.num_lags; k++) {
+                sorted[k] = scan.lag_best[k * num_windows + w];
             }
+            qsort(sorted, scan.num_lags, sizeof(LoopCandidate), compare_candidates);
+            num_candidates[w] = pick_distinct_candidates(sorted, scan.num_lags, scan.stride, candidates + w * max_candidates, max_candidates);
         }
     }
-    printf("\rTesting window size %d -- 100.00000%%     \n", (int)window_size);
-    *start_offset_buf = best_start;
-    *end_offset_buf = best_end;
-    return best_score;
+
+    free(scan.grid);
+    free(scan.lag_best);
+    free(sorted);
+    free(scan.lags);
+    free(sizes);
+    return scan.failed;
+}
+
+/**
+ * Finds the best start and end offsets throughout buf for several sliding window sizes in one
+ * pass over the diagonals. The diagonals are scored in parallel and the candidates picked in
+ * score order, so the result does not depend on the number of threads
+ * @param buf - Planar samples
+ * @param window_sizes - Sizes of the sliding windows in frames
+ * @param num_windows - Number of window sizes
+ * @param step_size - Step increment of the sliding window for each comparison in frames
+ * @param max_candidates - Number of candidates to find per window size, with loop lengths
+ *                         more than a step apart
+ * @param candidates - Buffer in which the candidates of each window size are returned best first,
+ *                     max_candidates per window size, with their offsets in frames
+ * @param num_candidates - Buffer in which the number of candidates of each window size is returned,
+ *                         0 if the track is too short for it
+ * @return Whether the search could run (0 if success)
+ */
+int get_window_scores(const planarbuf* buf, const unsigned long* window_sizes, int num_windows, unsigned long step_size, int max_candidates, LoopCandidate* candidates, int* num_candidates)
+{
+    SearchLimits limits;
+    PhaseTimer clock;
+    int stopped;
+
+    init_search_limits(&limits);
+    start_phase(&clock);
+    return scan_window_sizes(buf, window_sizes, num_windows, step_size, max_candidates, candidates, num_candidates, &limits, &clock, &stopped);
+}
+
+/**
+ * Returns the best score, with the start and end offsets identified throughout buf,
+ * with a given sliding window size
+ * @param buf - Planar samples
+ * @param start_offset_buf - Long buffer in which optimal start frame is returned
+ * @param end_offset_buf - Long buffer in which optimal end frame is returned
+ * @param sample_rate - Sample rate of this audio track
+ * @param window_size size of the sliding window in frames
+ * @param step_size step increment of sliding window for each comparison in frames
+*/
+int get_window_score(const planarbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int sample_rate, unsigned long window_size, unsigned long step_size) 
+{
+    LoopCandidate best;
+    int num_candidates;
+
+    (void) sample_rate;
+    best.start = 0L;
+    best.end = 0L;
+    best.score = ULONG_MAX;
+    get_window_scores(buf, &window_size, 1, step_size, 1, &best, &num_candidates);
+    *start_offset_buf = best.start;
+    *end_offset_buf = best.end;
+    return best.score;
 }
 
 /**
@@ -138,26 +636,74 @@ int find_loop_points_auto(sndbuf* buf, unsigned int* start_time_buf, unsigned in
 {
     unsigned long start_offset;
     unsigned long end_offset;
+    int res;
 
-    find_loop_points_auto_offsets(buf, &start_offset, &end_offset, num_channels, sample_rate);
+    res = find_loop_points_auto_offsets(buf, &start_offset, &end_offset, num_channels, sample_rate);
 
     *start_time_buf = (unsigned int)(start_offset / (sample_rate * num_channels));
     *end_time_buf = (unsigned int)(end_offset / (sample_rate * num_channels));
 
-    return 0;
+    return res;
 }
 
 /**
- * Finds the best loop start and end offsets throughout a given sndbuf.
- * @param buf - The buffer for the samples to search
- * @param start_offset_buf - Long buffer in which optimal start offset is returned
- * @param end_offset_buf - Long buffer in which optimal end offset is returned
- * @param num_channels - Number of channels for this audio track
- * @param sample_rate - Sample rate of this audio track
+ * The candidates of find_loop_points_auto_offsets, refined at the same time
  */
-int find_loop_points_auto_offsets(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate) {
-    short *sample_data = buf->data;
+typedef struct {
+    const planarbuf* buf;
+    int sample_rate;
+    unsigned long step_size;
+    /* candidates to refine, their end and score are replaced by the refined ones */
+    LoopCandidate* candidates;
+} CandidateRefinement;
+
+/**
+ * Refines the loop end of one candidate and scores it with every sample
+ * @param arg - The pointer to the CandidateRefinement
+ * @param index - The index of the candidate
+ */
+static void refine_candidate(void* arg, unsigned long index)
+{
+    CandidateRefinement* refinement = (CandidateRefinement*) arg;
+    LoopCandidate* candidate = &refinement->candidates[index];
+    unsigned long step_size = refinement->step_size;
+    unsigned long duration = refinement->sample_rate;
+    unsigned long curr_end_offset = candidate->end;
+
+    /* 
+    Take half a step back for possibility that match point occurs before the offset, 
+    since find_loop_end looks forward only 
+    */
+    curr_end_offset = (curr_end_offset < step_size / 2) ? curr_end_offset : curr_end_offset - step_size / 2;
+
+    /* Find the optimal end_offset, assuming start_offset is correct, within a 1 second duration */
+    candidate->end = curr_end_offset + find_loop_end_planar(refinement->buf, candidate->start, curr_end_offset, duration, 2 * duration);
 
+    /* Score the found offsets */
+    candidate->score = find_difference_planar(refinement->buf, candidate->start, candidate->end, duration, 1);
+
+    /* // Alternative scorer
+    candidate->score = find_frequency_difference(
+        refinement->buf->channels[0] + candidate->start, 
+        refinement->buf->channels[0] + candidate->end, 
+        duration
+        );
+    */
+}
+
+/**
+ * Finds the best loop start and end frames throughout planar samples, as an anytime search.
+ * The candidates of every window size are refined best coarse score first, so a search stopped
+ * by its deadline, its progress callback or an accepted score returns the best loop found so far.
+ * A search that runs to completion returns the same loop whatever its limits
+ * @param buf - The planar samples to search
+ * @param sample_rate - Sample rate of this audio track
+ * @param limits - The deadline, accepted score and progress callback of the search
+ * @param result - Buffer in which the best loop found is returned, in frames
+ * @return Whether the search could run (0 if success)
+ */
+int find_loop_points_search(const planarbuf* buf, int sample_rate, const SearchLimits* limits, SearchResult* result)
+{
     /* Candidate-finding window settings in seconds */
     int best_win_size = -1;
     int min_window_size = 10;
@@ -168,166 +714,837 @@ int find_loop_points_auto_offsets(sndbuf* buf, unsigned long* start_offset_buf,
     unsigned long best_end = 0L;
     unsigned long best_start = 0L;
     unsigned long best_score = ULONG_MAX;
-    unsigned long score;
 
     /* step_size MUST be set to sample_rate or less to allow find_loop_end to successfully find the loop point */
-    unsigned long step_size = (sample_rate / 6) * num_channels;
-    int best_diff_step_size = 1;
+    unsigned long step_size = sample_rate / 6;
 
     /* Iterator helpers */
-    unsigned long curr_start_offset;
-    unsigned long curr_end_offset;
+    unsigned long window_sizes[NUM_WINDOW_SIZES];
+    LoopCandidate candidates[NUM_WINDOW_SIZES * WINDOW_CANDIDATES];
+    LoopCandidate refined[NUM_WINDOW_SIZES * WINDOW_CANDIDATES];
+    LoopCandidate queue[NUM_WINDOW_SIZES * WINDOW_CANDIDATES];
+    int num_candidates[NUM_WINDOW_SIZES];
+    int window_of[NUM_WINDOW_SIZES * WINDOW_CANDIDATES];
+    /* position in refined of each queued candidate, and whether each candidate was refined */
+    int slot_of[NUM_WINDOW_SIZES * WINDOW_CANDIDATES];
+    int done[NUM_WINDOW_SIZES * WINDOW_CANDIDATES];
+    int num_refined = 0;
+    int num_done, batch, stopped, res;
+    CandidateRefinement refinement;
     int win_size;
+    int k, j;
+    PhaseTimer timer;
+    PhaseTimer clock;
 
-    printf("LOOP FINDING START ==============\n");
+    log_info("LOOP FINDING START ==============\n");
+    start_phase(&clock);
 
-    /* Find the best candidate for each window size */
-    for (win_size = min_window_size; win_size <= max_window_size; win_size += wind_step)
-    {
-        /* Preliminary offset selection */
-        get_window_score(buf, start_offset_buf, end_offset_buf, num_channels, sample_rate, win_size * sample_rate, step_size);
-
-        curr_start_offset = *start_offset_buf;
-        curr_end_offset = *end_offset_buf;
-
-        /* 
-        Take half a step back for possibility that match point occurs before the offset, 
-        since find_loop_end looks forward only 
-        */
-        curr_end_offset = (curr_end_offset < step_size / 2) ? curr_end_offset : curr_end_offset - step_size / 2;
-
-        /* Find the optimal end_offset, assuming start_offset is correct, within a 1 second duration. */
-        curr_end_offset = curr_end_offset + find_loop_end_short_arr(
-                                                sample_data + curr_start_offset, sample_rate * num_channels,
-                                                sample_data + curr_end_offset, sample_rate * num_channels,
-                                                num_channels);
-
-        /* Score the found offsets */
-        score = find_difference(
-            sample_data + curr_start_offset, 
-            sample_data + curr_end_offset, 
-            sample_rate * num_channels,
-            best_diff_step_size
-            );
-        
-        /* // Alternative scorer
-        score = find_frequency_difference(
-            sample_data + curr_start_offset, 
-            sample_data + curr_end_offset, 
-            sample_rate * num_channels
-            );
-        */
-        
-
-        if (score <= best_score) 
+    /* Preliminary offset selection, every window size from one pass over the diagonals */
+    for (win_size = min_window_size, k = 0; win_size <= max_window_size; win_size += wind_step, k++) {
+        window_sizes[k] = win_size * sample_rate;
+    }
+    start_phase(&timer);
+    res = scan_window_sizes(buf, window_sizes, NUM_WINDOW_SIZES, step_size, WINDOW_CANDIDATES, candidates, num_candidates, limits, &clock, &stopped);
+    end_phase("search", &timer);
+
+    /* Refine the best candidates of every window size, a slightly worse coarse candidate often
+    refines into a better seam. The queue holds them best coarse score first */
+    for (win_size = min_window_size, k = 0; win_size <= max_window_size; win_size += wind_step, k++) {
+        for (j = 0; j < num_candidates[k]; j++) {
+            window_of[num_refined] = win_size;
+            done[num_refined] = 0;
+            refined[num_refined] = candidates[k * WINDOW_CANDIDATES + j];
+            for (batch = num_refined; batch > 0 && refined[num_refined].score < queue[batch - 1].score; batch--) {
+                queue[batch] = queue[batch - 1];
+                slot_of[batch] = slot_of[batch - 1];
+            }
+            queue[batch] = refined[num_refined];
+            slot_of[batch] = num_refined++;
+        }
+    }
+    refinement.buf = buf;
+    refinement.sample_rate = sample_rate;
+    refinement.step_size = step_size;
+
+    /* A search stopped during the scan, or already past its limits, refines nothing and
+    returns its best coarse candidate */
+    if (!stopped && num_refined > 0 && search_interrupted(limits, &clock, "refine", 0.0)) {
+        stopped = 1;
+    }
+
+    /* One candidate per thread at a time, so the limits are checked between batches */
+    start_phase(&timer);
+    for (num_done = 0; num_done < num_refined && !stopped; num_done += batch) {
+        batch = num_refined - num_done < get_num_threads() ? num_refined - num_done : get_num_threads();
+        refinement.candidates = queue + num_done;
+        parallel_for(batch, refine_candidate, &refinement);
+        for (k = num_done; k < num_done + batch; k++) {
+            refined[slot_of[k]] = queue[k];
+            done[slot_of[k]] = 1;
+            if (queue[k].score < limits->accept_score && num_done + batch < num_refined) {
+                /* good enough, the remaining candidates are only refined for a better score */
+                stopped = 1;
+            }
+        }
+        if (search_interrupted(limits, &clock, "refine", (double) (num_done + batch) / num_refined) && num_done + batch < num_refined) {
+            stopped = 1;
+        }
+    }
+    end_phase("refine", &timer);
+
+    /* Pick the best refined candidate, in window size then coarse rank order */
+    for (k = 0; k < num_refined; k++) {
+        if (done[k] && refined[k].score <= best_score) 
         {
-            printf("\tNew best start time: %f\n", (float)curr_start_offset / (float)sample_rate / num_channels);
-            printf("\tNew best end time: %f\n", (float)curr_end_offset / (float)sample_rate / num_channels);
-            best_score = score;
-            best_end = curr_end_offset;
-            best_start = curr_start_offset;
-            best_win_size = win_size; /* Reporting purpose */
+            log_info("\tNew best start time: %f\n", (float)refined[k].start / (float)sample_rate);
+            log_info("\tNew best end time: %f\n", (float)refined[k].end / (float)sample_rate);
+            best_score = refined[k].score;
+            best_end = refined[k].end;
+            best_start = refined[k].start;
+            best_win_size = window_of[k]; /* Reporting purpose */
         }
     }
+    if (num_done == 0 && num_refined > 0) {
+        best_score = queue[0].score;
+        best_end = queue[0].end;
+        best_start = queue[0].start;
+        best_win_size = window_of[slot_of[0]];
+    }
 
-    *start_offset_buf = best_start;
-    *end_offset_buf = best_end;
+    result->start = best_start;
+    result->end = best_end;
+    result->score = best_score;
+    result->exhaustive = !stopped;
+    if (stopped) {
+        count_searches_stopped(1);
+    }
 
-    printf("\rLoop finding completed -------------------------\n");
-    printf("\tBest approx start time: %f\n", (float)best_start / sample_rate / num_channels);
-    printf("\tBest approx end time: %f\n", (float)best_end / sample_rate / num_channels);
-    printf("\tBest window size: %d\n", best_win_size);
+    log_info("\rLoop finding completed -------------------------\n");
+    if (stopped) {
+        log_info("\tSearch stopped after %f seconds, before every candidate was scored\n", get_elapsed_time(&clock));
+    }
+    log_info("\tBest approx start time: %f\n", (float)best_start / sample_rate);
+    log_info("\tBest approx end time: %f\n", (float)best_end / sample_rate);
+    log_info("\tBest window size: %d\n", best_win_size);
     
-    return 0;
+    return res;
+}
+
+/**
+ * Finds the best loop start and end offsets throughout a given sndbuf, within the deadline
+ * and accepted score of the settings. The search runs on a planar copy of the samples
+ * @param buf - The buffer for the samples to search
+ * @param start_offset_buf - Long buffer in which optimal start offset is returned
+ * @param end_offset_buf - Long buffer in which optimal end offset is returned
+ * @param num_channels - Number of channels for this audio track
+ * @param sample_rate - Sample rate of this audio track
+ * @return Whether the search could run (0 if success)
+ */
+int find_loop_points_auto_offsets(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate) {
+    SearchLimits limits;
+    SearchResult result;
+    planarbuf planar;
+    int res;
+
+    *start_offset_buf = 0;
+    *end_offset_buf = 0;
+    if (make_planar(buf->data, buf->size, num_channels, &planar) != 0) {
+        printf("ERROR: Failed to allocate the planar samples!\n");
+        return 1;
+    }
+    init_search_limits(&limits);
+    limits.deadline = settings.deadline;
+    limits.accept_score = settings.accept_score;
+    res = find_loop_points_search(&planar, sample_rate, &limits, &result);
+    free_planar(&planar);
+
+    *start_offset_buf = result.start * num_channels;
+    *end_offset_buf = result.end * num_channels;
+    return res;
 }
 
 
 
-int loop_with_offsets(WavFile* f, unsigned long start_offset, unsigned long end_offset, unsigned int min_length, WavFile* fout) {
-    unsigned long loop_size, ending_size;
-    sndbuf start_buf, end_buf, loop_buf, intro_buf, ending_buf, extended_buf;
-    int res;
-    unsigned int num_loops;
-    WavHeaders info = f->headers;
+/**
+ * State of the candidate search at the coarsest level of a pyramid, one row per window start
+ */
+typedef struct {
+    short* samples;
+    unsigned long window_size;
+    unsigned long step_size;
+    unsigned long last_offset;
+    /* PYRAMID_CANDIDATES best pairs of each row, best first */
+    LoopCandidate* rows;
+    int* row_counts;
+} CoarseScan;
+
+/**
+ * Scores every end of one window start of the coarse search, keeping the row's best candidates
+ * @param arg - The pointer to the CoarseScan
+ * @param row - The index of the window start
+ */
+static void scan_coarse_row(void* arg, unsigned long row)
+{
+    CoarseScan* scan = (CoarseScan*) arg;
+    LoopCandidate* best = scan->rows + row * PYRAMID_CANDIDATES;
+    LoopCandidate candidate;
+    unsigned long start = row * scan->step_size;
+    unsigned long end;
+    unsigned long limit;
+    unsigned long sum;
+    unsigned long num_candidates = 0;
+    unsigned long num_abandoned = 0;
+
+    scan->row_counts[row] = 0;
+    for (end = start + scan->window_size; end <= scan->last_offset; end += scan->step_size) {
+        num_candidates++;
+        limit = scan->row_counts[row] < PYRAMID_CANDIDATES || settings.exhaustive ? ULONG_MAX : (best[PYRAMID_CANDIDATES - 1].score + 1) * scan->window_size - 1;
+        sum = sum_abs_diff_s16_bounded(scan->samples + start, scan->samples + end, scan->window_size, limit);
+        if (sum > limit) {
+            num_abandoned++;
+            continue;
+        }
+        candidate.start = start;
+        candidate.end = end;
+        candidate.score = sum / scan->window_size;
+        insert_candidate(best, &scan->row_counts[row], PYRAMID_CANDIDATES, &candidate);
+    }
+    count_candidates(num_candidates);
+    count_abandoned(num_abandoned);
+}
+
+/**
+ * Finds the best candidates of one window size at a pyramid level, comparing every sample
+ * @param level - The pyramid level to search
+ * @param window_size - Size of the sliding window in samples
+ * @param step_size - Step increment of the sliding window in samples
+ * @param candidates - The buffer for up to PYRAMID_CANDIDATES candidates, best first
+ * @return The number of candidates found
+ */
+static int get_coarse_candidates(PyramidLevel* level, unsigned long window_size, unsigned long step_size, LoopCandidate* candidates)
+{
+    CoarseScan scan;
+    unsigned long num_rows;
+    unsigned long row;
+    int num_candidates = 0;
+    int k;
+
+    if (window_size == 0 || step_size == 0 || 2 * window_size > level->length) {
+        /* track too short for this window size */
+        return 0;
+    }
+
+    scan.samples = level->samples;
+    scan.window_size = window_size;
+    scan.step_size = step_size;
+    scan.last_offset = level->length - window_size;
+    num_rows = (scan.last_offset - window_size) / step_size + 1;
+    scan.rows = (LoopCandidate*) malloc(num_rows * PYRAMID_CANDIDATES * sizeof(LoopCandidate));
+    scan.row_counts = (int*) malloc(num_rows * sizeof(int));
+    if (scan.rows == NULL || scan.row_counts == NULL) {
+        printf("ERROR: Failed to allocate the coarse search!\n");
+        free(scan.rows);
+        free(scan.row_counts);
+        return 0;
+    }
+
+    parallel_for(num_rows, scan_coarse_row, &scan);
+
+    /* The merge only depends on the candidate order, not on the order the rows finished in */
+    for (row = 0; row < num_rows; row++) {
+        for (k = 0; k < scan.row_counts[row]; k++) {
+            insert_candidate(candidates, &num_candidates, PYRAMID_CANDIDATES, scan.rows + row * PYRAMID_CANDIDATES + k);
+        }
+    }
+
+    free(scan.rows);
+    free(scan.row_counts);
+    return num_candidates;
+}
 
-    res = read_samples(f, &start_buf, info.num_channels, start_offset, info.sample_rate);
-    if (res) {
-        printf("ERROR: start offset is an invalid timestamp!\n");
+/**
+ * Searches for the loop end around an estimate, keeping the loop start fixed
+ * @param samples - The interleaved samples
+ * @param num_frames - The number of frames in samples
+ * @param num_channels - The number of channels
+ * @param start - The loop start frame
+ * @param end - The estimated loop end frame
+ * @param radius - The number of frames to search either side of the estimate
+ * @param duration - The number of frames compared after the start and end
+ * @return The best loop end frame, or the estimate if there is no room to search
+ */
+static unsigned long refine_loop_end(short* samples, unsigned long num_frames, int num_channels, unsigned long start, unsigned long end, unsigned long radius, unsigned long duration)
+{
+    LoopEndSearch search;
+    short* start_ptr;
+    short* end_ptr;
+    unsigned long low = end > radius ? end - radius : 0;
+    unsigned long high = end + radius;
+    unsigned long score;
+
+    if (low <= start) {
+        low = start + 1;
+    }
+    if (duration > num_frames || start + duration > num_frames) {
+        return end;
+    }
+    if (high + duration > num_frames) {
+        high = num_frames - duration;
+    }
+    if (high < low) {
+        return end;
+    }
+
+    start_ptr = samples + start * num_channels;
+    end_ptr = samples + low * num_channels;
+    search.starts = &start_ptr;
+    search.ends = &end_ptr;
+    search.num_parts = 1;
+    search.size = duration * num_channels;
+    search.stride = num_channels;
+    search.num_offsets = high - low + 1;
+    return low + search_loop_end(&search, &score);
+}
+
+/**
+ * Finds the best loop start and end offsets throughout a given sndbuf coarse to fine: the window
+ * search runs on a decimated mono mix, then its best candidates are refined level by level
+ * down to sample accuracy on the full audio
+ * @param buf - The buffer for the samples to search
+ * @param start_offset_buf - Long buffer in which optimal start offset is returned
+ * @param end_offset_buf - Long buffer in which optimal end offset is returned
+ * @param num_channels - Number of channels for this audio track
+ * @param sample_rate - Sample rate of this audio track
+ * @return Whether the search could run (0 if success)
+ */
+int find_loop_points_pyramid(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate)
+{
+    /* Candidate-finding window settings in seconds, as in find_loop_points_auto_offsets */
+    int min_window_size = 10;
+    int max_window_size = 25;
+    int wind_step = 5;
+    int win_size;
+
+    LoopCandidate candidates[PYRAMID_CANDIDATES];
+    int num_candidates;
+    Pyramid pyramid;
+    PyramidLevel* coarse;
+    unsigned long num_frames = buf->size / num_channels;
+    unsigned long step_size;
+    unsigned long radius;
+    unsigned long start, end;
+    unsigned long best_start = 0L;
+    unsigned long best_end = 0L;
+    unsigned long best_score = ULONG_MAX;
+    unsigned long score;
+    int level;
+    int k;
+    PhaseTimer timer;
+
+    log_info("LOOP FINDING START (pyramid) ==============\n");
+
+    start_phase(&timer);
+    if (build_pyramid(buf->data, num_frames, num_channels, sample_rate, &pyramid) != 0) {
+        printf("ERROR: Failed to build the decimation pyramid!\n");
         return 1;
     }
-    res = read_samples(f, &end_buf, info.num_channels, end_offset, 2 * info.sample_rate);
-    if (res) {
-        printf("ERROR: end offset is an invalid timestamp!\n");
-        free(start_buf.data);
+    end_phase("pyramid", &timer);
+    coarse = &pyramid.levels[pyramid.num_levels - 1];
+
+    /* step_size MUST stay within the radius refined at the next level, so the true end is always reached */
+    step_size = coarse->sample_rate / 6;
+    for (win_size = min_window_size; win_size <= max_window_size; win_size += wind_step) {
+        start_phase(&timer);
+        num_candidates = get_coarse_candidates(coarse, win_size * coarse->sample_rate, step_size, candidates);
+        end_phase("search_coarse", &timer);
+
+        start_phase(&timer);
+        for (k = 0; k < num_candidates; k++) {
+            start = candidates[k].start;
+            end = candidates[k].end;
+            /* The coarse end is within half a step of the best one for this start */
+            radius = (step_size / 2 + 1) * PYRAMID_FACTOR;
+
+            /* Scale the pair up a level at a time, searching the end around each estimate,
+            comparing a second of mono mix at the decimated levels and of all channels at the full rate */
+            for (level = pyramid.num_levels - 2; level >= 0; level--) {
+                start *= PYRAMID_FACTOR;
+                end *= PYRAMID_FACTOR;
+                if (level == 0) {
+                    end = refine_loop_end(buf->data, num_frames, num_channels, start, end, radius, sample_rate);
+                } else {
+                    end = refine_loop_end(pyramid.levels[level].samples, pyramid.levels[level].length, 1, start, end, radius, pyramid.levels[level].sample_rate);
+                }
+                radius = PYRAMID_FINE_RADIUS;
+            }
+
+            if (start + sample_rate > num_frames || end + sample_rate > num_frames) {
+                continue;
+            }
+            score = find_difference(buf->data + start * num_channels, buf->data + end * num_channels, sample_rate * num_channels, 1);
+            if (score <= best_score) {
+                log_info("\tNew best start time: %f\n", (float)start / (float)sample_rate);
+                log_info("\tNew best end time: %f\n", (float)end / (float)sample_rate);
+                best_score = score;
+                best_start = start;
+                best_end = end;
+            }
+        }
+        end_phase("refine", &timer);
+    }
+
+    free_pyramid(&pyramid);
+
+    *start_offset_buf = best_start * num_channels;
+    *end_offset_buf = best_end * num_channels;
+
+    log_info("\rLoop finding completed -------------------------\n");
+    log_info("\tBest approx start time: %f\n", (float)best_start / sample_rate);
+    log_info("\tBest approx end time: %f\n", (float)best_end / sample_rate);
+    return 0;
+}
+
+/**
+ * State of the self-similarity search over feature frames, run in blocks of diagonals
+ */
+typedef struct {
+    const short* features;
+    unsigned long num_frames;
+    unsigned long window_size;
+    unsigned long num_lags;
+    /* FEATURE_CANDIDATES best pairs of each block, best first */
+    LoopCandidate* blocks;
+    int* block_counts;
+    int failed;
+} FeatureScan;
+
+/**
+ * Scores every start of a block of loop lengths. Along each diagonal of the self-similarity
+ * the distance of every frame pair is computed once, and the window sums slide over them
+ * @param arg - The pointer to the FeatureScan
+ * @param index - The index of the block
+ */
+static void scan_feature_lags(void* arg, unsigned long index)
+{
+    FeatureScan* scan = (FeatureScan*) arg;
+    LoopCandidate* best = scan->blocks + index * FEATURE_CANDIDATES;
+    LoopCandidate candidate;
+    LoopCandidate lag_best;
+    unsigned long first = index * FEATURE_LAG_CHUNK;
+    unsigned long last = first + FEATURE_LAG_CHUNK;
+    unsigned long window = scan->window_size;
+    unsigned long lag, start, length;
+    unsigned long sum;
+    unsigned long num_candidates = 0;
+    unsigned long* dist;
+
+    scan->block_counts[index] = 0;
+    if (last > scan->num_lags) {
+        last = scan->num_lags;
+    }
+    dist = (unsigned long*) malloc(scan->num_frames * sizeof(unsigned long));
+    if (dist == NULL) {
+        scan->failed = 1;
+        return;
+    }
+
+    for (lag = window + first; lag < window + last; lag++) {
+        /* frames of the diagonal, the last window of them ending at the last frame */
+        length = scan->num_frames - lag;
+        for (start = 0; start < length; start++) {
+            dist[start] = sum_abs_diff_s16(scan->features + start * FEATURE_SIZE, scan->features + (start + lag) * FEATURE_SIZE, FEATURE_SIZE);
+        }
+
+        /* Keep the best start of each loop length, so neighbouring starts do not crowd out other lengths */
+        sum = 0;
+        for (start = 0; start < window; start++) {
+            sum += dist[start];
+        }
+        lag_best.start = 0;
+        lag_best.end = lag;
+        lag_best.score = sum;
+        for (start = 1; start + window <= length; start++) {
+            sum += dist[start + window - 1] - dist[start - 1];
+            candidate.start = start;
+            candidate.end = start + lag;
+            candidate.score = sum;
+            if (is_better_candidate(&candidate, &lag_best)) {
+                lag_best = candidate;
+            }
+        }
+        num_candidates += length - window + 1;
+        insert_candidate(best, &scan->block_counts[index], FEATURE_CANDIDATES, &lag_best);
+    }
+
+    count_candidates(num_candidates);
+    free(dist);
+}
+
+/**
+ * Finds the best candidates of one window size in the self-similarity of the features
+ * @param features - The features to search
+ * @param window_size - Size of the compared windows in feature frames
+ * @param candidates - The buffer for up to FEATURE_CANDIDATES candidates in feature frames, best first
+ * @return The number of candidates found
+ */
+static int get_feature_candidates(featurebuf* features, unsigned long window_size, LoopCandidate* candidates)
+{
+    FeatureScan scan;
+    unsigned long num_blocks;
+    unsigned long block;
+    int num_candidates = 0;
+    int k;
+
+    if (window_size == 0 || 2 * window_size > features->num_frames) {
+        /* track too short for this window size */
+        return 0;
+    }
+
+    scan.features = features->data;
+    scan.num_frames = features->num_frames;
+    scan.window_size = window_size;
+    scan.num_lags = features->num_frames - 2 * window_size + 1;
+    scan.failed = 0;
+    num_blocks = (scan.num_lags + FEATURE_LAG_CHUNK - 1) / FEATURE_LAG_CHUNK;
+    scan.blocks = (LoopCandidate*) malloc(num_blocks * FEATURE_CANDIDATES * sizeof(LoopCandidate));
+    scan.block_counts = (int*) malloc(num_blocks * sizeof(int));
+    if (scan.blocks == NULL || scan.block_counts == NULL) {
+        printf("ERROR: Failed to allocate the feature search!\n");
+        free(scan.blocks);
+        free(scan.block_counts);
+        return 0;
+    }
+
+    parallel_for(num_blocks, scan_feature_lags, &scan);
+    if (scan.failed) {
+        printf("ERROR: Failed to allocate the feature search!\n");
+    }
+
+    for (block = 0; block < num_blocks && !scan.failed; block++) {
+        for (k = 0; k < scan.block_counts[block]; k++) {
+            insert_candidate(candidates, &num_candidates, FEATURE_CANDIDATES, scan.blocks + block * FEATURE_CANDIDATES + k);
+        }
+    }
+
+    free(scan.blocks);
+    free(scan.block_counts);
+    return num_candidates;
+}
+
+/**
+ * Finds the best loop start and end offsets throughout a given sndbuf by the similarity of
+ * chroma and loudness features, refining only the best candidates on the samples
+ * @param buf - The buffer for the samples to search
+ * @param start_offset_buf - Long buffer in which optimal start offset is returned
+ * @param end_offset_buf - Long buffer in which optimal end offset is returned
+ * @param num_channels - Number of channels for this audio track
+ * @param sample_rate - Sample rate of this audio track
+ * @return Whether the search could run (0 if success)
+ */
+int find_loop_points_features(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate)
+{
+    /* Candidate-finding window settings in seconds, as in find_loop_points_auto_offsets */
+    int min_window_size = 10;
+    int max_window_size = 25;
+    int wind_step = 5;
+    int win_size;
+
+    LoopCandidate candidates[FEATURE_CANDIDATES];
+    int num_candidates;
+    featurebuf features;
+    unsigned long num_frames = buf->size / num_channels;
+    unsigned long start, end;
+    unsigned long best_start = 0L;
+    unsigned long best_end = 0L;
+    unsigned long best_score = ULONG_MAX;
+    unsigned long score;
+    int k;
+    PhaseTimer timer;
+
+    log_info("LOOP FINDING START (features) ==============\n");
+
+    start_phase(&timer);
+    if (compute_features(buf->data, num_frames, num_channels, sample_rate, &features) != 0) {
+        printf("ERROR: Failed to compute the audio features!\n");
         return 1;
     }
+    end_phase("features", &timer);
+
+    for (win_size = min_window_size; win_size <= max_window_size; win_size += wind_step) {
+        start_phase(&timer);
+        num_candidates = get_feature_candidates(&features, win_size * FEATURE_FRAME_RATE, candidates);
+        end_phase("search_features", &timer);
+
+        start_phase(&timer);
+        for (k = 0; k < num_candidates; k++) {
+            start = candidates[k].start * features.hop_size;
+            end = candidates[k].end * features.hop_size;
+
+            /* Half a second back then a second forward, since find_loop_end looks forward only */
+            end = end < (unsigned long) sample_rate / 2 ? 0 : end - sample_rate / 2;
+            if (end <= start || end + 2 * sample_rate > num_frames) {
+                continue;
+            }
+            end += find_loop_end_short_arr(
+                        buf->data + start * num_channels, sample_rate * num_channels,
+                        buf->data + end * num_channels, 2 * sample_rate * num_channels,
+                        num_channels);
+
+            score = find_difference(buf->data + start * num_channels, buf->data + end * num_channels, sample_rate * num_channels, 1);
+            if (score <= best_score) {
+                log_info("\tNew best start time: %f\n", (float)start / (float)sample_rate);
+                log_info("\tNew best end time: %f\n", (float)end / (float)sample_rate);
+                best_score = score;
+                best_start = start;
+                best_end = end;
+            }
+        }
+        end_phase("refine", &timer);
+    }
 
-    /* Find looping point */
-    end_offset += find_loop_end(&start_buf, &end_buf, info.num_channels);
+    free_features(&features);
 
-    /* Store the data for a loop */
-    loop_size = end_offset - start_offset;
-    read_samples(f, &loop_buf, info.num_channels, start_offset, loop_size);
+    *start_offset_buf = best_start * num_channels;
+    *end_offset_buf = best_end * num_channels;
+
+    log_info("\rLoop finding completed -------------------------\n");
+    log_info("\tBest approx start time: %f\n", (float)best_start / sample_rate);
+    log_info("\tBest approx end time: %f\n", (float)best_end / sample_rate);
+    return 0;
+}
+
+/**
+ * Finds the best loop start and end offsets throughout a given sndbuf from an index of spectral
+ * landmarks: the loop lengths at which most landmarks repeat are proposed in roughly linear time,
+ * then each is placed where it repeats most and refined on the samples
+ * @param buf - The buffer for the samples to search
+ * @param start_offset_buf - Long buffer in which optimal start offset is returned
+ * @param end_offset_buf - Long buffer in which optimal end offset is returned
+ * @param num_channels - Number of channels for this audio track
+ * @param sample_rate - Sample rate of this audio track
+ * @return Whether the search could run (0 if success)
+ */
+int find_loop_points_fingerprint(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate)
+{
+    /* Shortest loop proposed and the window its start is placed with, in seconds */
+    int min_window_size = 10;
 
-    /* Store the data for the intro */
-    read_samples(f, &intro_buf, info.num_channels, 0, start_offset);
+    FingerprintIndex index;
+    LoopCandidate lags[FINGERPRINT_CANDIDATES];
+    LoopCandidate refined[FINGERPRINT_CANDIDATES];
+    LoopCandidate* sorted;
+    CandidateRefinement refinement;
+    planarbuf planar;
+    unsigned long* votes;
+    unsigned long num_frames = buf->size / num_channels;
+    unsigned long min_lag;
+    unsigned long lag, start, end, count;
+    unsigned long best_start = 0L;
+    unsigned long best_end = 0L;
+    unsigned long best_score = ULONG_MAX;
+    int num_lags;
+    int num_refined = 0;
+    int k;
+    PhaseTimer timer;
 
-    /* Store the data for the ending */
-    ending_size = f->num_frames / info.num_channels - end_offset;
-    read_samples(f, &ending_buf, info.num_channels, end_offset, ending_size);
+    log_info("LOOP FINDING START (fingerprint) ==============\n");
 
-    /* Compute number of loops */
-    num_loops = (min_length * info.sample_rate - start_offset - ending_size) / loop_size + 1;
-    printf("Number of loops: %d\n", num_loops);
+    start_phase(&timer);
+    if (build_fingerprint_index(buf->data, num_frames, num_channels, sample_rate, &index) != 0) {
+        printf("ERROR: Failed to build the fingerprint index!\n");
+        return 1;
+    }
+    end_phase("fingerprint", &timer);
+    log_info("\tLandmarks: %lu\n", index.num_landmarks);
 
-    /* Create buffer for extended audio */
-    extend_audio(&extended_buf, &intro_buf, &loop_buf, &ending_buf, num_loops);
+    start_phase(&timer);
+    votes = (unsigned long*) malloc((index.num_frames + 1) * sizeof(unsigned long));
+    sorted = (LoopCandidate*) malloc((index.num_frames + 1) * sizeof(LoopCandidate));
+    if (votes == NULL || sorted == NULL) {
+        printf("ERROR: Failed to allocate the fingerprint votes!\n");
+        free(votes);
+        free(sorted);
+        free_fingerprint_index(&index);
+        return 1;
+    }
+    min_lag = min_window_size * FINGERPRINT_FRAME_RATE;
+    vote_lags(&index, min_lag, votes);
 
-    /* Write buffer into new file */
-    fout->unscaled_frames = extended_buf.data;
-    fout->num_frames = extended_buf.size;
-    fout->headers.data_chunk_size = extended_buf.size * 2;
-    fout->headers.chunk_size = 28 + fout->headers.sub_chunk1_size + fout->headers.sub_chunk2_size +
-                                fout->headers.data_chunk_size;
+    /* Votes of neighbouring lags count too, the peaks of a repeat can land a frame apart */
+    for (lag = 0; lag < index.num_frames; lag++) {
+        count = votes[lag] + (lag > 0 ? votes[lag - 1] : 0) + (lag + 1 < index.num_frames ? votes[lag + 1] : 0);
+        sorted[lag].start = 0;
+        sorted[lag].end = lag;
+        sorted[lag].score = lag < min_lag || count == 0 ? ULONG_MAX : ULONG_MAX - 1 - count;
+    }
+    qsort(sorted, index.num_frames, sizeof(LoopCandidate), compare_candidates);
+    num_lags = pick_distinct_candidates(sorted, index.num_frames, FINGERPRINT_LAG_SPACING * FINGERPRINT_FRAME_RATE, lags, FINGERPRINT_CANDIDATES);
+    free(votes);
+    free(sorted);
 
-    /* Clean up */
-    free(start_buf.data);
-    free(end_buf.data);
-    free(intro_buf.data);
-    free(loop_buf.data);
-    free(ending_buf.data);
+    /* Place each loop length where most of its landmarks repeat, keeping room to refine the end */
+    for (k = 0; k < num_lags; k++) {
+        lag = lags[k].end;
+        start = find_lag_start(&index, lag, min_window_size * FINGERPRINT_FRAME_RATE, &count) * index.hop_size;
+        end = start + lag * index.hop_size;
+        log_info("\tProposed loop: %f -> %f (%lu repeats)\n", (float)start / sample_rate, (float)end / sample_rate, count);
+        if (count == 0 || end + 2 * (unsigned long) sample_rate > num_frames) {
+            continue;
+        }
+        refined[num_refined].start = start;
+        refined[num_refined].end = end;
+        refined[num_refined].score = ULONG_MAX;
+        num_refined++;
+    }
+    free_fingerprint_index(&index);
+    end_phase("search_votes", &timer);
+
+    /* Refine every proposal at once on the planar samples, searching from half a second before its end */
+    start_phase(&timer);
+    if (make_planar(buf->data, buf->size, num_channels, &planar) != 0) {
+        printf("ERROR: Failed to allocate the planar samples!\n");
+        return 1;
+    }
+    refinement.buf = &planar;
+    refinement.sample_rate = sample_rate;
+    refinement.step_size = sample_rate;
+    refinement.candidates = refined;
+    parallel_for(num_refined, refine_candidate, &refinement);
+    free_planar(&planar);
+    end_phase("refine", &timer);
+
+    for (k = 0; k < num_refined; k++) {
+        if (refined[k].score <= best_score) {
+            log_info("\tNew best start time: %f\n", (float)refined[k].start / (float)sample_rate);
+            log_info("\tNew best end time: %f\n", (float)refined[k].end / (float)sample_rate);
+            best_score = refined[k].score;
+            best_start = refined[k].start * num_channels;
+            best_end = refined[k].end * num_channels;
+        }
+    }
+
+    *start_offset_buf = best_start;
+    *end_offset_buf = best_end;
+
+    log_info("\rLoop finding completed -------------------------\n");
+    log_info("\tBest approx start time: %f\n", (float)best_start / sample_rate / num_channels);
+    log_info("\tBest approx end time: %f\n", (float)best_end / sample_rate / num_channels);
     return 0;
 }
 
 /* TODO: add docs, add loop length*/
-int auto_loop(FILE* fp, FILE* fpout, unsigned long min_length)
+int auto_loop(FILE* fp, FILE* fpout, unsigned long min_length, LoopPlan* plan_buf)
 {
-    clock_t t;
+    PhaseTimer timer;
     sndbuf all_smpl_buf;
+    planarbuf planar;
     unsigned long start_offset;
     unsigned long end_offset;
+    unsigned long duration;
     WavFile file;
-    WavFile loop_file;
+    LoopPlan plan;
+    SearchLimits limits;
+    SearchResult result;
+    CacheKey key;
+    CacheEntry entry;
+    int cached = 0;
+    int exhaustive = 1;
+    int res;
 
-    file = read_frames(fp);
-    loop_file.headers = file.headers;
+    start_phase(&timer);
+    res = read_frames(fp, &file);
+    end_phase("parse", &timer);
+    if (res != 0) {
+        fclose(fpout);
+        fclose(fp);
+        return 1;
+    }
+
+    /* Auto looping, searching the samples in place */
+    all_smpl_buf.data = file.unscaled_frames;
+    all_smpl_buf.size = file.num_frames;
+
+    /* The loop points only depend on the samples, a track rendered again skips the search */
+    if (settings.cache_dir != NULL) {
+        start_phase(&timer);
+        init_cache_key(&key, all_smpl_buf.data, all_smpl_buf.size, file.headers.num_channels, file.headers.sample_rate, settings.engine);
+        cached = read_cache(settings.cache_dir, &key, &entry) == 0;
+        end_phase("cache", &timer);
+    }
 
-    /* Auto looping*/
-    read_samples(&file, &all_smpl_buf, file.headers.num_channels, 0uL, file.num_frames / file.headers.num_channels);
+    if (cached) {
+        start_offset = entry.start;
+        end_offset = entry.end;
+        log_info("Loop points read from the cache\n");
+        log_info("\tBest approx start time: %f\n", (float)start_offset / file.headers.sample_rate / file.headers.num_channels);
+        log_info("\tBest approx end time: %f\n", (float)end_offset / file.headers.sample_rate / file.headers.num_channels);
+        log_info("\tScore: %lu\n", entry.score);
+    } else {
+        start_phase(&timer);
+        res = 0;
+        if (settings.engine == ENGINE_PYRAMID) {
+            res = find_loop_points_pyramid(&all_smpl_buf, &start_offset, &end_offset, file.headers.num_channels, file.headers.sample_rate);
+        } else if (settings.engine == ENGINE_FINGERPRINT) {
+            res = find_loop_points_fingerprint(&all_smpl_buf, &start_offset, &end_offset, file.headers.num_channels, file.headers.sample_rate);
+        } else if (settings.engine == ENGINE_FEATURES) {
+            res = find_loop_points_features(&all_smpl_buf, &start_offset, &end_offset, file.headers.num_channels, file.headers.sample_rate);
+        } else if (make_planar(all_smpl_buf.data, all_smpl_buf.size, file.headers.num_channels, &planar) != 0) {
+            printf("ERROR: Failed to allocate the planar samples!\n");
+            res = 1;
+        } else {
+            /* the window search compares every channel, one contiguous array per channel */
+            init_search_limits(&limits);
+            limits.deadline = settings.deadline;
+            limits.accept_score = settings.accept_score;
+            res = find_loop_points_search(&planar, file.headers.sample_rate, &limits, &result);
+            free_planar(&planar);
+            start_offset = result.start * file.headers.num_channels;
+            end_offset = result.end * file.headers.num_channels;
+            exhaustive = result.exhaustive;
+        }
+        log_info("Loop finding Time taken: %fs\n", get_elapsed_time(&timer));
+        if (res != 0) {
+            /* the engine could not allocate its samples, pyramid, features or index, the offsets were never written */
+            printf("ERROR: The loop search failed!\n");
+            fclose(fpout);
+            fclose(fp);
+            free_wav_file(file);
+            return 1;
+        }
 
-    t = clock();
-    find_loop_points_auto_offsets(&all_smpl_buf, &start_offset, &end_offset, file.headers.num_channels, file.headers.sample_rate);
-    t = clock() - t;
-    printf("Loop finding Time taken: %fs\n", ((double)t) / CLOCKS_PER_SEC);
+        /* Loop points of a search stopped early could be bettered by the next run */
+        if (settings.cache_dir != NULL && exhaustive && start_offset < end_offset) {
+            start_phase(&timer);
+            duration = file.headers.sample_rate * file.headers.num_channels;
+            entry.start = start_offset;
+            entry.end = end_offset;
+            entry.score = end_offset + duration <= all_smpl_buf.size
+                ? find_difference(all_smpl_buf.data + start_offset, all_smpl_buf.data + end_offset, duration, 1) : ULONG_MAX;
+            if (write_cache(settings.cache_dir, &key, &entry) != 0) {
+                printf("WARNING: Failed to write to the cache in %s!\n", settings.cache_dir);
+            }
+            end_phase("cache", &timer);
+        }
+    }
 
-    t = clock();
-    loop_with_offsets(&file, start_offset / file.headers.num_channels, end_offset / file.headers.num_channels, min_length, &loop_file);
-    t = clock() - t;
-    printf("Looping Time taken: %fs\n", ((double)t) / CLOCKS_PER_SEC);
+    start_phase(&timer);
+    res = plan_loop(&file, start_offset / file.headers.num_channels, end_offset / file.headers.num_channels, min_length, &plan);
+    end_phase("refine", &timer);
+    if (res == 0) {
+        /* Stream the extended audio straight from the input samples */
+        start_phase(&timer);
+        res = settings.copy_range ? copy_loop_wav(fpout, fp, &file, &plan) : write_loop_wav(fpout, &file, &plan);
+        end_phase("render", &timer);
+        if (plan_buf != NULL) {
+            *plan_buf = plan;
+        }
+    } else {
+        printf("ERROR: Failed to loop the audio!\n");
+    }
 
-    write_wav(fpout, loop_file);
     fclose(fpout);
     fclose(fp);
+    free_wav_file(file);
 
-    return 0;
+    return res;
 }
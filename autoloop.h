@@ -1,11 +1,70 @@
+/**
+ * A candidate pair of loop points with its score, lower is better
+ */
+typedef struct loop_candidate {
+    unsigned long start;
+    unsigned long end;
+    unsigned long score;
+} LoopCandidate;
+
+/**
+ * Progress callback of a loop search, called from the calling thread between batches of work
+ * @param arg - The argument given with the callback
+ * @param stage - The stage of the search, "search" for the window scan or "refine"
+ * @param fraction - The fraction of the stage done, 1 once it is complete
+ * @return Nonzero to cancel the search, which then returns the best loop found so far
+ */
+typedef int (*search_progress_fn)(void* arg, const char* stage, double fraction);
+
+/**
+ * Limits of an anytime loop search
+ */
+typedef struct search_limits {
+    /* seconds after which the search returns its best loop so far, 0 for none */
+    double deadline;
+    /* stop once a refined loop scores below this, 0 for never */
+    unsigned long accept_score;
+    /* progress callback, NULL for none */
+    search_progress_fn progress;
+    void* progress_arg;
+} SearchLimits;
+
+/**
+ * The best loop of a search in frames, and whether every candidate was scored to find it
+ */
+typedef struct search_result {
+    unsigned long start;
+    unsigned long end;
+    unsigned long score;
+    int exhaustive;
+} SearchResult;
+
 unsigned long find_difference(short* start_buf, short* end_buf, int window_size, unsigned long step_size);
 
-int get_window_score(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate, unsigned long window_size, unsigned long step_size);
+unsigned long find_difference_planar(const planarbuf* buf, unsigned long start, unsigned long end, unsigned long window_size, unsigned long step_size);
+
+int is_better_candidate(const LoopCandidate* a, const LoopCandidate* b);
+
+void insert_candidate(LoopCandidate* candidates, int* num_candidates, int max_candidates, const LoopCandidate* candidate);
+
+int log_search_progress(void* arg, const char* stage, double fraction);
+
+void init_search_limits(SearchLimits* limits);
+
+int get_window_scores(const planarbuf* buf, const unsigned long* window_sizes, int num_windows, unsigned long step_size, int max_candidates, LoopCandidate* candidates, int* num_candidates);
+
+int get_window_score(const planarbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int sample_rate, unsigned long window_size, unsigned long step_size);
 
 int find_loop_points_auto(sndbuf* buf, unsigned int* start_time_buf, unsigned int* end_time_buf, int num_channels, int sample_rate);
 
+int find_loop_points_search(const planarbuf* buf, int sample_rate, const SearchLimits* limits, SearchResult* result);
+
 int find_loop_points_auto_offsets(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate);
 
-int loop_with_offsets (WavFile* f, unsigned long start_offset, unsigned long end_offset, unsigned int min_length, WavFile* fout);
+int find_loop_points_pyramid(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate);
+
+int find_loop_points_features(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate);
+
+int find_loop_points_fingerprint(sndbuf* buf, unsigned long* start_offset_buf, unsigned long* end_offset_buf, int num_channels, int sample_rate);
 
-int auto_loop (FILE* fp, FILE* fpout, unsigned long min_length);
+int auto_loop (FILE* fp, FILE* fpout, unsigned long min_length, LoopPlan* plan_buf);
@@ -0,0 +1,438 @@
+/**
+ * @file batch.c
+ * @brief Runs of one track, and batches of tracks from a manifest sharing the thread pool
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "parse_wav.h"
+#include "planar.h"
+#include "mmap_wav.h"
+#include "loop.h"
+#include "render.h"
+#include "autoloop.h"
+#include "fsm.h"
+#include "settings.h"
+#include "threadpool.h"
+#include "report.h"
+#include "batch.h"
+
+/**
+ * One line of a manifest, tokenised in place
+ */
+typedef struct batch_job {
+    char* line;
+    char* args[BATCH_MAX_ARGS];
+    int num_args;
+    unsigned long line_number;
+    /* estimated peak memory of the job in bytes */
+    unsigned long memory;
+} BatchJob;
+
+/**
+ * Shared state of the job runners of run_batch
+ */
+typedef struct {
+    BatchJob* jobs;
+    unsigned long num_jobs;
+    /* next job to hand out */
+    unsigned long next_job;
+    unsigned long num_failed;
+    /* memory budget in bytes, 0 for none, and the estimates of the running jobs */
+    unsigned long budget;
+    unsigned long reserved;
+    pthread_mutex_t lock;
+    /* signalled whenever a job finishes and releases its memory */
+    pthread_cond_t released;
+} Batch;
+
+/**
+ * Checks the times of a job
+ * @param args - INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME END_TIME]
+ * @param num_args - The number of arguments, 3 or 5
+ * @return Whether the times are valid (0 if valid)
+ */
+static int check_job_times (char** args, int num_args) {
+    NumFSM numFsm;
+
+    /* Check min length */
+    initNumFSM(&numFsm);
+    if (!runNumFsm(&numFsm, args[2])) {
+        printf("ERROR: Invalid min length!\n");
+        return 1;
+    }
+
+    if (num_args > 3) {
+        /* Check start time */
+        initNumFSM(&numFsm);
+        if (!runNumFsm(&numFsm, args[3])) {
+            printf("ERROR: Invalid start time!\n");
+            return 1;
+        }
+
+        /* Check end time */
+        initNumFSM(&numFsm);
+        if (!runNumFsm(&numFsm, args[4])) {
+            printf("ERROR: Invalid end time!\n");
+            return 1;
+        }
+
+        if (strtoul(args[3], NULL, 10) > strtoul(args[4], NULL, 10)) {
+            printf("ERROR: Start time is after end time!\n");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Extends one track: validates the arguments, then loops the track either at the given times
+ * or at the loop points found by the automatic mode
+ * @param args - INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME END_TIME]
+ * @param num_args - The number of arguments, 3 or 5
+ * @param fp - The already open input, read instead of INPUT_FILE, or NULL. Closed by the call
+ * @param fpout - The already open output, written instead of OUTPUT_FILE, or NULL. Closed by the call
+ * @param plan_buf - Buffer in which the loop of the extended track is returned, or NULL
+ * @return Whether the track was extended (0 if success)
+ */
+int run_job_files (char** args, int num_args, FILE* fp, FILE* fpout, LoopPlan* plan_buf) {
+    unsigned long start_time = 0, end_time = 0, min_length;
+    int res;
+    WavFile f;
+    LoopPlan plan;
+    FileExtFSM fileExtFsm;
+    PhaseTimer timer;
+
+    res = check_job_times(args, num_args);
+    if (res == 0 && fp == NULL) {
+        /* Check read file, - streams the wav data from stdin */
+        initFileExtFSM(&fileExtFsm);
+        if (strcmp(args[0], "-") == 0) {
+            fp = stdin;
+        } else if (!runFileExtFsm(&fileExtFsm, args[0])) {
+            printf("ERROR: File extension of %s is not .wav!\n", args[0]);
+            res = 1;
+        } else if ((fp = fopen(args[0], "r")) == NULL) {
+            printf("ERROR: Failed to open %s!\n", args[0]);
+            res = 1;
+        }
+    }
+
+    if (res == 0 && fpout == NULL) {
+        /* Check write file */
+        initFileExtFSM(&fileExtFsm);
+        if (!runFileExtFsm(&fileExtFsm, args[1])) {
+            printf("ERROR: File extension of %s is not .wav!\n", args[1]);
+            res = 1;
+        } else if ((fpout = fopen(args[1], "w")) == NULL) {
+            printf("ERROR: Failed to open %s!\n", args[1]);
+            res = 1;
+        }
+    }
+
+    if (res != 0) {
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        if (fpout != NULL) {
+            fclose(fpout);
+        }
+        return 1;
+    }
+
+    min_length = strtoul(args[2], NULL, 10);
+    if (num_args == 3) {
+        return auto_loop(fp, fpout, min_length, plan_buf);
+    }
+    start_time = strtoul(args[3], NULL, 10);
+    end_time = strtoul(args[4], NULL, 10);
+
+    /* Extend audio, streaming it into the new file */
+    start_phase(&timer);
+    res = read_frames(fp, &f);
+    end_phase("parse", &timer);
+    if (res != 0) {
+        fclose(fp);
+        fclose(fpout);
+        return 1;
+    }
+
+    start_phase(&timer);
+    res = plan_loop(&f, start_time * f.headers.sample_rate, end_time * f.headers.sample_rate, min_length, &plan);
+    if (res == LOOP_INVALID_START) {
+        printf("ERROR: %lu is an invalid timestamp!\n", start_time);
+    } else if (res == LOOP_INVALID_END) {
+        printf("ERROR: %lu is an invalid timestamp!\n", end_time);
+    } else if (res == LOOP_EMPTY) {
+        printf("ERROR: The loop is empty!\n");
+    }
+    end_phase("refine", &timer);
+
+    if (res == 0) {
+        start_phase(&timer);
+        res = settings.copy_range ? copy_loop_wav(fpout, fp, &f, &plan) : write_loop_wav(fpout, &f, &plan);
+        end_phase("render", &timer);
+        if (plan_buf != NULL) {
+            *plan_buf = plan;
+        }
+    }
+
+    /* Clean up */
+    fclose(fp);
+    fclose(fpout);
+    free_wav_file(f);
+    return res != 0;
+}
+
+/**
+ * Extends one track given by paths
+ * @param args - INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME END_TIME]
+ * @param num_args - The number of arguments, 3 or 5
+ * @return Whether the track was extended (0 if success)
+ */
+int run_job (char** args, int num_args) {
+    return run_job_files(args, num_args, NULL, NULL, NULL);
+}
+
+/**
+ * Splits a job line in place into its fields, separated by spaces or tabs
+ * @param line - The line, without leading blanks
+ * @param args - Buffer for BATCH_MAX_ARGS fields
+ * @return The number of fields, BATCH_MAX_ARGS + 1 if there are more
+ */
+int split_job_line (char* line, char** args) {
+    int num_args = 0;
+
+    while (*line != '\0') {
+        if (num_args == BATCH_MAX_ARGS) {
+            return num_args + 1;
+        }
+        args[num_args++] = line;
+        line += strcspn(line, " \t\r\n");
+        if (*line != '\0') {
+            *line++ = '\0';
+            line += strspn(line, " \t\r\n");
+        }
+    }
+    return num_args;
+}
+
+/**
+ * Estimates the peak memory of a job from the header of its input file: the data chunk, mapped
+ * or read, BATCH_INT16_COPIES int16 copies of its samples and the render buffer
+ * @param path - The path of the input file
+ * @return The estimate in bytes, 0 if the header could not be read
+ */
+static unsigned long estimate_job_memory (const char* path) {
+    WavHeaders headers;
+    unsigned long bytes_per_sample;
+    unsigned long data_size;
+    FILE* fp;
+    int res;
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+    /* same chunk walk as the reader, so RF64 sizes and truncated data chunks agree with it */
+    res = map_wav_headers(fp, &headers);
+    fclose(fp);
+    if (res != 0) {
+        return 0;
+    }
+    bytes_per_sample = ((unsigned long) headers.bits_per_sample + 7) / 8;
+    data_size = (unsigned long) headers.data_chunk_size;
+    free_wav_headers(headers);
+    free(headers.data_header);
+    if (bytes_per_sample == 0) {
+        return 0;
+    }
+    return data_size + BATCH_INT16_COPIES * sizeof(short) * (data_size / bytes_per_sample) + COPY_BUFFER_SIZE;
+}
+
+/**
+ * Reads a manifest: one job per line, INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME END_TIME]
+ * separated by spaces or tabs. Blank lines and lines starting with # are skipped
+ * @param path - The path of the manifest
+ * @param jobs_buf - Buffer in which the jobs are returned, to be freed with free_jobs
+ * @param num_jobs_buf - Buffer in which the number of jobs is returned
+ * @return Whether the manifest could be read (0 if success)
+ */
+static int read_manifest (const char* path, BatchJob** jobs_buf, unsigned long* num_jobs_buf) {
+    char buf[BATCH_LINE_SIZE];
+    BatchJob* jobs = NULL;
+    BatchJob* grown;
+    BatchJob* job;
+    unsigned long num_jobs = 0;
+    unsigned long capacity = 0;
+    unsigned long line_number = 0;
+    char* p;
+    FILE* fp;
+    int res = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        printf("ERROR: Failed to open the manifest %s!\n", path);
+        return 1;
+    }
+
+    while (fgets(buf, BATCH_LINE_SIZE, fp) != NULL) {
+        line_number++;
+        if (strchr(buf, '\n') == NULL && !feof(fp)) {
+            printf("ERROR: Line %lu of the manifest is too long!\n", line_number);
+            res = 1;
+            break;
+        }
+        p = buf + strspn(buf, " \t\r\n");
+        if (*p == '\0' || *p == '#') {
+            continue;
+        }
+
+        if (num_jobs == capacity) {
+            capacity = capacity == 0 ? 64 : 2 * capacity;
+            grown = (BatchJob*) realloc(jobs, capacity * sizeof(BatchJob));
+            if (grown == NULL) {
+                printf("ERROR: Failed to allocate the jobs of the manifest!\n");
+                res = 1;
+                break;
+            }
+            jobs = grown;
+        }
+        job = &jobs[num_jobs];
+        job->line = (char*) malloc(strlen(p) + 1);
+        if (job->line == NULL) {
+            printf("ERROR: Failed to allocate the jobs of the manifest!\n");
+            res = 1;
+            break;
+        }
+        strcpy(job->line, p);
+        num_jobs++;
+
+        job->num_args = split_job_line(job->line, job->args);
+        job->line_number = line_number;
+        if (job->num_args != 3 && job->num_args != 5) {
+            printf("ERROR: Line %lu of the manifest needs INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME END_TIME]!\n", line_number);
+            res = 1;
+            break;
+        }
+
+        job->memory = strcmp(job->args[0], "-") != 0 ? estimate_job_memory(job->args[0]) : 0;
+    }
+    fclose(fp);
+
+    *jobs_buf = jobs;
+    *num_jobs_buf = num_jobs;
+    return res;
+}
+
+/**
+ * Frees the jobs of a manifest
+ * @param jobs - The jobs
+ * @param num_jobs - The number of jobs
+ */
+static void free_jobs (BatchJob* jobs, unsigned long num_jobs) {
+    unsigned long k;
+
+    for (k = 0; k < num_jobs; k++) {
+        free(jobs[k].line);
+    }
+    free(jobs);
+}
+
+/**
+ * Job runner body: takes the jobs in manifest order, each once its memory estimate fits in
+ * the budget next to the running jobs, and prints a status line when it finishes. A job over
+ * the whole budget runs on its own
+ * @param arg - The pointer to the Batch
+ */
+static void* run_jobs (void* arg) {
+    Batch* batch = (Batch*) arg;
+    BatchJob* job;
+    PhaseTimer timer;
+    double seconds;
+    int res;
+
+    pthread_mutex_lock(&batch->lock);
+    while (batch->next_job < batch->num_jobs) {
+        job = &batch->jobs[batch->next_job++];
+        while (batch->budget > 0 && batch->reserved > 0 && batch->reserved + job->memory > batch->budget) {
+            pthread_cond_wait(&batch->released, &batch->lock);
+        }
+        batch->reserved += job->memory;
+        pthread_mutex_unlock(&batch->lock);
+
+        start_phase(&timer);
+        res = run_job(job->args, job->num_args);
+        seconds = get_elapsed_time(&timer);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->reserved -= job->memory;
+        pthread_cond_broadcast(&batch->released);
+        if (res != 0) {
+            batch->num_failed++;
+        }
+        printf("%lu\t%s\t%d\t%.3f\t%s\t%s\n", job->line_number, res == 0 ? "ok" : "failed", res, seconds, job->args[0], job->args[1]);
+        fflush(stdout);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+/**
+ * Extends every track of a manifest in one process. Up to settings.num_jobs tracks run at
+ * once, each searching on the shared thread pool, within settings.memory_budget
+ * @param path - The path of the manifest
+ * @return Whether every job succeeded (0 if success)
+ */
+int run_batch (const char* path) {
+    Batch batch;
+    pthread_t* runners;
+    int num_runners, started, k;
+    int quiet;
+
+    if (read_manifest(path, &batch.jobs, &batch.num_jobs) != 0) {
+        free_jobs(batch.jobs, batch.num_jobs);
+        return 1;
+    }
+
+    num_runners = settings.num_jobs > 0 ? settings.num_jobs : get_num_threads();
+    if ((unsigned long) num_runners > batch.num_jobs) {
+        num_runners = batch.num_jobs > 0 ? (int) batch.num_jobs : 1;
+    }
+    runners = (pthread_t*) malloc(num_runners * sizeof(pthread_t));
+    if (runners == NULL) {
+        printf("ERROR: Failed to allocate the job runners!\n");
+        free_jobs(batch.jobs, batch.num_jobs);
+        return 1;
+    }
+
+    batch.next_job = 0;
+    batch.num_failed = 0;
+    batch.budget = settings.memory_budget * 1024UL * 1024UL;
+    batch.reserved = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.released, NULL);
+
+    quiet = silence_progress();
+    for (started = 0; started < num_runners - 1; started++) {
+        if (pthread_create(&runners[started], NULL, run_jobs, &batch) != 0) {
+            break;
+        }
+    }
+    /* the calling thread is one of the runners */
+    run_jobs(&batch);
+    for (k = 0; k < started; k++) {
+        pthread_join(runners[k], NULL);
+    }
+    restore_progress(quiet);
+
+    log_info("Batch completed: %lu jobs, %lu failed\n", batch.num_jobs, batch.num_failed);
+
+    pthread_cond_destroy(&batch.released);
+    pthread_mutex_destroy(&batch.lock);
+    free(runners);
+    free_jobs(batch.jobs, batch.num_jobs);
+    return batch.num_failed != 0;
+}
@@ -0,0 +1,13 @@
+/* longest manifest line, and the most fields a line may have */
+#define BATCH_LINE_SIZE 4096
+#define BATCH_MAX_ARGS 5
+/* int16 sized buffers of a job on top of its samples: the analysis copy, its planar copy and the search buffers */
+#define BATCH_INT16_COPIES 3
+
+int run_job_files (char** args, int num_args, FILE* fp, FILE* fpout, LoopPlan* plan_buf);
+
+int run_job (char** args, int num_args);
+
+int split_job_line (char* line, char** args);
+
+int run_batch (const char* path);
@@ -0,0 +1,155 @@
+/**
+ * @file cache.c
+ * @brief On-disk cache of the loop points found for a track, keyed by a hash of its samples
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cache.h"
+
+/* "/", 16 hex digits of hash, "-", the engine, ".loop" and the temporary file suffix */
+#define CACHE_NAME_SIZE 64
+#define CACHE_MAGIC "autoloop-cache"
+
+/**
+ * Hashes the samples and records what else the loop points depend on. The samples are hashed
+ * as 32 bit words by two FNV-1a style lanes with different offsets and primes
+ * @param key - The key to fill in
+ * @param samples - The interleaved samples searched
+ * @param num_samples - The number of samples of every channel
+ * @param num_channels - The number of channels
+ * @param sample_rate - The sample rate
+ * @param engine - The search engine, one of the ENGINE_ settings
+ */
+void init_cache_key (CacheKey* key, const short* samples, unsigned long num_samples, int num_channels, int sample_rate, int engine) {
+    unsigned long a = 2166136261UL;
+    unsigned long b = 3323198485UL;
+    unsigned long word;
+    unsigned long i;
+
+    for (i = 0; i + 1 < num_samples; i += 2) {
+        word = ((unsigned long) (unsigned short) samples[i] << 16) | (unsigned short) samples[i + 1];
+        a = ((a ^ word) * 16777619UL) & 0xFFFFFFFFUL;
+        b = ((b ^ word) * 2246822519UL) & 0xFFFFFFFFUL;
+    }
+    if (i < num_samples) {
+        word = (unsigned short) samples[i];
+        a = ((a ^ word) * 16777619UL) & 0xFFFFFFFFUL;
+        b = ((b ^ word) * 2246822519UL) & 0xFFFFFFFFUL;
+    }
+
+    key->hash[0] = a;
+    key->hash[1] = b;
+    key->num_samples = num_samples;
+    key->num_channels = num_channels;
+    key->sample_rate = sample_rate;
+    key->engine = engine;
+}
+
+/**
+ * Builds the path of the entry of a key
+ * @param dir - The cache directory
+ * @param key - The key
+ * @return The path, to be freed, or NULL if out of memory
+ */
+static char* get_cache_path (const char* dir, const CacheKey* key) {
+    char* path = (char*) malloc(strlen(dir) + CACHE_NAME_SIZE);
+
+    if (path != NULL) {
+        sprintf(path, "%s/%08lx%08lx-%d.loop", dir, key->hash[0], key->hash[1], key->engine);
+    }
+    return path;
+}
+
+/**
+ * Looks up the loop points of a track. Entries are only ever replaced whole, so a reader sees
+ * either no entry or a complete one, whatever other jobs write at the same time
+ * @param dir - The cache directory
+ * @param key - The key of the track
+ * @param entry - Buffer in which the cached loop points are returned
+ * @return Whether the loop points were found (0 if found)
+ */
+int read_cache (const char* dir, const CacheKey* key, CacheEntry* entry) {
+    char* path = get_cache_path(dir, key);
+    char magic[sizeof(CACHE_MAGIC)];
+    unsigned long hash[2];
+    unsigned long num_samples;
+    int version, engine, num_channels, sample_rate;
+    int res = 1;
+    FILE* fp;
+
+    if (path == NULL) {
+        return 1;
+    }
+    fp = fopen(path, "r");
+    free(path);
+    if (fp == NULL) {
+        return 1;
+    }
+
+    /* Every field of the key is stored, a hash collision is a miss and not the wrong loop */
+    if (fscanf(fp, "%14s %d %8lx%8lx %lu %d %d %d %lu %lu %lu", magic, &version, &hash[0], &hash[1], &num_samples,
+               &num_channels, &sample_rate, &engine, &entry->start, &entry->end, &entry->score) == 11
+        && strcmp(magic, CACHE_MAGIC) == 0 && version == CACHE_VERSION
+        && hash[0] == key->hash[0] && hash[1] == key->hash[1] && num_samples == key->num_samples
+        && num_channels == key->num_channels && sample_rate == key->sample_rate && engine == key->engine
+        && entry->start < entry->end && entry->end <= num_samples) {
+        res = 0;
+    }
+    fclose(fp);
+    return res;
+}
+
+/**
+ * Stores the loop points of a track. The entry is written to a temporary file in the cache
+ * directory and renamed over the entry, so parallel jobs never see it half written
+ * @param dir - The cache directory, which must exist
+ * @param key - The key of the track
+ * @param entry - The loop points
+ * @return Whether the entry was stored (0 if success)
+ */
+int write_cache (const char* dir, const CacheKey* key, const CacheEntry* entry) {
+    char* path = get_cache_path(dir, key);
+    char* tmp_path;
+    FILE* fp;
+    int fd, res;
+
+    if (path == NULL) {
+        return 1;
+    }
+    tmp_path = (char*) malloc(strlen(path) + 8);
+    if (tmp_path == NULL) {
+        free(path);
+        return 1;
+    }
+    sprintf(tmp_path, "%s.XXXXXX", path);
+
+    fd = mkstemp(tmp_path);
+    fp = fd < 0 ? NULL : fdopen(fd, "w");
+    if (fp == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        free(path);
+        return 1;
+    }
+
+    fprintf(fp, "%s %d %08lx%08lx %lu %d %d %d %lu %lu %lu\n", CACHE_MAGIC, CACHE_VERSION, key->hash[0], key->hash[1], key->num_samples,
+            key->num_channels, key->sample_rate, key->engine, entry->start, entry->end, entry->score);
+    res = fflush(fp) != 0 || ferror(fp) || fsync(fd) != 0;
+    res = fclose(fp) != 0 || res;
+    if (res == 0) {
+        res = rename(tmp_path, path) != 0;
+    }
+    if (res != 0) {
+        unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(path);
+    return res;
+}
@@ -0,0 +1,29 @@
+/* bump when a change to the loop searches changes the loop points they find */
+#define CACHE_VERSION 2
+
+/**
+ * What the loop points of a track depend on: a hash of its samples, their layout and the search engine
+ */
+typedef struct cache_key {
+    /* two 32 bit hashes of the samples */
+    unsigned long hash[2];
+    unsigned long num_samples;
+    int num_channels;
+    int sample_rate;
+    int engine;
+} CacheKey;
+
+/**
+ * Loop points found for a CacheKey, in samples of every channel
+ */
+typedef struct cache_entry {
+    unsigned long start;
+    unsigned long end;
+    unsigned long score;
+} CacheEntry;
+
+void init_cache_key (CacheKey* key, const short* samples, unsigned long num_samples, int num_channels, int sample_rate, int engine);
+
+int read_cache (const char* dir, const CacheKey* key, CacheEntry* entry);
+
+int write_cache (const char* dir, const CacheKey* key, const CacheEntry* entry);
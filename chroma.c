@@ -0,0 +1,191 @@
+/**
+ * @file chroma.c
+ * @brief Chroma and loudness features of short frames of audio, for searching loops by
+ *        similarity of harmonic content rather than of the raw waveform
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "chroma.h"
+#include "fft.h"
+#include "threadpool.h"
+
+#define FEATURE_PI 3.14159265358979323846
+
+/* frames analysed by one task of the thread pool */
+#define FEATURE_CHUNK_SIZE 64UL
+/* sum of the chroma bins of a frame, so a frame's chroma weighs as much as a loudness
+   change of FEATURE_CHROMA_SCALE / FEATURE_DB_SCALE dB */
+#define FEATURE_CHROMA_SCALE 4096.0
+/* loudness units per dB, and the quietest loudness kept apart from silence */
+#define FEATURE_DB_SCALE 64.0
+#define FEATURE_MIN_DB -96.0
+/* frequency range mapped onto the chroma bins, in Hz */
+#define FEATURE_MIN_FREQ 55.0
+#define FEATURE_MAX_FREQ 5000.0
+
+/**
+ * Work shared by the feature tasks
+ */
+typedef struct {
+    const short* samples;
+    unsigned long num_samples;
+    int num_channels;
+    unsigned long sample_rate;
+    unsigned long window_size;
+    /* chroma bin of each FFT bin, -1 outside the analysed range */
+    int* bins;
+    featurebuf* features;
+    int failed;
+} FeatureJob;
+
+/**
+ * Computes the features of one chunk of frames: a Hann windowed FFT of the mono mix
+ * at each hop, folded onto the pitch classes and normalised, then the loudness in dB
+ * @param arg - The pointer to the FeatureJob
+ * @param index - The index of the chunk
+ */
+static void compute_feature_chunk (void* arg, unsigned long index) {
+    FeatureJob* job = (FeatureJob*) arg;
+    const FFTPlan* plan = get_fft_plan(job->window_size);
+    unsigned long first = index * FEATURE_CHUNK_SIZE;
+    unsigned long last = first + FEATURE_CHUNK_SIZE;
+    unsigned long n = job->window_size;
+    unsigned long frame, k, pos;
+    double chroma[FEATURE_CHROMA_BINS];
+    double* re;
+    double* im;
+    double sample, energy, total, db;
+    short* out;
+    int c;
+
+    if (last > job->features->num_frames) {
+        last = job->features->num_frames;
+    }
+
+    re = (double*) malloc(n * sizeof(double));
+    im = (double*) malloc(n * sizeof(double));
+    if (plan == NULL || re == NULL || im == NULL) {
+        job->failed = 1;
+        release_fft_plan(plan);
+        free(re);
+        free(im);
+        return;
+    }
+
+    for (frame = first; frame < last; frame++) {
+        energy = 0.0;
+        for (k = 0; k < n; k++) {
+            pos = frame * job->features->hop_size + k;
+            sample = 0.0;
+            if (pos < job->num_samples) {
+                for (c = 0; c < job->num_channels; c++) {
+                    sample += job->samples[pos * job->num_channels + c];
+                }
+                sample /= job->num_channels;
+            }
+            energy += sample * sample;
+            re[k] = sample * (0.5 - 0.5 * cos(2.0 * FEATURE_PI * k / n));
+            im[k] = 0.0;
+        }
+        fft(plan, re, im, 0);
+
+        for (c = 0; c < FEATURE_CHROMA_BINS; c++) {
+            chroma[c] = 0.0;
+        }
+        total = 0.0;
+        for (k = 1; k < n / 2; k++) {
+            if (job->bins[k] >= 0) {
+                chroma[job->bins[k]] += re[k] * re[k] + im[k] * im[k];
+                total += re[k] * re[k] + im[k] * im[k];
+            }
+        }
+
+        /* Silent frames have no chroma, so they only match other silence */
+        out = job->features->data + frame * FEATURE_SIZE;
+        db = energy > 0.0 ? 10.0 * log10(energy / n / (32768.0 * 32768.0)) : FEATURE_MIN_DB;
+        if (db < FEATURE_MIN_DB) {
+            db = FEATURE_MIN_DB;
+        }
+        for (c = 0; c < FEATURE_CHROMA_BINS; c++) {
+            out[c] = (short) (db > FEATURE_MIN_DB && total > 0.0 ? floor(chroma[c] / total * FEATURE_CHROMA_SCALE + 0.5) : 0.0);
+        }
+        out[FEATURE_CHROMA_BINS] = (short) floor((db - FEATURE_MIN_DB) * FEATURE_DB_SCALE + 0.5);
+    }
+
+    release_fft_plan(plan);
+    free(re);
+    free(im);
+}
+
+/**
+ * Computes the features of interleaved int16 audio, one frame per 1 / FEATURE_FRAME_RATE seconds
+ * @param samples - The interleaved samples
+ * @param num_frames - The number of audio frames
+ * @param num_channels - The number of channels
+ * @param sample_rate - The sample rate of the audio
+ * @param features - The pointer to the features to fill, freed with free_features
+ * @return Whether the features were computed (0 if success)
+ */
+int compute_features (const short* samples, unsigned long num_frames, int num_channels, unsigned long sample_rate, featurebuf* features) {
+    FeatureJob job;
+    unsigned long k;
+    double freq, pitch;
+
+    features->data = NULL;
+    features->num_frames = 0;
+    features->hop_size = sample_rate / FEATURE_FRAME_RATE;
+    if (num_channels <= 0 || features->hop_size == 0) {
+        return 1;
+    }
+
+    /* Analyse two hops per frame, so the windows overlap by at least half */
+    job.window_size = 1;
+    while (job.window_size < 2 * features->hop_size) {
+        job.window_size *= 2;
+    }
+    job.samples = samples;
+    job.num_samples = num_frames;
+    job.num_channels = num_channels;
+    job.sample_rate = sample_rate;
+    job.features = features;
+    job.failed = 0;
+
+    features->num_frames = num_frames / features->hop_size;
+    features->data = (short*) malloc((features->num_frames * FEATURE_SIZE + 1) * sizeof(short));
+    job.bins = (int*) malloc(job.window_size * sizeof(int));
+    if (features->data == NULL || job.bins == NULL) {
+        free(job.bins);
+        free_features(features);
+        return 1;
+    }
+
+    for (k = 0; k < job.window_size; k++) {
+        freq = (double) k * sample_rate / job.window_size;
+        job.bins[k] = -1;
+        if (freq >= FEATURE_MIN_FREQ && freq <= FEATURE_MAX_FREQ) {
+            /* MIDI note number, 69 being A4 at 440 Hz and C the first pitch class */
+            pitch = 69.0 + 12.0 * log(freq / 440.0) / log(2.0);
+            job.bins[k] = (int) floor(pitch + 0.5) % FEATURE_CHROMA_BINS;
+        }
+    }
+
+    parallel_for((features->num_frames + FEATURE_CHUNK_SIZE - 1) / FEATURE_CHUNK_SIZE, compute_feature_chunk, &job);
+
+    free(job.bins);
+    if (job.failed) {
+        free_features(features);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Frees the features
+ * @param features - The pointer to the features
+ */
+void free_features (featurebuf* features) {
+    free(features->data);
+    features->data = NULL;
+    features->num_frames = 0;
+}
@@ -0,0 +1,19 @@
+/* values per feature frame: 12 chroma bins followed by the loudness */
+#define FEATURE_SIZE 13
+#define FEATURE_CHROMA_BINS 12
+/* feature frames per second of audio, a 40 ms hop */
+#define FEATURE_FRAME_RATE 25
+
+/**
+ * Compact per-frame description of the audio, frame k starting at sample k * hop_size
+ * and taking FEATURE_SIZE values from data + k * FEATURE_SIZE
+ */
+typedef struct feature_buffer {
+    short* data;
+    unsigned long num_frames;
+    unsigned long hop_size;
+} featurebuf;
+
+int compute_features (const short* samples, unsigned long num_frames, int num_channels, unsigned long sample_rate, featurebuf* features);
+
+void free_features (featurebuf* features);
@@ -0,0 +1,362 @@
+/**
+ * @file convert.c
+ * @brief Bulk conversion kernels from the wav sample formats into the int16 samples used for analysis
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "parse_wav.h"
+#include "convert.h"
+#include "threadpool.h"
+
+/* bytes of raw samples converted per pool task, rounded down to whole pages and samples */
+#define DECODE_CHUNK_SIZE (4UL * 1024 * 1024)
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define CONVERT_HAS_SSSE3 1
+#endif
+
+/**
+ * Converts unsigned 8 bit samples to int16
+ * @param src - The raw samples
+ * @param dst - The destination for the converted samples
+ * @param n - The number of samples
+ */
+static void convert_u8 (const unsigned char* src, short* dst, unsigned long n) {
+    unsigned long k = 0;
+#if defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i bias = _mm_set1_epi16(128);
+    __m128i x;
+
+    for (; k + 16 <= n; k += 16) {
+        x = _mm_loadu_si128((const __m128i*) (src + k));
+        _mm_storeu_si128((__m128i*) (dst + k), _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(x, zero), bias), 8));
+        _mm_storeu_si128((__m128i*) (dst + k + 8), _mm_slli_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(x, zero), bias), 8));
+    }
+#endif
+    for (; k < n; k++) {
+        dst[k] = (short) ((src[k] - 128) * 256);
+    }
+}
+
+#if defined(CONVERT_HAS_SSSE3)
+/**
+ * SSSE3 kernel keeping the two most significant bytes of each packed 24 bit sample
+ * @return The number of samples converted, the caller finishes the tail
+ */
+__attribute__((target("ssse3")))
+static unsigned long convert_s24_ssse3 (const unsigned char* src, short* dst, unsigned long n) {
+    unsigned long k = 0;
+    __m128i low_mask = _mm_setr_epi8(1, 2, 4, 5, 7, 8, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1);
+    __m128i high_mask = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 1, 2, 4, 5, 7, 8, 10, 11);
+    __m128i a, b;
+
+    /* each 16 byte load covers 4 whole samples, the second load reads 4 bytes past them */
+    for (; 3 * k + 28 <= 3 * n; k += 8) {
+        a = _mm_loadu_si128((const __m128i*) (src + 3 * k));
+        b = _mm_loadu_si128((const __m128i*) (src + 3 * k + 12));
+        _mm_storeu_si128((__m128i*) (dst + k), _mm_or_si128(_mm_shuffle_epi8(a, low_mask), _mm_shuffle_epi8(b, high_mask)));
+    }
+    return k;
+}
+#endif
+
+/**
+ * Converts packed signed 24 bit samples to int16 by dropping the least significant byte
+ * @param src - The raw samples
+ * @param dst - The destination for the converted samples
+ * @param n - The number of samples
+ */
+static void convert_s24 (const unsigned char* src, short* dst, unsigned long n) {
+    unsigned long k = 0;
+#if defined(CONVERT_HAS_SSSE3)
+    if (__builtin_cpu_supports("ssse3")) {
+        k = convert_s24_ssse3(src, dst, n);
+    }
+#endif
+    for (; k < n; k++) {
+        dst[k] = (short) (src[3 * k + 1] | (src[3 * k + 2] << 8));
+    }
+}
+
+/**
+ * Converts signed 32 bit samples to int16 by keeping the upper 16 bits
+ * @param src - The raw samples
+ * @param dst - The destination for the converted samples
+ * @param n - The number of samples
+ */
+static void convert_s32 (const unsigned char* src, short* dst, unsigned long n) {
+    unsigned long k = 0;
+    int sample;
+#if defined(__SSE2__)
+    __m128i a, b;
+
+    for (; k + 8 <= n; k += 8) {
+        a = _mm_srai_epi32(_mm_loadu_si128((const __m128i*) (src + 4 * k)), 16);
+        b = _mm_srai_epi32(_mm_loadu_si128((const __m128i*) (src + 4 * k + 16)), 16);
+        _mm_storeu_si128((__m128i*) (dst + k), _mm_packs_epi32(a, b));
+    }
+#endif
+    for (; k < n; k++) {
+        memcpy(&sample, src + 4 * k, 4);
+        dst[k] = (short) (sample >> 16);
+    }
+}
+
+/**
+ * Converts IEEE float samples in -1 to 1 to int16, clamping out of range values.
+ * Rounds toward zero in both the vector and scalar paths so the results are identical
+ * @param src - The raw samples
+ * @param dst - The destination for the converted samples
+ * @param n - The number of samples
+ */
+static void convert_f32 (const unsigned char* src, short* dst, unsigned long n) {
+    unsigned long k = 0;
+    float sample;
+#if defined(__SSE2__)
+    __m128 scale = _mm_set1_ps(32767.0f);
+    __m128 low = _mm_set1_ps(-32768.0f);
+    __m128 high = _mm_set1_ps(32767.0f);
+    __m128 a, b;
+
+    for (; k + 8 <= n; k += 8) {
+        a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps((const float*) (src + 4 * k)), scale), low), high);
+        b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps((const float*) (src + 4 * k + 16)), scale), low), high);
+        _mm_storeu_si128((__m128i*) (dst + k), _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b)));
+    }
+#endif
+    for (; k < n; k++) {
+        memcpy(&sample, src + 4 * k, 4);
+        sample *= 32767.0f;
+        /* same operand order as max/min above, so NaN maps to the low clamp */
+        sample = sample > -32768.0f ? sample : -32768.0f;
+        sample = sample < 32767.0f ? sample : 32767.0f;
+        dst[k] = (short) (int) sample;
+    }
+}
+
+/**
+ * Converts IEEE double samples in -1 to 1 to int16, clamping out of range values
+ * @param src - The raw samples
+ * @param dst - The destination for the converted samples
+ * @param n - The number of samples
+ */
+static void convert_f64 (const unsigned char* src, short* dst, unsigned long n) {
+    unsigned long k;
+    double sample;
+
+    for (k = 0; k < n; k++) {
+        memcpy(&sample, src + 8 * k, 8);
+        sample *= 32767.0;
+        sample = sample > -32768.0 ? sample : -32768.0;
+        sample = sample < 32767.0 ? sample : 32767.0;
+        dst[k] = (short) (int) sample;
+    }
+}
+
+/**
+ * Finds the effective sample format of a wav file, resolving WAVE_FORMAT_EXTENSIBLE
+ * to the format tag stored in the first two bytes of its sub-format GUID
+ * @param headers - The wav file headers
+ * @return The format tag (WAVE_FORMAT_PCM, WAVE_FORMAT_IEEE_FLOAT or another tag)
+ */
+int get_sample_format (const WavHeaders* headers) {
+    if (headers->audio_format == WAVE_FORMAT_EXTENSIBLE) {
+        /* extra_params starts with the fmt extension: cbSize, valid bits, channel mask, GUID */
+        if (headers->sub_chunk1_size < 40 || headers->extra_params_size < 10) {
+            return -1;
+        }
+        return (int) byte_str_to_long(headers->extra_params + 8, 1, 2);
+    }
+    return (int) headers->audio_format;
+}
+
+/**
+ * Converts raw wav samples of any supported format into int16 samples
+ * @param src - The raw samples
+ * @param dst - The destination for the converted samples
+ * @param num_samples - The number of samples (over all channels)
+ * @param sample_format - The effective format tag from get_sample_format
+ * @param sample_size - The number of bytes per sample
+ * @return Whether the format is supported (0 if success)
+ */
+int convert_samples_to_s16 (const unsigned char* src, short* dst, unsigned long num_samples, int sample_format, unsigned long sample_size) {
+    if (sample_format == WAVE_FORMAT_PCM) {
+        switch (sample_size) {
+            case 1:
+                convert_u8(src, dst, num_samples);
+                return 0;
+            case 2:
+                memcpy(dst, src, num_samples * sizeof(short));
+                return 0;
+            case 3:
+                convert_s24(src, dst, num_samples);
+                return 0;
+            case 4:
+                convert_s32(src, dst, num_samples);
+                return 0;
+        }
+    } else if (sample_format == WAVE_FORMAT_IEEE_FLOAT) {
+        switch (sample_size) {
+            case 4:
+                convert_f32(src, dst, num_samples);
+                return 0;
+            case 8:
+                convert_f64(src, dst, num_samples);
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * One conversion spread over the thread pool in ranges that start on the page boundaries of src
+ */
+typedef struct {
+    const unsigned char* src;
+    short* dst;
+    unsigned long num_samples;
+    /* bytes from src to its first page boundary, converted by the first range */
+    unsigned long lead_bytes;
+    /* bytes of the other ranges, a multiple of the page size */
+    unsigned long chunk_bytes;
+    int sample_format;
+    unsigned long sample_size;
+} DecodeJob;
+
+/**
+ * Finds the first sample of the index-th range of a DecodeJob, the first sample that starts
+ * at or after the range's page boundary
+ * @param job - The pointer to the DecodeJob
+ * @param index - The index of the range
+ * @return The index of the sample
+ */
+static unsigned long decode_chunk_start (const DecodeJob* job, unsigned long index) {
+    unsigned long start;
+
+    if (index == 0) {
+        return 0;
+    }
+    start = (job->lead_bytes + (index - 1) * job->chunk_bytes + job->sample_size - 1) / job->sample_size;
+    return start < job->num_samples ? start : job->num_samples;
+}
+
+/**
+ * Converts the index-th range of a DecodeJob
+ * @param arg - The pointer to the DecodeJob
+ * @param index - The index of the range
+ */
+static void decode_chunk (void* arg, unsigned long index) {
+    DecodeJob* job = (DecodeJob*) arg;
+    unsigned long first = decode_chunk_start(job, index);
+    unsigned long last = decode_chunk_start(job, index + 1);
+
+    convert_samples_to_s16(job->src + first * job->sample_size, job->dst + first, last - first, job->sample_format, job->sample_size);
+}
+
+/**
+ * Converts raw samples to int16 like convert_samples_to_s16, splitting the data into ranges
+ * that are converted on the thread pool. The data chunk rarely starts on a page (src sits after
+ * the headers in the mapping), so the first range runs up to the first page boundary of src and
+ * the others cover whole pages from there. A range starts on its page boundary whenever that is
+ * also a sample boundary, otherwise on the next sample
+ * @param src - The raw little endian samples
+ * @param dst - The destination for the converted samples
+ * @param num_samples - The number of samples (over all channels)
+ * @param sample_format - The effective format tag from get_sample_format
+ * @param sample_size - The number of bytes per sample
+ * @return Whether the format is supported (0 if success)
+ */
+int convert_samples_to_s16_parallel (const unsigned char* src, short* dst, unsigned long num_samples, int sample_format, unsigned long sample_size) {
+    DecodeJob job;
+    long page_size = sysconf(_SC_PAGESIZE);
+    unsigned long num_pages;
+    unsigned long num_bytes = num_samples * sample_size;
+    unsigned long num_chunks = 1;
+
+    /* check the format once up front, the tasks cannot report failure */
+    if (convert_samples_to_s16(src, dst, 0, sample_format, sample_size) != 0) {
+        return 1;
+    }
+
+    if (page_size <= 0) {
+        page_size = 4096;
+    }
+    num_pages = DECODE_CHUNK_SIZE / (unsigned long) page_size;
+    if (num_pages == 0) {
+        num_pages = 1;
+    }
+
+    job.src = src;
+    job.dst = dst;
+    job.num_samples = num_samples;
+    job.lead_bytes = ((unsigned long) page_size - (unsigned long) src % (unsigned long) page_size) % (unsigned long) page_size;
+    job.chunk_bytes = num_pages * (unsigned long) page_size;
+    job.sample_format = sample_format;
+    job.sample_size = sample_size;
+
+    if (num_bytes > job.lead_bytes) {
+        num_chunks += (num_bytes - job.lead_bytes + job.chunk_bytes - 1) / job.chunk_bytes;
+    }
+    parallel_for(num_chunks, decode_chunk, &job);
+    return 0;
+}
+
+/**
+ * Fills in the int16 analysis samples of a wav file from its raw data chunk.
+ * Aligned 16 bit PCM is used in place, every other format is converted into a new buffer
+ * while raw_frames keeps the original samples for output
+ * @param wav_file - The pointer to the wav file, with headers and raw_frames set
+ * @return 0 if success, DECODE_UNSUPPORTED for an unsupported sample format or
+ *         DECODE_NO_MEMORY if the converted samples could not be allocated
+ */
+int decode_wav_frames (WavFile* wav_file) {
+    WavHeaders* headers = &wav_file->headers;
+    int sample_format = get_sample_format(headers);
+    unsigned long sample_size;
+    unsigned long num_samples;
+    short* samples;
+
+    if (headers->num_channels <= 0 || headers->block_align % headers->num_channels != 0) {
+        return DECODE_UNSUPPORTED;
+    }
+
+    sample_size = (unsigned long) (headers->block_align / headers->num_channels);
+    if (sample_size == 0) {
+        return DECODE_UNSUPPORTED;
+    }
+    num_samples = (unsigned long) headers->data_chunk_size / sample_size;
+
+    wav_file->frames = NULL;
+    wav_file->num_frames = num_samples;
+    wav_file->scale = (double) get_max_int(16);
+
+    if (
+        sample_format == WAVE_FORMAT_PCM && sample_size == sizeof(short) &&
+        ((unsigned long) wav_file->raw_frames) % sizeof(short) == 0
+    ) {
+        wav_file->unscaled_frames = (short*) wav_file->raw_frames;
+        return 0;
+    }
+
+    samples = (short*) malloc((num_samples + 1) * sizeof(short));
+    if (samples == NULL) {
+        return DECODE_NO_MEMORY;
+    }
+    samples[num_samples] = 0;
+    if (convert_samples_to_s16_parallel(wav_file->raw_frames, samples, num_samples, sample_format, sample_size) != 0) {
+        free(samples);
+        return DECODE_UNSUPPORTED;
+    }
+
+    wav_file->unscaled_frames = samples;
+    return 0;
+}
@@ -0,0 +1,16 @@
+/* wav fmt chunk format tags */
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+/* decode_wav_frames failures */
+#define DECODE_UNSUPPORTED 1
+#define DECODE_NO_MEMORY 2
+
+int get_sample_format (const WavHeaders* headers);
+
+int convert_samples_to_s16 (const unsigned char* src, short* dst, unsigned long num_samples, int sample_format, unsigned long sample_size);
+
+int convert_samples_to_s16_parallel (const unsigned char* src, short* dst, unsigned long num_samples, int sample_format, unsigned long sample_size);
+
+int decode_wav_frames (WavFile* wav_file);
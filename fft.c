@@ -0,0 +1,266 @@
+/**
+ * @file fft.c
+ * @brief Self-contained radix-2 FFT and real cross-correlation, so the search does not need fftw
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include "fft.h"
+
+#define FFT_PI 3.14159265358979323846
+
+/* number of plan sizes kept around, the search only uses a handful */
+#define FFT_PLAN_CACHE_SIZE 8
+
+/**
+ * A cached plan, with the number of callers holding it and when it was last handed out
+ */
+typedef struct {
+    FFTPlan plan;
+    int users;
+    unsigned long last_used;
+} CachedFFTPlan;
+
+static CachedFFTPlan fft_plans[FFT_PLAN_CACHE_SIZE];
+static int num_fft_plans = 0;
+static unsigned long fft_plan_clock = 0;
+static pthread_mutex_t fft_plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Fills in the tables of a plan
+ * @param plan - The plan to initialise
+ * @param size - The transform size, a power of two
+ * @return Whether the tables could be allocated (0 if success)
+ */
+static int init_fft_plan (FFTPlan* plan, unsigned long size) {
+    unsigned long k;
+    unsigned long bits = 0;
+    unsigned long reversed;
+    unsigned long b;
+
+    plan->size = size;
+    plan->cos_table = (double*) malloc((size / 2 + 1) * sizeof(double));
+    plan->sin_table = (double*) malloc((size / 2 + 1) * sizeof(double));
+    plan->bit_reverse = (unsigned long*) malloc(size * sizeof(unsigned long));
+    if (plan->cos_table == NULL || plan->sin_table == NULL || plan->bit_reverse == NULL) {
+        free(plan->cos_table);
+        free(plan->sin_table);
+        free(plan->bit_reverse);
+        return 1;
+    }
+
+    for (k = 0; k < size / 2; k++) {
+        plan->cos_table[k] = cos(-2.0 * FFT_PI * (double) k / (double) size);
+        plan->sin_table[k] = sin(-2.0 * FFT_PI * (double) k / (double) size);
+    }
+
+    while ((1UL << bits) < size) {
+        bits++;
+    }
+    for (k = 0; k < size; k++) {
+        reversed = 0;
+        for (b = 0; b < bits; b++) {
+            reversed |= ((k >> b) & 1) << (bits - 1 - b);
+        }
+        plan->bit_reverse[k] = reversed;
+    }
+    return 0;
+}
+
+/**
+ * Frees the tables of a plan
+ * @param plan - The plan
+ */
+static void free_fft_tables (FFTPlan* plan) {
+    free(plan->cos_table);
+    free(plan->sin_table);
+    free(plan->bit_reverse);
+}
+
+/**
+ * Returns the cached plan for a transform size, creating it on first use. A full cache evicts
+ * its least recently used plan nobody holds; if every plan is held, the caller gets a plan of
+ * its own. Safe to call from any thread
+ * @param size - The transform size, a power of two
+ * @return The plan, to be handed back with release_fft_plan, or NULL if it could not be created
+ */
+const FFTPlan* get_fft_plan (unsigned long size) {
+    CachedFFTPlan* entry = NULL;
+    FFTPlan* transient;
+    int k;
+
+    pthread_mutex_lock(&fft_plan_lock);
+    for (k = 0; k < num_fft_plans; k++) {
+        if (fft_plans[k].plan.size == size) {
+            entry = &fft_plans[k];
+            break;
+        }
+    }
+    if (entry == NULL && num_fft_plans < FFT_PLAN_CACHE_SIZE) {
+        entry = &fft_plans[num_fft_plans++];
+        entry->plan.size = 0;
+    } else if (entry == NULL) {
+        for (k = 0; k < FFT_PLAN_CACHE_SIZE; k++) {
+            if (fft_plans[k].users == 0 && (entry == NULL || fft_plans[k].last_used < entry->last_used)) {
+                entry = &fft_plans[k];
+            }
+        }
+        if (entry != NULL && entry->plan.size > 0) {
+            free_fft_tables(&entry->plan);
+            entry->plan.size = 0;
+        }
+    }
+    /* a slot whose plan could not be created keeps size 0, which no transform asks for */
+    if (entry != NULL && entry->plan.size == 0 && init_fft_plan(&entry->plan, size) != 0) {
+        entry->plan.size = 0;
+        entry->last_used = 0;
+        pthread_mutex_unlock(&fft_plan_lock);
+        return NULL;
+    }
+    if (entry != NULL) {
+        entry->users++;
+        entry->last_used = ++fft_plan_clock;
+        pthread_mutex_unlock(&fft_plan_lock);
+        return &entry->plan;
+    }
+    pthread_mutex_unlock(&fft_plan_lock);
+
+    transient = (FFTPlan*) malloc(sizeof(FFTPlan));
+    if (transient == NULL || init_fft_plan(transient, size) != 0) {
+        free(transient);
+        return NULL;
+    }
+    return transient;
+}
+
+/**
+ * Hands back a plan from get_fft_plan, so the cache may evict it
+ * @param plan - The plan, or NULL
+ */
+void release_fft_plan (const FFTPlan* plan) {
+    FFTPlan* transient;
+    int k;
+
+    if (plan == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&fft_plan_lock);
+    for (k = 0; k < num_fft_plans; k++) {
+        if (&fft_plans[k].plan == plan) {
+            fft_plans[k].users--;
+            pthread_mutex_unlock(&fft_plan_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&fft_plan_lock);
+
+    transient = (FFTPlan*) plan;
+    free_fft_tables(transient);
+    free(transient);
+}
+
+/**
+ * In place iterative radix-2 FFT. The inverse transform is not scaled by 1/size
+ * @param plan - The plan for the transform size
+ * @param re - The real parts
+ * @param im - The imaginary parts
+ * @param inverse - Whether to run the inverse transform
+ */
+void fft (const FFTPlan* plan, double* re, double* im, int inverse) {
+    unsigned long n = plan->size;
+    unsigned long k, j, half, step, start;
+    double sign = inverse ? -1.0 : 1.0;
+    double wr, wi, tr, ti, t;
+
+    for (k = 0; k < n; k++) {
+        j = plan->bit_reverse[k];
+        if (k < j) {
+            t = re[k]; re[k] = re[j]; re[j] = t;
+            t = im[k]; im[k] = im[j]; im[j] = t;
+        }
+    }
+
+    for (half = 1; half < n; half *= 2) {
+        step = n / (2 * half);
+        for (start = 0; start < n; start += 2 * half) {
+            for (k = 0; k < half; k++) {
+                wr = plan->cos_table[k * step];
+                wi = sign * plan->sin_table[k * step];
+                j = start + k + half;
+                tr = re[j] * wr - im[j] * wi;
+                ti = re[j] * wi + im[j] * wr;
+                re[j] = re[start + k] - tr;
+                im[j] = im[start + k] - ti;
+                re[start + k] += tr;
+                im[start + k] += ti;
+            }
+        }
+    }
+}
+
+/**
+ * Computes out[k] = sum over j < a_size of a[j] * b[k + j] for every k < num_lags.
+ * Both real inputs share one complex transform, a in the real and b in the imaginary part
+ * @param a - The shorter sequence
+ * @param a_size - The length of a
+ * @param b - The longer sequence, which must hold num_lags + a_size - 1 samples
+ * @param b_size - The length of b
+ * @param out - The correlation for each lag
+ * @param num_lags - The number of lags to compute
+ * @param accumulate - Whether to add to out instead of overwriting it
+ * @return Whether the correlation could be computed (0 if success)
+ */
+int cross_correlate (const short* a, unsigned long a_size, const short* b, unsigned long b_size, double* out, unsigned long num_lags, int accumulate) {
+    const FFTPlan* plan;
+    unsigned long n = 1;
+    unsigned long k, m;
+    double* re;
+    double* im;
+    double ar, ai, br, bi, cr, ci;
+
+    /* lags never wrap around as long as the transform covers b */
+    while (n < b_size) {
+        n *= 2;
+    }
+    plan = get_fft_plan(n);
+    re = (double*) calloc(2 * n, sizeof(double));
+    if (plan == NULL || re == NULL) {
+        release_fft_plan(plan);
+        free(re);
+        return 1;
+    }
+    im = re + n;
+
+    for (k = 0; k < a_size; k++) {
+        re[k] = (double) a[k];
+    }
+    for (k = 0; k < b_size; k++) {
+        im[k] = (double) b[k];
+    }
+    fft(plan, re, im, 0);
+
+    /* split the spectra of a and b and form conj(A) * B, which is hermitian */
+    for (k = 0; k <= n / 2; k++) {
+        m = (n - k) & (n - 1);
+        ar = 0.5 * (re[k] + re[m]);
+        ai = 0.5 * (im[k] - im[m]);
+        br = 0.5 * (im[k] + im[m]);
+        bi = -0.5 * (re[k] - re[m]);
+        cr = ar * br + ai * bi;
+        ci = ar * bi - ai * br;
+        re[k] = cr;
+        im[k] = ci;
+        re[m] = cr;
+        im[m] = -ci;
+    }
+    fft(plan, re, im, 1);
+
+    for (k = 0; k < num_lags; k++) {
+        out[k] = (accumulate ? out[k] : 0.0) + re[k] / (double) n;
+    }
+
+    release_fft_plan(plan);
+    free(re);
+    return 0;
+}
@@ -0,0 +1,18 @@
+/**
+ * Twiddle factors and bit reversal permutation for power of two FFTs of one size
+ */
+typedef struct fft_plan {
+    unsigned long size;
+    /* cos and sin of -2*pi*k/size for k < size/2 */
+    double* cos_table;
+    double* sin_table;
+    unsigned long* bit_reverse;
+} FFTPlan;
+
+const FFTPlan* get_fft_plan (unsigned long size);
+
+void release_fft_plan (const FFTPlan* plan);
+
+void fft (const FFTPlan* plan, double* re, double* im, int inverse);
+
+int cross_correlate (const short* a, unsigned long a_size, const short* b, unsigned long b_size, double* out, unsigned long num_lags, int accumulate);
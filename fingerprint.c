@@ -0,0 +1,348 @@
+/**
+ * @file fingerprint.c
+ * @brief Spectral peak landmarks of the audio in a hash table, voting on the lags at which
+ *        they repeat to propose loops in roughly linear time
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "fingerprint.h"
+#include "fft.h"
+#include "threadpool.h"
+
+#define FINGERPRINT_PI 3.14159265358979323846
+
+/* frames analysed by one task of the thread pool */
+#define FINGERPRINT_CHUNK_SIZE 256UL
+/* frequency bands holding at most one peak per frame each */
+#define FINGERPRINT_BANDS 6
+/* a band's loudest bin is a peak if it has this many times the mean power of the band */
+#define FINGERPRINT_PEAK_RATIO 4.0
+/* frames quieter than this mean power per sample (about -70 dBFS) have no peaks */
+#define FINGERPRINT_SILENCE 100.0
+/* peaks paired with each peak, from the following FINGERPRINT_MAX_DT frames */
+#define FINGERPRINT_FAN_OUT 4
+#define FINGERPRINT_MAX_DT 32
+/* bits of each peak frequency bin in a hash, the frame distance takes the lowest 6 bits */
+#define FINGERPRINT_BIN_BITS 10
+/* later occurrences of a landmark that vote, so very common landmarks stay linear */
+#define FINGERPRINT_MAX_MATCHES 32
+
+/* edges of the frequency bands in Hz */
+static const double band_edges[FINGERPRINT_BANDS + 1] = { 100.0, 250.0, 500.0, 1000.0, 2000.0, 4000.0, 8000.0 };
+
+/**
+ * Work shared by the peak picking tasks
+ */
+typedef struct {
+    const short* samples;
+    unsigned long num_samples;
+    int num_channels;
+    unsigned long window_size;
+    unsigned long hop_size;
+    unsigned long num_frames;
+    /* first bin of each band, and the end of the last one */
+    unsigned long band_bins[FINGERPRINT_BANDS + 1];
+    /* peak bin of each band of each frame, 0 for none */
+    unsigned short* peaks;
+    int failed;
+} PeakJob;
+
+/**
+ * Picks the spectral peaks of one chunk of frames: the loudest bin of each band of a Hann
+ * windowed FFT of the mono mix, if it stands out of its band
+ * @param arg - The pointer to the PeakJob
+ * @param index - The index of the chunk
+ */
+static void find_peak_chunk (void* arg, unsigned long index) {
+    PeakJob* job = (PeakJob*) arg;
+    const FFTPlan* plan = get_fft_plan(job->window_size);
+    unsigned long first = index * FINGERPRINT_CHUNK_SIZE;
+    unsigned long last = first + FINGERPRINT_CHUNK_SIZE;
+    unsigned long n = job->window_size;
+    unsigned long frame, k, pos, peak;
+    double* re;
+    double* im;
+    double sample, energy, power, band_power, peak_power;
+    int b, c;
+
+    if (last > job->num_frames) {
+        last = job->num_frames;
+    }
+
+    re = (double*) malloc(n * sizeof(double));
+    im = (double*) malloc(n * sizeof(double));
+    if (plan == NULL || re == NULL || im == NULL) {
+        job->failed = 1;
+        release_fft_plan(plan);
+        free(re);
+        free(im);
+        return;
+    }
+
+    for (frame = first; frame < last; frame++) {
+        energy = 0.0;
+        for (k = 0; k < n; k++) {
+            pos = frame * job->hop_size + k;
+            sample = 0.0;
+            if (pos < job->num_samples) {
+                for (c = 0; c < job->num_channels; c++) {
+                    sample += job->samples[pos * job->num_channels + c];
+                }
+                sample /= job->num_channels;
+            }
+            energy += sample * sample;
+            re[k] = sample * (0.5 - 0.5 * cos(2.0 * FINGERPRINT_PI * k / n));
+            im[k] = 0.0;
+        }
+
+        for (b = 0; b < FINGERPRINT_BANDS; b++) {
+            job->peaks[frame * FINGERPRINT_BANDS + b] = 0;
+        }
+        if (energy / n < FINGERPRINT_SILENCE) {
+            continue;
+        }
+        fft(plan, re, im, 0);
+
+        for (b = 0; b < FINGERPRINT_BANDS; b++) {
+            band_power = 0.0;
+            peak_power = 0.0;
+            peak = 0;
+            for (k = job->band_bins[b]; k < job->band_bins[b + 1]; k++) {
+                power = re[k] * re[k] + im[k] * im[k];
+                band_power += power;
+                if (power > peak_power) {
+                    peak_power = power;
+                    peak = k;
+                }
+            }
+            if (peak_power * (job->band_bins[b + 1] - job->band_bins[b]) > FINGERPRINT_PEAK_RATIO * band_power) {
+                job->peaks[frame * FINGERPRINT_BANDS + b] = (unsigned short) peak;
+            }
+        }
+    }
+
+    release_fft_plan(plan);
+    free(re);
+    free(im);
+}
+
+/**
+ * @return The bucket of a landmark hash in a table of num_buckets, a power of two
+ */
+static unsigned long get_bucket (unsigned long hash, unsigned long num_buckets) {
+    return ((hash * 2654435761UL) >> 7) & (num_buckets - 1);
+}
+
+/**
+ * Builds the landmark index of interleaved int16 audio, one frame per 1 / FINGERPRINT_FRAME_RATE
+ * seconds. Each landmark hashes the frequencies of two peaks and the frames between them
+ * @param samples - The interleaved samples
+ * @param num_frames - The number of audio frames
+ * @param num_channels - The number of channels
+ * @param sample_rate - The sample rate of the audio
+ * @param index - The pointer to the index to fill, freed with free_fingerprint_index
+ * @return Whether the index was built (0 if success)
+ */
+int build_fingerprint_index (const short* samples, unsigned long num_frames, int num_channels, unsigned long sample_rate, FingerprintIndex* index) {
+    PeakJob job;
+    unsigned long max_landmarks;
+    unsigned long frame, other, dt, hash, bucket;
+    unsigned long f1, f2;
+    int b, b2, paired;
+
+    index->hashes = NULL;
+    index->frames = NULL;
+    index->next = NULL;
+    index->buckets = NULL;
+    index->num_landmarks = 0;
+    index->hop_size = sample_rate / FINGERPRINT_FRAME_RATE;
+    index->num_frames = index->hop_size == 0 ? 0 : num_frames / index->hop_size;
+    if (num_channels <= 0 || index->num_frames == 0) {
+        return 1;
+    }
+
+    /* Analyse two hops per frame, so the windows overlap by at least half */
+    job.window_size = 1;
+    while (job.window_size < 2 * index->hop_size) {
+        job.window_size *= 2;
+    }
+    for (b = 0; b <= FINGERPRINT_BANDS; b++) {
+        job.band_bins[b] = (unsigned long) (band_edges[b] * job.window_size / sample_rate);
+        if (job.band_bins[b] >= job.window_size / 2) {
+            job.band_bins[b] = job.window_size / 2;
+        }
+        if (job.band_bins[b] >= (1UL << FINGERPRINT_BIN_BITS)) {
+            job.band_bins[b] = (1UL << FINGERPRINT_BIN_BITS) - 1;
+        }
+    }
+    job.samples = samples;
+    job.num_samples = num_frames;
+    job.num_channels = num_channels;
+    job.hop_size = index->hop_size;
+    job.num_frames = index->num_frames;
+    job.failed = 0;
+    job.peaks = (unsigned short*) malloc(index->num_frames * FINGERPRINT_BANDS * sizeof(unsigned short));
+    if (job.peaks == NULL) {
+        return 1;
+    }
+
+    parallel_for((index->num_frames + FINGERPRINT_CHUNK_SIZE - 1) / FINGERPRINT_CHUNK_SIZE, find_peak_chunk, &job);
+    if (job.failed) {
+        free(job.peaks);
+        return 1;
+    }
+
+    max_landmarks = index->num_frames * FINGERPRINT_BANDS * FINGERPRINT_FAN_OUT;
+    index->num_buckets = 1;
+    while (index->num_buckets < max_landmarks) {
+        index->num_buckets *= 2;
+    }
+    index->hashes = (unsigned long*) malloc(max_landmarks * sizeof(unsigned long));
+    index->frames = (unsigned long*) malloc(max_landmarks * sizeof(unsigned long));
+    index->next = (unsigned long*) malloc(max_landmarks * sizeof(unsigned long));
+    index->buckets = (unsigned long*) malloc(index->num_buckets * sizeof(unsigned long));
+    if (index->hashes == NULL || index->frames == NULL || index->next == NULL || index->buckets == NULL) {
+        free(job.peaks);
+        free_fingerprint_index(index);
+        return 1;
+    }
+
+    /* Pair each peak with the first peaks after it */
+    for (frame = 0; frame < index->num_frames; frame++) {
+        for (b = 0; b < FINGERPRINT_BANDS; b++) {
+            f1 = job.peaks[frame * FINGERPRINT_BANDS + b];
+            if (f1 == 0) {
+                continue;
+            }
+            paired = 0;
+            for (dt = 1; dt <= FINGERPRINT_MAX_DT && frame + dt < index->num_frames && paired < FINGERPRINT_FAN_OUT; dt++) {
+                other = frame + dt;
+                for (b2 = 0; b2 < FINGERPRINT_BANDS && paired < FINGERPRINT_FAN_OUT; b2++) {
+                    f2 = job.peaks[other * FINGERPRINT_BANDS + b2];
+                    if (f2 == 0) {
+                        continue;
+                    }
+                    hash = (f1 << (FINGERPRINT_BIN_BITS + 6)) | (f2 << 6) | (dt & 63);
+                    index->hashes[index->num_landmarks] = hash;
+                    index->frames[index->num_landmarks] = frame;
+                    index->num_landmarks++;
+                    paired++;
+                }
+            }
+        }
+    }
+    free(job.peaks);
+
+    /* Chain the landmarks of each bucket, earliest first, so a landmark's chain continues with the later ones */
+    for (bucket = 0; bucket < index->num_buckets; bucket++) {
+        index->buckets[bucket] = index->num_landmarks;
+    }
+    for (other = index->num_landmarks; other > 0; other--) {
+        bucket = get_bucket(index->hashes[other - 1], index->num_buckets);
+        index->next[other - 1] = index->buckets[bucket];
+        index->buckets[bucket] = other - 1;
+    }
+    return 0;
+}
+
+/**
+ * Frees the landmark index
+ * @param index - The pointer to the index
+ */
+void free_fingerprint_index (FingerprintIndex* index) {
+    free(index->hashes);
+    free(index->frames);
+    free(index->next);
+    free(index->buckets);
+    index->hashes = NULL;
+    index->frames = NULL;
+    index->next = NULL;
+    index->buckets = NULL;
+    index->num_landmarks = 0;
+}
+
+/**
+ * Counts, for every lag, the landmarks that occur again that many frames later. Only the next
+ * FINGERPRINT_MAX_MATCHES occurrences of a landmark vote, so the count stays linear in the track length
+ * @param index - The pointer to the index
+ * @param min_lag - The shortest lag counted
+ * @param votes - The buffer for index->num_frames counts, indexed by lag
+ */
+void vote_lags (const FingerprintIndex* index, unsigned long min_lag, unsigned long* votes) {
+    unsigned long i, j;
+    unsigned long frame;
+    int matches;
+
+    for (i = 0; i < index->num_frames; i++) {
+        votes[i] = 0;
+    }
+
+    for (i = 0; i < index->num_landmarks; i++) {
+        frame = index->frames[i];
+        matches = 0;
+        for (j = index->next[i]; j < index->num_landmarks && matches < FINGERPRINT_MAX_MATCHES; j = index->next[j]) {
+            if (index->hashes[j] == index->hashes[i] && index->frames[j] >= frame + min_lag) {
+                votes[index->frames[j] - frame]++;
+                matches++;
+            }
+        }
+    }
+}
+
+/**
+ * Finds the window in which the most landmarks repeat at a lag, give or take a frame
+ * @param index - The pointer to the index
+ * @param lag - The lag in frames
+ * @param window - The window size in frames
+ * @param count_buf - Long buffer in which the number of repeats in the window is returned
+ * @return The first frame of the earliest best window
+ */
+unsigned long find_lag_start (const FingerprintIndex* index, unsigned long lag, unsigned long window, unsigned long* count_buf) {
+    unsigned long* counts;
+    unsigned long i, j;
+    unsigned long frame, distance;
+    unsigned long sum = 0;
+    int matches;
+    unsigned long best_sum = 0;
+    unsigned long best_start = 0;
+
+    *count_buf = 0;
+    counts = (unsigned long*) calloc(index->num_frames + 1, sizeof(unsigned long));
+    if (counts == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < index->num_landmarks; i++) {
+        frame = index->frames[i];
+        matches = 0;
+        for (j = index->next[i]; j < index->num_landmarks && matches < FINGERPRINT_MAX_MATCHES; j = index->next[j]) {
+            if (index->hashes[j] != index->hashes[i]) {
+                continue;
+            }
+            matches++;
+            distance = index->frames[j] - frame;
+            if (distance > lag + 1) {
+                break;
+            }
+            if (distance + 1 >= lag) {
+                counts[frame]++;
+            }
+        }
+    }
+
+    for (i = 0; i < index->num_frames; i++) {
+        sum += counts[i];
+        if (i >= window) {
+            sum -= counts[i - window];
+        }
+        if (i + 1 >= window && sum > best_sum) {
+            best_sum = sum;
+            best_start = i + 1 - window;
+        }
+    }
+
+    free(counts);
+    *count_buf = best_sum;
+    return best_start;
+}
@@ -0,0 +1,28 @@
+/* fingerprint frames per second of audio, a 20 ms hop */
+#define FINGERPRINT_FRAME_RATE 50
+
+/**
+ * Landmarks of the audio (pairs of spectral peaks close in time) in a chained hash table,
+ * so the other occurrences of a landmark are found in constant time
+ */
+typedef struct fingerprint_index {
+    /* hash of each landmark and the frame of its first peak */
+    unsigned long* hashes;
+    unsigned long* frames;
+    /* next later landmark in the same bucket, num_landmarks at the end of a chain */
+    unsigned long* next;
+    unsigned long num_landmarks;
+    /* first landmark of each bucket, num_landmarks if empty */
+    unsigned long* buckets;
+    unsigned long num_buckets;
+    unsigned long num_frames;
+    unsigned long hop_size;
+} FingerprintIndex;
+
+int build_fingerprint_index (const short* samples, unsigned long num_frames, int num_channels, unsigned long sample_rate, FingerprintIndex* index);
+
+void free_fingerprint_index (FingerprintIndex* index);
+
+void vote_lags (const FingerprintIndex* index, unsigned long min_lag, unsigned long* votes);
+
+unsigned long find_lag_start (const FingerprintIndex* index, unsigned long lag, unsigned long window, unsigned long* count_buf);
@@ -4,9 +4,39 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <limits.h>
+#include <math.h>
 #include "parse_wav.h"
+#include "planar.h"
 #include "loop.h"
+#include "report.h"
+#include "settings.h"
+#include "fft.h"
+#include "simd.h"
+#include "threadpool.h"
+
+/* relative error allowed for FFT correlation scores before an offset is scored exactly */
+#define CORRELATION_TOLERANCE 1e-11
+/* searches over at most this many offsets are scored directly, quicker than setting up the FFTs */
+#define DIRECT_SEARCH_MAX_OFFSETS 128
+
+/**
+ * A scan of the offsets of a LoopEndSearch, split into ranges for the thread pool
+ */
+typedef struct {
+    LoopEndSearch* search;
+    /* FFT estimates of the scores, NULL to score every offset */
+    const double* estimates;
+    double tolerance;
+    /* offset already scored exactly, which only lower offsets can tie */
+    unsigned long seed_offset;
+    unsigned long seed_score;
+    unsigned long chunk_size;
+    /* lowest offset with the best score in each range */
+    unsigned long* best_offsets;
+    unsigned long* best_scores;
+} OffsetScan;
 
 /**
  * Copies a number of samples from the wav file into a buffer
@@ -20,22 +50,26 @@
 int read_samples (WavFile* wavfile, sndbuf* buf, int channels, unsigned long offset, unsigned long duration) {
     unsigned long res = 0;
     short* wav_ptr;
-    int i;
+    unsigned long i;
 
     /* Seek to offset */
-    if (offset > wavfile->num_frames) {
+    if (offset * channels > wavfile->num_frames) {
         return 1;
     }
     wav_ptr = wavfile->unscaled_frames + offset * channels;
    
-    /* Save a section of the audio of the specified duration */
+    /* Save a section of the audio of the specified duration, padding with silence past the end */
     buf->size = duration * channels;
     buf->data = (short*) malloc(buf->size * sizeof(short));
     for (i = 0; i < buf->size; i++) {
-        buf->data[i] = wav_ptr[i];
-        res++;
+        if (offset * channels + i < wavfile->num_frames) {
+            buf->data[i] = wav_ptr[i];
+            res++;
+        } else {
+            buf->data[i] = 0;
+        }
     }
-    if (res < duration) {
+    if (res < buf->size) {
         printf("WARNING: Reached end of file before reading all samples. Number of samples read: %lu\n", res);
     }
 
@@ -43,38 +77,363 @@ int read_samples (WavFile* wavfile, sndbuf* buf, int channels, unsigned long off
 }
 
 /**
- * Finds the closest matching looping point from the end timestamp
- * @param start_buf - The buffer for the samples at the start of the loop
- * @param end_buf - The buffer for the samples at the end of the loop
- * @param channels - The number of channels in the audio
- * @return The optimal offset in end_buf
+ * Sum of squared differences between the start samples and the end samples at one offset
+ * @param search - The pointer to the search
+ * @param offset - The candidate offset
+ * @return The exact score
  */
-unsigned long find_loop_end (sndbuf* start_buf, sndbuf* end_buf, int channels) {
-    unsigned long duration = start_buf->size / channels;
-    unsigned int best_offset = 0;
+static unsigned long get_offset_score (LoopEndSearch* search, unsigned long offset) {
+    unsigned long score = 0;
+    int p;
+
+    for (p = 0; p < search->num_parts; p++) {
+        score += sum_sq_diff_s16(search->starts[p], search->ends[p] + offset * search->stride, search->size);
+    }
+    return score;
+}
+
+/**
+ * Like get_offset_score, but stops early once the score exceeds a limit
+ * @param search - The pointer to the search
+ * @param offset - The candidate offset
+ * @param limit - The largest score of interest
+ * @return The exact score if it is at most limit, otherwise a partial score above limit
+ */
+static unsigned long get_offset_score_bounded (LoopEndSearch* search, unsigned long offset, unsigned long limit) {
+    unsigned long score = 0;
+    int p;
+
+    for (p = 0; p < search->num_parts && score <= limit; p++) {
+        score += sum_sq_diff_s16_bounded(search->starts[p], search->ends[p] + offset * search->stride, search->size, limit - score);
+    }
+    return score;
+}
+
+/**
+ * Scores the index-th range of offsets of an OffsetScan, keeping the lowest offset with the best score
+ * @param arg - The pointer to the OffsetScan
+ * @param index - The index of the range
+ */
+static void scan_offsets (void* arg, unsigned long index) {
+    OffsetScan* scan = (OffsetScan*) arg;
+    unsigned long first = index * scan->chunk_size;
+    unsigned long last = first + scan->chunk_size;
+    unsigned long best_offset = 0;
     unsigned long best_score = ULONG_MAX;
+    unsigned long num_abandoned = 0;
     unsigned long score;
-    int diff;
-    unsigned int i;
-    unsigned int j;
-
-    for (i = 0; i < duration; i++) {
-        /* Calculate score for current offset */
-        score = 0;
-        for (j = 0; j < duration * channels; j += 1) {
-            diff = start_buf->data[j] - end_buf->data[i * channels + j];
-            score += diff * diff;
+    unsigned long limit;
+    unsigned long seed_limit;
+    unsigned long i;
+
+    if (last > scan->search->num_offsets) {
+        last = scan->search->num_offsets;
+    }
+
+    for (i = first; i < last; i++) {
+        if (scan->estimates != NULL) {
+            /* Only offsets that could tie or beat the seed, which already wins ties with later offsets */
+            if (i == scan->seed_offset) {
+                continue;
+            }
+            if (i < scan->seed_offset && scan->estimates[i] - scan->tolerance > (double) scan->seed_score) {
+                continue;
+            }
+            if (i > scan->seed_offset && (scan->seed_score == 0 || scan->estimates[i] - scan->tolerance >= (double) scan->seed_score)) {
+                continue;
+            }
         }
 
-        /* Update best score */
-        if (score < best_score) {
+        /* Only a strictly lower score beats an earlier offset of this range, and the seed needs
+        a score no higher (earlier offsets) or strictly lower (later offsets) */
+        if (best_score == 0) {
+            break;
+        }
+        limit = best_score - 1;
+        if (scan->estimates != NULL) {
+            seed_limit = i < scan->seed_offset ? scan->seed_score : scan->seed_score - 1;
+            limit = seed_limit < limit ? seed_limit : limit;
+        }
+        if (settings.exhaustive) {
+            limit = ULONG_MAX;
+        }
+
+        score = get_offset_score_bounded(scan->search, i, limit);
+        if (score > limit) {
+            num_abandoned++;
+        } else if (score < best_score) {
             best_score = score;
             best_offset = i;
         }
     }
 
-    printf("Best score: %lu\n", best_score);
-    printf("Best offset: %d\n", best_offset);
+    count_abandoned(num_abandoned);
+
+    scan->best_offsets[index] = best_offset;
+    scan->best_scores[index] = best_score;
+}
+
+/**
+ * Splits the offsets of a scan into ranges scored on the thread pool, then reduces the per range
+ * results in offset order so ties resolve to the lowest offset exactly as a sequential scan would
+ * @param scan - The pointer to the scan, with search, estimates, tolerance and seed set
+ * @param best_score_buf - Long buffer in which the best score is returned
+ * @return The lowest offset with the best score
+ */
+static unsigned long run_offset_scan (OffsetScan* scan, unsigned long* best_score_buf) {
+    unsigned long num_chunks = 4 * (unsigned long) get_num_threads();
+    unsigned long best_offset = scan->seed_offset;
+    unsigned long best_score = scan->seed_score;
+    unsigned long k;
+
+    scan->chunk_size = (scan->search->num_offsets + num_chunks - 1) / num_chunks;
+    num_chunks = (scan->search->num_offsets + scan->chunk_size - 1) / scan->chunk_size;
+    scan->best_offsets = (unsigned long*) malloc(2 * num_chunks * sizeof(unsigned long));
+    scan->best_scores = scan->best_offsets + num_chunks;
+
+    parallel_for(num_chunks, scan_offsets, scan);
+
+    for (k = 0; k < num_chunks; k++) {
+        if (scan->best_scores[k] < best_score || (scan->best_scores[k] == best_score && scan->best_offsets[k] < best_offset)) {
+            best_score = scan->best_scores[k];
+            best_offset = scan->best_offsets[k];
+        }
+    }
+
+    free(scan->best_offsets);
+    *best_score_buf = best_score;
+    return best_offset;
+}
+
+/**
+ * Scores every offset directly, the O(n^2) reference for find_best_offset_fft
+ * @param search - The pointer to the search
+ * @param best_score_buf - Long buffer in which the best score is returned
+ * @return The lowest offset with the best score
+ */
+static unsigned long find_best_offset_brute_force (LoopEndSearch* search, unsigned long* best_score_buf) {
+    OffsetScan scan;
+
+    scan.search = search;
+    scan.estimates = NULL;
+    scan.tolerance = 0.0;
+    scan.seed_offset = search->num_offsets;
+    scan.seed_score = ULONG_MAX;
+    return run_offset_scan(&scan, best_score_buf);
+}
+
+/**
+ * Finds the same offset as find_best_offset_brute_force in O(n log n). The score at each offset is
+ * split into the start energy, the end energy (from prefix sums) and an FFT cross-correlation.
+ * Offsets whose estimate is within the rounding error bound of the best are then scored exactly,
+ * so the result does not depend on floating point error
+ * @param search - The pointer to the search
+ * @param best_offset_buf - Long buffer in which the lowest offset with the best score is returned
+ * @param best_score_buf - Long buffer in which the best score is returned
+ * @return Whether the correlation could be computed (0 if success)
+ */
+static int find_best_offset_fft (LoopEndSearch* search, unsigned long* best_offset_buf, unsigned long* best_score_buf) {
+    unsigned long end_size = (search->num_offsets - 1) * search->stride + search->size;
+    unsigned long num_lags = (search->num_offsets - 1) * search->stride + 1;
+    unsigned long start_energy = 0;
+    unsigned long* end_energy;
+    double* correlation;
+    double* estimates;
+    double tolerance;
+    double bits = 1.0;
+    unsigned long best_offset = 0;
+    unsigned long best_score;
+    unsigned long i;
+    unsigned long j;
+    int p;
+    int res = 0;
+    OffsetScan scan;
+
+    end_energy = (unsigned long*) calloc(end_size + 1, sizeof(unsigned long));
+    correlation = (double*) malloc(num_lags * sizeof(double));
+    estimates = (double*) malloc(search->num_offsets * sizeof(double));
+    if (end_energy == NULL || correlation == NULL || estimates == NULL) {
+        res = 1;
+    }
+
+    for (p = 0; p < search->num_parts && res == 0; p++) {
+        for (j = 0; j < search->size; j++) {
+            start_energy += (long) search->starts[p][j] * search->starts[p][j];
+        }
+        /* prefix sums of the end energy, summed over the parts */
+        for (j = 0; j < end_size; j++) {
+            end_energy[j + 1] += (long) search->ends[p][j] * search->ends[p][j];
+        }
+        res = cross_correlate(search->starts[p], search->size, search->ends[p], end_size, correlation, num_lags, p > 0);
+    }
+
+    if (res != 0) {
+        free(end_energy);
+        free(correlation);
+        free(estimates);
+        return 1;
+    }
+
+    for (j = 0; j < end_size; j++) {
+        end_energy[j + 1] += end_energy[j];
+    }
+    for (i = 0; i < search->num_offsets; i++) {
+        estimates[i] = (double) start_energy
+            + (double) (end_energy[i * search->stride + search->size] - end_energy[i * search->stride])
+            - 2.0 * correlation[i * search->stride];
+        if (estimates[i] < estimates[best_offset]) {
+            best_offset = i;
+        }
+    }
+
+    /* FFT rounding error grows with log2 of the transform size and the signal energies */
+    for (j = end_size; j > 1; j /= 2) {
+        bits += 1.0;
+    }
+    tolerance = CORRELATION_TOLERANCE * bits * sqrt((double) start_energy * (double) end_energy[end_size]) + 1.0;
+
+    /* Verify every offset that could tie or beat the best estimate, ties going to the lowest offset */
+    scan.search = search;
+    scan.estimates = estimates;
+    scan.tolerance = tolerance;
+    scan.seed_offset = best_offset;
+    scan.seed_score = get_offset_score(search, best_offset);
+    best_offset = run_offset_scan(&scan, &best_score);
+
+    free(end_energy);
+    free(correlation);
+    free(estimates);
+    *best_offset_buf = best_offset;
+    *best_score_buf = best_score;
+    return 0;
+}
+
+/**
+ * Finds the offset with the lowest sum of squared differences, using the FFT correlation unless
+ * --brute-force asks for the reference search
+ * @param search - The pointer to the search
+ * @param best_score_buf - Long buffer in which the best score is returned
+ * @return The lowest offset with the best score
+ */
+unsigned long search_loop_end (LoopEndSearch* search, unsigned long* best_score_buf) {
+    unsigned long best_offset;
+
+    *best_score_buf = ULONG_MAX;
+    if (search->num_offsets == 0) {
+        return 0;
+    }
+
+    count_candidates(search->num_offsets);
+    if (!settings.brute_force && search->num_offsets > DIRECT_SEARCH_MAX_OFFSETS && find_best_offset_fft(search, &best_offset, best_score_buf) == 0) {
+        return best_offset;
+    }
+    return find_best_offset_brute_force(search, best_score_buf);
+}
+
+/**
+ * Searches the loop end with one contiguous part per channel
+ * @param starts - The first sample of each channel at the start of the loop
+ * @param ends - The first sample of each channel at the estimated end of the loop
+ * @param num_channels - The number of channels
+ * @param size - The number of frames compared
+ * @param num_offsets - The number of end offsets to score
+ * @return The lowest frame offset from ends with the best score
+ */
+static unsigned long search_planar_loop_end (short** starts, short** ends, int num_channels, unsigned long size, unsigned long num_offsets) {
+    LoopEndSearch search;
+    unsigned long best_offset;
+    unsigned long best_score;
+
+    search.starts = starts;
+    search.ends = ends;
+    search.num_parts = num_channels;
+    search.size = size;
+    search.stride = 1;
+    search.num_offsets = num_offsets;
+
+    best_offset = search_loop_end(&search, &best_score);
+    log_info("Best score: %lu\n", best_score);
+    log_info("Best offset: %lu\n", best_offset);
+    return best_offset;
+}
+
+/**
+ * Finds the closest matching looping point from the end timestamp. The windows are split into
+ * one part per channel, so the correlation runs over contiguous samples of a single channel
+ * @param start_buf - The buffer for the samples at the start of the loop
+ * @param end_buf - The buffer for the samples at the end of the loop, usually twice as long.
+ *                  Only offsets at which all of start_buf fits in end_buf are scored
+ * @param channels - The number of channels in the audio
+ * @return The optimal offset in end_buf
+ */
+unsigned long find_loop_end (sndbuf* start_buf, sndbuf* end_buf, int channels) {
+    planarbuf starts, ends;
+    unsigned long num_frames = start_buf->size / channels;
+    unsigned long num_offsets = num_frames;
+    unsigned long best_offset;
+
+    if (end_buf->size < num_frames * channels) {
+        num_offsets = 0;
+    } else if (end_buf->size / channels - num_frames + 1 < num_offsets) {
+        num_offsets = end_buf->size / channels - num_frames + 1;
+    }
+
+    if (channels == 1) {
+        return search_planar_loop_end(&start_buf->data, &end_buf->data, 1, num_frames, num_offsets);
+    }
+    if (make_planar(start_buf->data, num_frames * channels, channels, &starts) != 0) {
+        printf("ERROR: Failed to allocate the planar samples!\n");
+        return 0;
+    }
+    if (make_planar(end_buf->data, end_buf->size, channels, &ends) != 0) {
+        printf("ERROR: Failed to allocate the planar samples!\n");
+        free_planar(&starts);
+        return 0;
+    }
+    best_offset = search_planar_loop_end(starts.channels, ends.channels, channels, num_frames, num_offsets);
+    free_planar(&starts);
+    free_planar(&ends);
+    return best_offset;
+}
+
+/**
+ * Finds the closest matching looping point from the end offset in the planar samples of a track
+ * @param buf - The planar samples of the whole track
+ * @param start_offset - The frame at the start of the loop
+ * @param end_offset - The estimated frame at the end of the loop
+ * @param window_size - The number of frames compared, which is also the most offsets scored
+ * @param search_size - The number of frames from end_offset the compared window may reach
+ * @return The optimal offset (in frames) from end_offset
+ */
+unsigned long find_loop_end_planar (const planarbuf* buf, unsigned long start_offset, unsigned long end_offset, unsigned long window_size, unsigned long search_size) {
+    unsigned long num_offsets = window_size;
+    unsigned long best_offset;
+    short** parts;
+    int c;
+
+    /* only offsets whose window ends inside the search and the track */
+    if (end_offset > buf->length) {
+        search_size = 0;
+    } else if (search_size > buf->length - end_offset) {
+        search_size = buf->length - end_offset;
+    }
+    if (search_size < window_size) {
+        num_offsets = 0;
+    } else if (search_size - window_size + 1 < num_offsets) {
+        num_offsets = search_size - window_size + 1;
+    }
+
+    parts = (short**) malloc(2 * buf->num_channels * sizeof(short*));
+    if (parts == NULL) {
+        printf("ERROR: Failed to allocate the planar samples!\n");
+        return 0;
+    }
+    for (c = 0; c < buf->num_channels; c++) {
+        parts[c] = buf->channels[c] + start_offset;
+        parts[buf->num_channels + c] = buf->channels[c] + end_offset;
+    }
+    best_offset = search_planar_loop_end(parts, parts + buf->num_channels, buf->num_channels, window_size, num_offsets);
+    free(parts);
     return best_offset;
 }
 
@@ -103,7 +462,7 @@ unsigned long find_loop_end_short_arr (short* start_buf, unsigned long start_buf
  * @param dst - The short buffer to copy into
  */
 void copy_samples (sndbuf* src_buf, short* dst) {
-    unsigned int i;
+    unsigned long i;
     for (i = 0; i < src_buf->size; i++) {
         dst[i] = src_buf->data[i];
     }
@@ -119,7 +478,7 @@ void copy_samples (sndbuf* src_buf, short* dst) {
  * @param crossfade_dist - Distance, in offset number, to crossfade into
 */
 void crossfade_samples (sndbuf* src_buf, short* dst, sndbuf* crossfade_buf, unsigned long crossfade_dist) {
-    unsigned int i;
+    unsigned long i;
     for (i = 0; i < src_buf->size; i++) {
         if (i < crossfade_dist && i < crossfade_buf->size) {
             float proportion = i / (float)crossfade_dist;
@@ -132,113 +491,97 @@ void crossfade_samples (sndbuf* src_buf, short* dst, sndbuf* crossfade_buf, unsi
 }
 
 /**
- * Creates a buffer of the extended audio
- * @param extended_buf - The pointer to the buffer for the extended audio
- * @param intro_buf - The pointer to the buffer that contains all audio before the loop
- * @param loop_buf - The pointer to the buffer that contains the audio in the loop
- * @param ending_buf - The pointer to the buffer that contains all audio after the loop
- * @param num_loops - The number of loops in the extended audio
+ * Computes how many times the loop must repeat for the extended audio to reach a minimum length.
+ * All sizes are in frames and use unsigned long, so multi-hour renders do not overflow on LP64 systems
+ * @param min_length - The minimum length of the extended audio (in seconds)
+ * @param sample_rate - The sample rate of the audio
+ * @param intro_size - The number of frames before the loop
+ * @param loop_size - The number of frames in the loop
+ * @param ending_size - The number of frames after the loop
+ * @return The number of loops (at least 1), or 0 if the loop is empty
  */
-void extend_audio (sndbuf* extended_buf, sndbuf* intro_buf, sndbuf* loop_buf, sndbuf* ending_buf, unsigned int num_loops) {
-    short* seek_ptr;
-    unsigned int loop_ctr;
-    /* int first = 1; */
-
-    /* Create a buffer for the extended audio */
-    extended_buf->size = intro_buf->size + loop_buf->size * num_loops + ending_buf->size;
-    extended_buf->data = (short*) malloc(extended_buf->size * sizeof(short));
-    seek_ptr = extended_buf->data;
-
-    /* Copy intro */
-    copy_samples(intro_buf, seek_ptr);
-    seek_ptr += intro_buf->size;
-
-    /* Copy loops */
-    for (loop_ctr = 0; loop_ctr < num_loops; loop_ctr++) {
-        copy_samples(loop_buf, seek_ptr);
-
-        /*
-        if (first) 
-            copy_samples(loop_buf, seek_ptr);
-        else 
-            crossfade_samples(loop_buf, seek_ptr, ending_buf, 4 * 44100);
-        first = 0;
-        */
-
-        seek_ptr += loop_buf->size;
+unsigned long compute_num_loops (unsigned long min_length, unsigned long sample_rate, unsigned long intro_size, unsigned long loop_size, unsigned long ending_size) {
+    unsigned long target_size = min_length * sample_rate;
 
+    if (loop_size == 0) {
+        return 0;
     }
-
-    /* Copy ending */
-    copy_samples(ending_buf, seek_ptr);
+    if (target_size <= intro_size + ending_size) {
+        return 1;
+    }
+    return (target_size - intro_size - ending_size) / loop_size + 1;
 }
 
 /**
- * Finds the best loop point from user input and creates the extended audio
+ * Refines the loop end and works out the frame ranges of the extended audio, without creating it
  * @param f - The pointer to the input wav file
- * @param start_time - The estimated timestamp for the start of the loop (in seconds)
- * @param end_time - The estimated timestamp for the end of the loop (in seconds)
+ * @param start_offset - The frame at which the loop starts
+ * @param end_offset - The estimated frame at which the loop ends
  * @param min_length - The minimum length of the extended audio (in seconds)
- * @param fout - The pointer to the output wav file
- * @return Whether the audio extension is successful (0 if success)
- */
-int loop (WavFile* f, unsigned int start_time, unsigned int end_time, unsigned int min_length, WavFile* fout) {
-    unsigned long intro_size, end_offset, loop_size, ending_size;
-    sndbuf start_buf, end_buf, loop_buf, intro_buf, ending_buf, extended_buf;
-    int res;
-    unsigned int num_loops;
+ * @param plan - The pointer in which the loop ranges are returned
+ * @return 0 if success, LOOP_INVALID_START or LOOP_INVALID_END for out of range offsets,
+ *         LOOP_EMPTY if the refined loop has no frames
+ */
+int plan_loop (WavFile* f, unsigned long start_offset, unsigned long end_offset, unsigned long min_length, LoopPlan* plan) {
+    sndbuf start_buf, end_buf;
+    unsigned long num_frames = f->num_frames / f->headers.num_channels;
+    unsigned long window_size;
+    unsigned long search_size;
+    unsigned long ending_size;
     WavHeaders info = f->headers;
 
-    /* Save a section of the audio at the start time for comparison */
-    intro_size = start_time * info.sample_rate;
-    res = read_samples(f, &start_buf, info.num_channels, intro_size, info.sample_rate);
-    if (res) {
-        printf("ERROR: %i is an invalid timestamp!\n", start_time);
-        return 1;
+    if (start_offset > num_frames) {
+        return LOOP_INVALID_START;
+    }
+    if (end_offset > num_frames) {
+        return LOOP_INVALID_END;
     }
 
-    /* Save a section of end time audio */
-    end_offset = end_time * info.sample_rate;
-    res = read_samples(f, &end_buf, info.num_channels, end_offset, 2 * info.sample_rate);
-    if (res) {
-        printf("ERROR: %i is an invalid timestamp!\n", end_time);
+    /* Compare a second of audio over two seconds of end offsets, cut short by the end of the
+    track so the search never scores the silence past it */
+    window_size = info.sample_rate;
+    search_size = 2 * (unsigned long) info.sample_rate;
+    if (window_size > num_frames - start_offset) {
+        window_size = num_frames - start_offset;
+    }
+    if (window_size > num_frames - end_offset) {
+        window_size = num_frames - end_offset;
+    }
+    if (search_size > num_frames - end_offset) {
+        search_size = num_frames - end_offset;
+    }
+
+    /* Save a section of the audio at the start of the loop for comparison */
+    if (read_samples(f, &start_buf, info.num_channels, start_offset, window_size)) {
+        return LOOP_INVALID_START;
+    }
+
+    /* Save a section of the audio at the estimated end of the loop */
+    if (read_samples(f, &end_buf, info.num_channels, end_offset, search_size)) {
         free(start_buf.data);
-        return 1;
+        return LOOP_INVALID_END;
     }
 
     /* Find looping point */
     end_offset += find_loop_end(&start_buf, &end_buf, info.num_channels);
+    free(start_buf.data);
+    free(end_buf.data);
 
-    /* Store the data for a loop */
-    loop_size = end_offset - intro_size;
-    read_samples(f, &loop_buf, info.num_channels, intro_size, loop_size);
-
-    /* Store the data for the intro */
-    read_samples(f, &intro_buf, info.num_channels, 0, intro_size);
-
-    /* Store the data for the ending */
-    ending_size = f->num_frames / info.num_channels - end_offset;
-    read_samples(f, &ending_buf, info.num_channels, end_offset, ending_size);
+    /* find_loop_end only tries offsets whose whole window lies in end_buf */
+    if (end_offset > num_frames) {
+        printf("ERROR: The refined loop end %lu is past the end of the track!\n", end_offset);
+        return LOOP_INVALID_END;
+    }
 
     /* Compute number of loops */
-    num_loops = (min_length * info.sample_rate - intro_size - ending_size) / loop_size + 1;
-    printf("Number of loops: %d\n", num_loops);
-
-    /* Create buffer for extended audio */
-    extend_audio(&extended_buf, &intro_buf, &loop_buf, &ending_buf, num_loops);
-
-    /* Write buffer into new file */
-    fout->unscaled_frames = extended_buf.data;
-    fout->num_frames = extended_buf.size;
-    fout->headers.data_chunk_size = extended_buf.size * 2;
-    fout->headers.chunk_size = 28 + fout->headers.sub_chunk1_size + fout->headers.sub_chunk2_size +
-                                fout->headers.data_chunk_size;
+    ending_size = num_frames - end_offset;
+    plan->start_offset = start_offset;
+    plan->end_offset = end_offset;
+    plan->num_loops = compute_num_loops(min_length, info.sample_rate, start_offset, end_offset - start_offset, ending_size);
+    if (plan->num_loops == 0) {
+        return LOOP_EMPTY;
+    }
 
-    /* Clean up */
-    free(start_buf.data);
-    free(end_buf.data);
-    free(intro_buf.data);
-    free(loop_buf.data);
-    free(ending_buf.data);
+    log_info("Number of loops: %lu\n", plan->num_loops);
     return 0;
 }
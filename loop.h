@@ -6,16 +6,49 @@ typedef struct sound_buffer {
     unsigned long size;
 } sndbuf;
 
+/**
+ * Frame ranges of the extended audio: the intro up to start_offset,
+ * the loop from start_offset to end_offset repeated num_loops times, then the ending
+ */
+typedef struct loop_plan {
+    unsigned long start_offset;
+    unsigned long end_offset;
+    unsigned long num_loops;
+} LoopPlan;
+
+/**
+ * Candidate loop end offsets to score. The score at an offset is the sum over the parts
+ * (interleaved samples, or one part per planar channel) of the squared differences between
+ * starts[p][j] and ends[p][offset * stride + j] for j < size
+ */
+typedef struct {
+    short** starts;
+    short** ends;
+    int num_parts;
+    unsigned long size;
+    unsigned long stride;
+    unsigned long num_offsets;
+} LoopEndSearch;
+
+/* plan_loop error codes */
+#define LOOP_INVALID_START 1
+#define LOOP_INVALID_END 2
+#define LOOP_EMPTY 3
+
 int read_samples (WavFile* wavfile, sndbuf* buf, int channels, unsigned long offset, unsigned long duration);
 
+unsigned long search_loop_end (LoopEndSearch* search, unsigned long* best_score_buf);
+
 unsigned long find_loop_end (sndbuf* start_buf, sndbuf* end_buf, int channels);
 
 unsigned long find_loop_end_short_arr (short* start_buf, unsigned long start_buf_size, short* end_buf, unsigned long end_buf_size, int channels);
 
+unsigned long find_loop_end_planar (const planarbuf* buf, unsigned long start_offset, unsigned long end_offset, unsigned long window_size, unsigned long search_size);
+
 void copy_samples (sndbuf* src_buf, short* dst);
 
 void crossfade_samples (sndbuf* src_buf, short* dst, sndbuf* crossfade_buf, unsigned long crossfade_dist);
 
-void extend_audio (sndbuf* extended_buf, sndbuf* intro_buf, sndbuf* loop_buf, sndbuf* ending_buf, unsigned int num_loops);
+unsigned long compute_num_loops (unsigned long min_length, unsigned long sample_rate, unsigned long intro_size, unsigned long loop_size, unsigned long ending_size);
 
-int loop (WavFile* f, unsigned int start_time, unsigned int end_time, unsigned int min_length, WavFile* fout);
+int plan_loop (WavFile* f, unsigned long start_offset, unsigned long end_offset, unsigned long min_length, LoopPlan* plan);
@@ -2,110 +2,252 @@
  * @file main.c
  * @brief Entry point for the audio extension program
  */
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "parse_wav.h"
+#include "planar.h"
 #include "loop.h"
-#include "autoloop.h"
 #include "fsm.h"
+#include "settings.h"
+#include "threadpool.h"
+#include "report.h"
+#include "simd.h"
+#include "batch.h"
+#include "server.h"
 
-int main (int argc, char** argv) {
-    unsigned long start_time, end_time, min_length;
-    int res;
+/**
+ * Applies the --options on the command line to the run-wide settings and removes them from argv,
+ * leaving only the positional arguments in place
+ * @param argc - The number of arguments
+ * @param argv - The arguments, compacted in place
+ * @return The number of arguments left, or -1 if an option is not recognised
+ */
+static int parse_options (int argc, char** argv) {
+    int i;
+    int num_args = 1;
     char* end_ptr;
-    FILE* fp;
-    FILE* fpout;
-    WavFile f, fout;
-    FileExtFSM fileExtFsm;
     NumFSM numFsm;
 
-    /* Perform checks on input */
-    if (argc != 4 && argc != 6) {
-        printf("ERROR: Insufficient number of arguments!\n");
-        printf("Usage: ./main INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME] [END_TIME]\n");
-        printf("START_TIME, END_TIME and MIN_LENGTH should be provided in seconds\n");
-        return 1;
+    init_settings(&settings);
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--copy-range") == 0) {
+            settings.copy_range = 1;
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            initNumFSM(&numFsm);
+            if (i + 1 == argc || !runNumFsm(&numFsm, argv[i + 1])) {
+                printf("ERROR: --threads needs a number of threads!\n");
+                return -1;
+            }
+            settings.num_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--brute-force") == 0) {
+            settings.brute_force = 1;
+        } else if (strcmp(argv[i], "--exhaustive") == 0) {
+            settings.exhaustive = 1;
+        } else if (strcmp(argv[i], "--simd") == 0) {
+            if (i + 1 == argc) {
+                printf("ERROR: --simd needs an instruction set!\n");
+                return -1;
+            }
+            i++;
+            if (strcmp(argv[i], "scalar") == 0) {
+                settings.simd_level = SIMD_SCALAR;
+            } else if (strcmp(argv[i], "sse2") == 0) {
+                settings.simd_level = SIMD_SSE2;
+            } else if (strcmp(argv[i], "avx2") == 0) {
+                settings.simd_level = SIMD_AVX2;
+            } else if (strcmp(argv[i], "avx512") == 0) {
+                settings.simd_level = SIMD_AVX512;
+            } else {
+                printf("ERROR: Unknown instruction set %s!\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            settings.quiet = 1;
+        } else if (strcmp(argv[i], "--report") == 0) {
+            if (i + 1 == argc) {
+                printf("ERROR: --report needs a file path!\n");
+                return -1;
+            }
+            settings.report_path = argv[++i];
+        } else if (strcmp(argv[i], "--report-fd") == 0) {
+            initNumFSM(&numFsm);
+            if (i + 1 == argc || !runNumFsm(&numFsm, argv[i + 1])) {
+                printf("ERROR: --report-fd needs a file descriptor!\n");
+                return -1;
+            }
+            settings.report_fd = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--engine") == 0) {
+            if (i + 1 == argc) {
+                printf("ERROR: --engine needs a search engine!\n");
+                return -1;
+            }
+            i++;
+            if (strcmp(argv[i], "window") == 0) {
+                settings.engine = ENGINE_WINDOW;
+            } else if (strcmp(argv[i], "pyramid") == 0) {
+                settings.engine = ENGINE_PYRAMID;
+            } else if (strcmp(argv[i], "features") == 0) {
+                settings.engine = ENGINE_FEATURES;
+            } else if (strcmp(argv[i], "fingerprint") == 0) {
+                settings.engine = ENGINE_FINGERPRINT;
+            } else {
+                printf("ERROR: Unknown search engine %s!\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--deadline") == 0) {
+            if (i + 1 == argc || (settings.deadline = strtod(argv[i + 1], &end_ptr)) < 0 || end_ptr == argv[i + 1] || *end_ptr != '\0') {
+                printf("ERROR: --deadline needs a number of seconds!\n");
+                return -1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--accept-score") == 0) {
+            initNumFSM(&numFsm);
+            if (i + 1 == argc || !runNumFsm(&numFsm, argv[i + 1])) {
+                printf("ERROR: --accept-score needs a score!\n");
+                return -1;
+            }
+            settings.accept_score = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            if (i + 1 == argc) {
+                printf("ERROR: --cache needs a directory!\n");
+                return -1;
+            }
+            settings.cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            if (i + 1 == argc) {
+                printf("ERROR: --batch needs a manifest!\n");
+                return -1;
+            }
+            settings.batch_path = argv[++i];
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            initNumFSM(&numFsm);
+            if (i + 1 == argc || !runNumFsm(&numFsm, argv[i + 1])) {
+                printf("ERROR: --jobs needs a number of jobs!\n");
+                return -1;
+            }
+            settings.num_jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--memory-budget") == 0) {
+            initNumFSM(&numFsm);
+            if (i + 1 == argc || !runNumFsm(&numFsm, argv[i + 1])) {
+                printf("ERROR: --memory-budget needs a number of megabytes!\n");
+                return -1;
+            }
+            settings.memory_budget = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--daemon") == 0) {
+            if (i + 1 == argc) {
+                printf("ERROR: --daemon needs a socket path!\n");
+                return -1;
+            }
+            settings.server_path = argv[++i];
+        } else if (strcmp(argv[i], "--queue-depth") == 0) {
+            initNumFSM(&numFsm);
+            if (i + 1 == argc || !runNumFsm(&numFsm, argv[i + 1])) {
+                printf("ERROR: --queue-depth needs a number of requests!\n");
+                return -1;
+            }
+            settings.queue_depth = atoi(argv[++i]);
+        } else if (strncmp(argv[i], "--", 2) == 0) {
+            printf("ERROR: Unknown option %s!\n", argv[i]);
+            return -1;
+        } else {
+            argv[num_args++] = argv[i];
+        }
     }
 
-    /* Check min length */
-    initNumFSM(&numFsm);
-    res = runNumFsm(&numFsm, argv[3]);
-    if (!res) {
-        printf("ERROR: Invalid min length!\n");
-        return 1;
+    /* the other engines have no anytime search to bound */
+    if (settings.engine != ENGINE_WINDOW && (settings.deadline > 0 || settings.accept_score > 0)) {
+        printf("ERROR: --deadline and --accept-score only apply to the window engine!\n");
+        return -1;
     }
-    min_length = strtoul(argv[3], &end_ptr, 10);
 
-    if (argc > 4) {
-        /* Check start time */
-        initNumFSM(&numFsm);
-        res=runNumFsm(&numFsm, argv[4]);
-        if (!res) {
-            printf("ERROR: Invalid start time!\n");
-            return 1;
-        }
-        start_time = strtoul(argv[4], &end_ptr, 10);
+    return num_args;
+}
 
-        /* Check end time */
-        initNumFSM(&numFsm);
-        res = runNumFsm(&numFsm, argv[5]);
-        if (!res) {
-            printf("ERROR: Invalid end time!\n");
-            return 1;
-        }
-        end_time = strtoul(argv[5], &end_ptr, 10);
+/**
+ * Writes the JSON report if one was requested and stops the worker threads
+ * @param res - The result of the run
+ * @return The exit code of the program
+ */
+static int finish_run (int res) {
+    FILE* fp;
 
-        if (start_time > end_time) {
-            printf("ERROR: Start time is after end time!\n");
-            return 1;
+    if (settings.report_path != NULL) {
+        fp = fopen(settings.report_path, "w");
+        if (fp == NULL || write_report(fp, res) != 0) {
+            printf("ERROR: Failed to write the report to %s!\n", settings.report_path);
+        }
+        if (fp != NULL) {
+            fclose(fp);
         }
     }
 
-    /* Check read file */
-    initFileExtFSM(&fileExtFsm);
-    res = runFileExtFsm(&fileExtFsm, argv[1]);
-    if (!res) {
-        printf("ERROR: File extension of %s is not .wav!\n", argv[1]);
-        return 1;
+    if (settings.report_fd >= 0) {
+        fp = fdopen(settings.report_fd, "w");
+        if (fp == NULL || write_report(fp, res) != 0) {
+            printf("ERROR: Failed to write the report to file descriptor %d!\n", settings.report_fd);
+        }
+        if (fp != NULL) {
+            fclose(fp);
+        }
     }
 
-    fp = fopen(argv[1], "r");
-    if (fp == NULL) {
-        printf("ERROR: Failed to open %s!\n", argv[1]);
-        return 1;
-    }
+    shutdown_thread_pool();
+    return res;
+}
 
-    /* Check write file */
-    initFileExtFSM(&fileExtFsm);
-    res = runFileExtFsm(&fileExtFsm, argv[2]);
-    if (!res) {
-        printf("ERROR: File extension of %s is not .wav!\n", argv[2]);
-        fclose(fp);
-        return 1;
-    }
+int main (int argc, char** argv) {
+    int res;
 
-    fpout = fopen(argv[2], "w");
-    if (fpout == NULL) {
-        printf("ERROR: Failed to open %s!\n", argv[2]);
-        fclose(fp);
+    /* Perform checks on input */
+    argc = parse_options(argc, argv);
+    if (settings.batch_path != NULL || settings.server_path != NULL ? argc != 1 : argc != 4 && argc != 6) {
+        printf("ERROR: Insufficient number of arguments!\n");
+        printf("Usage: ./main [OPTIONS] INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME] [END_TIME]\n");
+        printf("       ./main [OPTIONS] --batch MANIFEST\n");
+        printf("       ./main [OPTIONS] --daemon SOCKET\n");
+        printf("START_TIME, END_TIME and MIN_LENGTH should be provided in seconds\n");
+        printf("INPUT_FILE may be - to read the wav data from stdin\n");
+        printf("Options:\n");
+        printf("  --copy-range  assemble the output from ranges of the input file in the kernel\n");
+        printf("  --threads N   number of threads to use, 0 (the default) for one per CPU\n");
+        printf("  --brute-force score every loop end offset directly (slow reference search)\n");
+        printf("  --exhaustive  score every candidate in full, without early abandoning\n");
+        printf("  --simd SET    highest instruction set to use: scalar, sse2, avx2 or avx512 (default)\n");
+        printf("  --quiet       only print errors and warnings\n");
+        printf("  --report PATH write a JSON report of time per phase, work done and memory to PATH\n");
+        printf("  --report-fd N write the JSON report to file descriptor N\n");
+        printf("  --engine NAME loop search for the automatic mode: window (default), pyramid (coarse to fine)\n");
+        printf("                features (chroma and loudness similarity) or fingerprint (landmark index,\n");
+        printf("                for long recordings)\n");
+        printf("  --deadline S  stop the window search after S seconds with the best loop found so far,\n");
+        printf("                window engine only\n");
+        printf("  --accept-score N\n");
+        printf("                stop the window search once a loop scores below N, window engine only\n");
+        printf("  --cache DIR   reuse the loop points found for the same audio in earlier runs\n");
+        printf("  --batch PATH  extend every track of a manifest, one INPUT_FILE OUTPUT_FILE MIN_LENGTH\n");
+        printf("                [START_TIME END_TIME] per line, printing a status line per track\n");
+        printf("  --daemon PATH serve requests on the Unix domain socket PATH until SIGINT or SIGTERM\n");
+        printf("  --jobs N      tracks extended at once in batch and daemon mode, 0 (the default) for one per thread\n");
+        printf("  --memory-budget MB\n");
+        printf("                only start a track in batch mode while the estimated memory fits in MB\n");
+        printf("  --queue-depth N\n");
+        printf("                requests waiting in daemon mode before clients are turned away, default 16\n");
         return 1;
     }
 
-    if (argc == 4) {
-        res = auto_loop(fp, fpout, min_length);
-        return res;
+    init_simd_kernels(settings.simd_level);
+    if (init_thread_pool(settings.num_threads) != 0) {
+        printf("WARNING: Unable to start worker threads, running on one thread!\n");
     }
 
-    /* Extend audio and write to new file */
-    f = read_frames(fp);
-    fout.headers = f.headers;
-    res = loop(&f, start_time, end_time, min_length, &fout);
-    if (!res) {
-        write_wav(fpout, fout);
+    if (settings.server_path != NULL) {
+        res = run_server(settings.server_path);
+    } else if (settings.batch_path != NULL) {
+        res = run_batch(settings.batch_path);
+    } else {
+        res = run_job(argv + 1, argc - 1);
     }
-
-    /* Clean up */
-    fclose(fp);
-    fclose(fpout);
-    return res;
+    return finish_run(res);
 }
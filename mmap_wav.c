@@ -0,0 +1,207 @@
+/**
+ * @file mmap_wav.c
+ * @brief Zero-copy wav reader that maps the file once and walks the RIFF chunks in place
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "parse_wav.h"
+#include "mmap_wav.h"
+#include "report.h"
+
+/**
+ * Copies a range of bytes out of the mapping into a new null terminated string
+ * @param map - The start of the mapping
+ * @param start - The index of the first byte to copy
+ * @param end - The index one past the last byte to copy
+ * @return The allocated copy, or NULL if it could not be allocated
+ */
+static char * copy_map_slice (const unsigned char* map, unsigned long start, unsigned long end) {
+    char* slice = (char*) malloc(end - start + 1);
+
+    if (slice == NULL) {
+        return NULL;
+    }
+    memcpy(slice, map + start, end - start);
+    slice[end - start] = 0;
+    return slice;
+}
+
+/**
+ * Walks the RIFF chunks of a mapped wav (or RF64/BW64) file and fills in its headers.
+ * header_size is the offset of the data chunk, whose size is clamped to the bytes present
+ * @param map - The start of the mapping
+ * @param map_size - The size of the mapping
+ * @param headers - The pointer in which the headers are returned
+ * @return Whether the file is a wav file (0 if success). On failure nothing is allocated
+ */
+static int parse_wav_map (const unsigned char* map, unsigned long map_size, WavHeaders* headers) {
+    unsigned long offset;
+    unsigned long chunk_size;
+    unsigned long fmt_offset = 0;
+    unsigned long fmt_size = 0;
+    unsigned long data_offset = 0;
+    unsigned long data_size = 0;
+    unsigned long ds64_data_size = 0;
+
+    if (
+        map_size < 12 ||
+        (memcmp(map, "RIFF", 4) != 0 && memcmp(map, "RF64", 4) != 0 && memcmp(map, "BW64", 4) != 0) ||
+        memcmp(map + 8, "WAVE", 4) != 0
+    ) {
+        return 1;
+    }
+
+    /* Walk the sub-chunks in place, chunk bodies are padded to an even number of bytes */
+    offset = 12;
+    while (offset + 8 <= map_size) {
+        chunk_size = byte_str_to_long((char*) map + offset + 4, 1, 4);
+        if (memcmp(map + offset, "ds64", 4) == 0 && chunk_size >= 16 && offset + 24 <= map_size) {
+            /* RF64/BW64 keep the 64 bit data size in ds64, after the 64 bit RIFF size */
+            ds64_data_size = byte_str_to_long((char*) map + offset + 16, 1, 4) |
+                (byte_str_to_long((char*) map + offset + 20, 1, 4) << 32);
+        } else if (memcmp(map + offset, "fmt ", 4) == 0 && fmt_offset == 0) {
+            fmt_offset = offset;
+            fmt_size = chunk_size;
+        } else if (memcmp(map + offset, "data", 4) == 0) {
+            data_offset = offset;
+            data_size = chunk_size == RIFF_MAX_CHUNK_SIZE && ds64_data_size > 0 ? ds64_data_size : chunk_size;
+            break;
+        }
+        offset += 8 + chunk_size + (chunk_size & 1);
+    }
+
+    if (fmt_offset == 0 || data_offset == 0 || fmt_size < 16 || data_offset < fmt_offset + 24) {
+        return 1;
+    }
+
+    /* Tolerate truncated files by clamping the data chunk to what is actually present */
+    if (data_offset + 8 + data_size > map_size) {
+        data_size = map_size - data_offset - 8;
+    }
+
+    headers->chunk_id = copy_map_slice(map, 0, 4);
+    headers->chunk_size = (long) byte_str_to_long((char*) map + 4, 1, 4);
+    headers->format = copy_map_slice(map, 8, 12);
+    headers->sub_chunk_id = copy_map_slice(map, fmt_offset, fmt_offset + 4);
+    headers->sub_chunk1_size = (long) fmt_size;
+    headers->audio_format = (long) byte_str_to_long((char*) map + fmt_offset + 8, 1, 2);
+    headers->num_channels = (long) byte_str_to_long((char*) map + fmt_offset + 10, 1, 2);
+    headers->sample_rate = (long) byte_str_to_long((char*) map + fmt_offset + 12, 1, 4);
+    headers->byte_rate = (long) byte_str_to_long((char*) map + fmt_offset + 16, 1, 4);
+    headers->block_align = (long) byte_str_to_long((char*) map + fmt_offset + 20, 1, 2);
+    headers->bits_per_sample = (long) byte_str_to_long((char*) map + fmt_offset + 22, 1, 2);
+    /* everything after the standard 16 fmt bytes up to the data chunk */
+    headers->extra_params = copy_map_slice(map, fmt_offset + 24, data_offset);
+    headers->extra_params_size = (long) (data_offset - fmt_offset - 24);
+    headers->sub_chunk2_size = 0;
+    headers->list_chunk_data = NULL;
+    headers->data_header = copy_map_slice(map, data_offset, data_offset + 4);
+    headers->header_size = (long) data_offset;
+    headers->data_chunk_size = (long) data_size;
+    if (
+        headers->chunk_id == NULL || headers->format == NULL || headers->sub_chunk_id == NULL ||
+        headers->extra_params == NULL || headers->data_header == NULL
+    ) {
+        free_wav_headers(*headers);
+        free(headers->data_header);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Maps a regular file read-only
+ * @param fp - The file stream
+ * @param map_size_buf - Long buffer in which the size of the mapping is returned
+ * @return The mapping, or NULL if fp is not a regular file or could not be mapped
+ */
+static unsigned char * map_file (FILE* fp, unsigned long* map_size_buf) {
+    struct stat info;
+    unsigned char* map;
+
+    if (fp == NULL || fstat(fileno(fp), &info) != 0 || !S_ISREG(info.st_mode) || info.st_size < 12) {
+        return NULL;
+    }
+    map = (unsigned char*) mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    *map_size_buf = (unsigned long) info.st_size;
+    return map;
+}
+
+/**
+ * Maps a wav (or RF64/BW64) file into memory and exposes its data chunk without copying it.
+ * The returned wav file's raw_frames point directly into the read-only mapping,
+ * so it must be released with unmap_wav_frames (or free_wav_file) and never written to.
+ * Call decode_wav_frames afterwards to fill in the int16 analysis samples.
+ * @param fp - The wav file stream, which must refer to a regular file
+ * @param wav_file - The pointer in which the mapped wav file is returned
+ * @return Whether the file was mapped successfully (0 if success). On failure nothing
+ *         is allocated and the caller should fall back to a buffered reader
+ */
+int map_wav_frames (FILE* fp, WavFile* wav_file) {
+    unsigned char* map;
+    unsigned long map_size;
+    WavHeaders headers;
+
+    map = map_file(fp, &map_size);
+    if (map == NULL) {
+        return 1;
+    }
+    if (parse_wav_map(map, map_size, &headers) != 0) {
+        munmap(map, map_size);
+        return 1;
+    }
+
+    wav_file->headers = headers;
+    wav_file->frames = NULL;
+    wav_file->num_frames = 0;
+    wav_file->unscaled_frames = NULL;
+    wav_file->raw_frames = map + headers.header_size + 8;
+    wav_file->mapping = map;
+    wav_file->mapping_size = map_size;
+    count_bytes_read(map_size);
+    return 0;
+}
+
+/**
+ * Reads only the headers of a wav (or RF64/BW64) file, with the same rules as map_wav_frames.
+ * Only the pages holding the header chunks are read
+ * @param fp - The wav file stream, which must refer to a regular file
+ * @param headers - The pointer in which the headers are returned, freed with free_wav_headers
+ * @return Whether the headers were read (0 if success)
+ */
+int map_wav_headers (FILE* fp, WavHeaders* headers) {
+    unsigned char* map;
+    unsigned long map_size;
+    int res;
+
+    map = map_file(fp, &map_size);
+    if (map == NULL) {
+        return 1;
+    }
+    res = parse_wav_map(map, map_size, headers);
+    munmap(map, map_size);
+    return res;
+}
+
+/**
+ * Releases the file mapping backing a wav file returned by map_wav_frames
+ * @param wav_file - The pointer to the mapped wav file
+ */
+void unmap_wav_frames (WavFile* wav_file) {
+    if (wav_file->mapping != NULL) {
+        if ((void*) wav_file->unscaled_frames == (void*) wav_file->raw_frames) {
+            wav_file->unscaled_frames = NULL;
+        }
+        munmap(wav_file->mapping, wav_file->mapping_size);
+        wav_file->mapping = NULL;
+        wav_file->raw_frames = NULL;
+    }
+}
@@ -0,0 +1,5 @@
+int map_wav_frames (FILE* fp, WavFile* wav_file);
+
+int map_wav_headers (FILE* fp, WavHeaders* headers);
+
+void unmap_wav_frames (WavFile* wav_file);
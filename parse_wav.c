@@ -2,8 +2,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include "parse_wav.h"
+#include "mmap_wav.h"
+#include "stream_wav.h"
+#include "convert.h"
+#include "planar.h"
+#include "threadpool.h"
+#include "report.h"
 
-const int DEBUG_INDEX = 36;
+/* samples scaled per thread pool task */
+#define SCALE_CHUNK_SIZE (1UL << 20)
 
 void free_wav_headers(WavHeaders headers) {
     free(headers.chunk_id);
@@ -15,14 +22,23 @@ void free_wav_headers(WavHeaders headers) {
 void free_wav_file(WavFile wav_file) {
     free_wav_headers(wav_file.headers);
     free(wav_file.frames);
+
+    if ((void *) wav_file.unscaled_frames != (void *) wav_file.raw_frames) {
+        free(wav_file.unscaled_frames);
+    }
+    if (wav_file.mapping != NULL) {
+        unmap_wav_frames(&wav_file);
+    } else {
+        free(wav_file.raw_frames);
+    }
 }
 
 void free_wav_parse_result(WavParseResult wav_parse_result) {
-    int k;
-    for (k=0; k<wav_parse_result.num_channels; k++) {
-        free(wav_parse_result.samples[k]);
+    /* every channel points into the single block at samples[0] */
+    if (wav_parse_result.samples == NULL) {
+        return;
     }
-
+    free(wav_parse_result.samples[0]);
     free(wav_parse_result.samples);
 }
 
@@ -80,8 +96,8 @@ unsigned long byte_str_to_long(
         so byte strings with more than 4 chars might overflow
         https://en.wikipedia.org/wiki/C_data_types
         */
-        printf("BYTE_STR_TOO_LONG");
-        exit(1);
+        printf("ERROR: BYTE_STR_TOO_LONG\n");
+        return 0;
     }
 
     for (k=0; k<length; k++) {
@@ -124,85 +140,20 @@ int is_str_equal(const char * string1, const char * string2) {
     return 1;
 }
 
-char * read_str_slice(
-    FILE *fp, unsigned long start_index, unsigned long end_index
-) {
-    /* reads a string from a wav file stream */
-    unsigned long str_size;
-    unsigned long k;
-    char * str_slice;
-
-    if (end_index < start_index) {
-        printf("END_INDEX IS LESS THAN START_INDEX");
-        exit(1);
-    }
-
-    str_size = end_index - start_index + 1;
-    str_slice = (char *) malloc(str_size * sizeof(char));
-    str_slice[str_size-1] = 0;
-
-    for (k=start_index; k<end_index; k++) {
-        long str_slice_index;
-        int fget_result;
-
-        fseek(fp, (long) k, SEEK_SET);
-        str_slice_index = (long) k - (long) start_index;
-        fget_result = fgetc(fp);
-
-        if (fget_result == EOF) {
-            printf("END_OF_FILE REACHED");
-            exit(1);
-        }
-
-        /* printf("DD %lu\n %c\n", k, (char) fget_result); */
-        str_slice[str_slice_index] = (char) fget_result;
-    }
-
-    /* fseek(fp, 0L, SEEK_SET); */
-    return str_slice;
-}
-
-unsigned long read_long_from_str_slice(
-    FILE *fp, unsigned long start_index, unsigned long end_index,
-    int is_little_endian
-) {
-    /* reads a long from the wav file stream */
-    unsigned long length;
-    char * raw_str_slice;
-    unsigned long value;
-    int k;
-
-    length = end_index - start_index;
-    raw_str_slice = read_str_slice(fp, start_index, end_index);
-
-    if (start_index == DEBUG_INDEX) {
-        for (k=0; k<length; k++) {
-            printf(
-                "CHAR[%d]: %d\n", (int) start_index + k,
-                (unsigned char) raw_str_slice[k]
-            );
-        }
-    }
-
-    value = byte_str_to_long(
-        raw_str_slice, is_little_endian, length
-    );
-    free(raw_str_slice);
-    return value;
-}
-
 /* slice a substring from a source string */
 char * slice_str(const char * source_str, size_t start, size_t end) {
     char * dest_str;
     size_t length;
 
     if (end < start) {
-        printf("END CANNOT BE BEFORE START");
-        exit(1);
+        return NULL;
     }
 
     length = end - start + 1;
     dest_str = (char *) malloc(length * sizeof(char));
+    if (dest_str == NULL) {
+        return NULL;
+    }
     dest_str[length - 1] = 0;
 
     /* https://stackoverflow.com/questions/26620388/ */
@@ -211,285 +162,167 @@ char * slice_str(const char * source_str, size_t start, size_t end) {
 }
 
 void print_wav_headers(WavHeaders headers) {
-    printf("---- WAV FILE HEADERS ----\n");
-    printf("CHUNK_ID: %s\n", headers.chunk_id);
-    printf("CHUNK_SIZE: %ld\n", headers.chunk_size);
-    printf("FORMAT: %s\n", headers.format);
-    printf("SUB_CHUNK_ID: %s\n", headers.sub_chunk_id);
-    printf("SUB_CHUNK1_SIZE: %ld\n", headers.sub_chunk1_size);
-    printf("AUDIO_FORMAT: %ld\n", headers.audio_format);
-    printf("NUM_CHANNELS: %ld\n", headers.num_channels);
-    printf("SAMPLE_RATE: %ld\n", headers.sample_rate);
-    printf("BYTE_RATE: %ld\n", headers.byte_rate);
-    printf("BLOCK_ALIGN: %ld\n", headers.block_align);
-    printf("BITS_PER_SAMPLE: %ld\n", headers.bits_per_sample);
+    log_info("---- WAV FILE HEADERS ----\n");
+    log_info("CHUNK_ID: %s\n", headers.chunk_id);
+    log_info("CHUNK_SIZE: %ld\n", headers.chunk_size);
+    log_info("FORMAT: %s\n", headers.format);
+    log_info("SUB_CHUNK_ID: %s\n", headers.sub_chunk_id);
+    log_info("SUB_CHUNK1_SIZE: %ld\n", headers.sub_chunk1_size);
+    log_info("AUDIO_FORMAT: %ld\n", headers.audio_format);
+    log_info("NUM_CHANNELS: %ld\n", headers.num_channels);
+    log_info("SAMPLE_RATE: %ld\n", headers.sample_rate);
+    log_info("BYTE_RATE: %ld\n", headers.byte_rate);
+    log_info("BLOCK_ALIGN: %ld\n", headers.block_align);
+    log_info("BITS_PER_SAMPLE: %ld\n", headers.bits_per_sample);
     /* printf("EXTRA_PARAMS_SIZE: %ld\n", headers.extra_params_size); */
-    printf("EXTRA_PARAMS: [%s]\n", headers.extra_params);
-    printf("DATA_HEADER: %s\n", headers.data_header);
-    printf("DATA_CHUNK_SIZE: %ld\n", headers.data_chunk_size);
-    printf("---- WAV FILE HEADERS END ----\n");
+    log_info("EXTRA_PARAMS: [%s]\n", headers.extra_params);
+    log_info("DATA_HEADER: %s\n", headers.data_header);
+    log_info("DATA_CHUNK_SIZE: %ld\n", headers.data_chunk_size);
+    log_info("---- WAV FILE HEADERS END ----\n");
 }
 
-WavHeaders read_wav_headers(FILE * fp) {
-    /*
-     * reads the header fields from the wav file
-    */
-    char * chunk_id;
-    unsigned long chunk_size;
-    char * sub_chunk_id;
-    unsigned long sub_chunk1_size;
-    unsigned long format;
-    /* number of auto channels in the wav file */
-    unsigned long num_channels;
-    /* number of audio data samples per second of audio */
-    unsigned long sample_rate;
-    unsigned long byte_rate;
-    unsigned long block_align;
-    unsigned long bits_per_sample;
-    unsigned long extra_params_size;
-    unsigned long extra_params_index;
-    char * extra_params;
-
-    unsigned long header_size;
-    char * data_header;
-    int data_header_is_valid;
-    unsigned long data_chunk_size;
-    char * format_str;
-    WavHeaders headers;
-
-    if (fp == NULL) {
-        printf("FILE_OPEN_FAILED");
-        exit(1);
-    }
+long get_max_int(unsigned int bits) {
+    /* get maximum positive integer with size bits */
+    long result;
+    int k;
 
-    chunk_id = read_str_slice(fp, 0, 4);
-    printf("CHUNK_START_READ: %s\n", chunk_id);
-    if (!is_str_equal(chunk_id, "RIFF")) {
-        printf("INVALID_FILE_HEADER");
-        exit(1);
-    }
+    result = 1;
 
-    chunk_size = read_long_from_str_slice(fp, 4, 8, 1);
-    printf("chunk size: %ld\n",chunk_size);
-    format_str = read_str_slice(fp, 8, 12);
-    if (!is_str_equal(format_str, "WAVE")) {
-        printf("WAV FORMAT IS NOT WAVE: %s\n", format_str);
-        exit(1);
+    for (k=1; k<bits; k++) {
+        result *= 2;
     }
 
-    sub_chunk_id = read_str_slice(fp, 12, 16);
-    printf("sub chunk id: %s\n", sub_chunk_id);
-    /* size in bytes of initial fmt chunk */
-    sub_chunk1_size = read_long_from_str_slice(fp, 16, 20, 1);
-    format = read_long_from_str_slice(fp, 20, 22, 1);
-    num_channels = read_long_from_str_slice(fp,22, 24, 1);
-    sample_rate = read_long_from_str_slice(fp, 24, 28, 1);
-    byte_rate = read_long_from_str_slice(fp, 28, 32, 1);
-    block_align = read_long_from_str_slice(fp, 32, 34, 1);
-    bits_per_sample = read_long_from_str_slice(fp, 34, 36, 1);
+    result--;
+    return result;
+}
 
+int read_frames(FILE * fp, WavFile * wav_file) {
     /*
-     * retrieve size of all unnecessary chunks between the
-     * "fmt " and "data" sub-chunks
+    * reads the wav file headers as well as
+    * the raw audio data from the file into wav_file.
+    * Regular files are memory mapped and 16 bit PCM is used in place,
+    * pipes and stdin are read front to back in large blocks without
+    * seeking. Other sample formats are converted to int16 for analysis
+    * while raw_frames keeps the original samples for output.
+    * Returns 0 if success, otherwise prints why and returns 1
+    * with nothing left to free
     */
-    /* length of data for all unnecessary chunks */
-    extra_params_size = 0;
-    /* data after "fmt " sub-chunk starts from index 36 */
-    extra_params_index = 36;
-    while (1) {
-        char * header;
-        int is_data_header;
-        unsigned long sub_chunk_size;
-
-        header = read_str_slice(fp, extra_params_index, extra_params_index+4);
-        is_data_header = is_str_equal("data", header);
-        /* printf("IDX %lu\n", extra_params_index); */
-        /* printf("HEADER %s\n", header); */
-        free(header);
-
-        if (is_data_header) { break; }
-
-        /* sub-chunk size starts 4 bytes from sub-chunk start, consumes 8 bytes */
-        sub_chunk_size = read_long_from_str_slice(
-            fp, extra_params_index+4, extra_params_index+8, 1
-        );
-
-        /* sub-chunk name + size info consumes 8 bytes */
-        extra_params_size += 8 + sub_chunk_size;
-        extra_params_index += 8 + sub_chunk_size;
-    }
+    int res;
 
-    extra_params = read_str_slice(fp, 36, extra_params_index);
-    header_size = (
-        4 + /* for RIFF initial chunk header */
-        4 + /* overall chunk size info */
-        4 + /* extra 4 bytes of space to store WAVE (to declare file is wav?) */
-        4 + /* fmt sub chunk header */
-        4 + /* fmt sub chunk size info */
-        sub_chunk1_size + /* WAVE sub chunk size */
-        extra_params_size
-    );
-    printf("HEADER_SIZE: %ld\n", header_size);
-
-    data_header = read_str_slice(fp, header_size, header_size+4);
-    data_header_is_valid = starts_with_word(data_header, "data");
-    printf("DATA_HEADER: %s\n", data_header);
-    /* free(data_header); */
+    if (fp == NULL) {
+        printf("ERROR: FILE_OPEN_FAILED\n");
+        return 1;
+    }
 
-    if (!data_header_is_valid) {
-        printf("DATA HEADER IS INVALID");
-        exit(1);
+    if (
+        (map_wav_frames(fp, wav_file) != 0) &&
+        (stream_wav_frames(fp, wav_file) != 0)
+    ) {
+        printf("ERROR: INVALID_FILE_HEADER\n");
+        return 1;
     }
 
-    data_chunk_size = read_long_from_str_slice(
-        fp, header_size+4, header_size+8, 1
-    );
+    /* scaled frames are only computed on request, see get_scaled_frames */
+    res = decode_wav_frames(wav_file);
+    if (res != 0) {
+        if (res == DECODE_NO_MEMORY) {
+            printf("ERROR: Failed to allocate the analysis samples!\n");
+        } else {
+            printf("ERROR: INVALID_BITS_PER_SAMPLE %ld\n", wav_file->headers.bits_per_sample);
+        }
+        free_wav_file(*wav_file);
+        return 1;
+    }
 
-    headers.chunk_id = chunk_id;
-    headers.chunk_size = (int) chunk_size;
-    headers.format = format_str;
-    /* headers.filesize = filesize; */
-
-    headers.sub_chunk_id = sub_chunk_id;
-    headers.sub_chunk1_size = (int) sub_chunk1_size;
-    headers.audio_format = (int) format;
-    headers.num_channels = (int) num_channels;
-    headers.sample_rate = (long) sample_rate;
-    headers.byte_rate = (int) byte_rate;
-    headers.block_align = (int) block_align;
-    headers.bits_per_sample = (int) bits_per_sample;
-    /* headers.extra_params_size = (int) extra_params_size; */
-    headers.extra_params = extra_params;
-    headers.extra_params_size = (long) extra_params_size;
-    headers.header_size = (long) header_size;
-    headers.data_header = data_header; /* (int) header_size; */
-    headers.data_chunk_size = (int) data_chunk_size;
-    print_wav_headers(headers);
-    printf("%ld\n",data_chunk_size);
-    return headers;
+    print_wav_headers(wav_file->headers);
+    log_info("NUM_SAMPLES %lu\n", wav_file->num_frames);
+    log_info("NUM_FRAMES %lu\n", wav_file->num_frames / wav_file->headers.num_channels);
+    return 0;
 }
 
-long get_max_int(unsigned int bits) {
-    /* get maximum positive integer with size bits */
-    long result;
-    int k;
+typedef struct {
+    const short * src;
+    double * dst;
+    float * dst_f32;
+    unsigned long num_samples;
+    double scale;
+} ScaleJob;
 
-    result = 1;
+static void scale_chunk(void * arg, unsigned long index) {
+    /*
+     * scales the index-th SCALE_CHUNK_SIZE range of a ScaleJob,
+     * into dst as doubles or into dst_f32 as floats
+     */
+    ScaleJob * job = (ScaleJob *) arg;
+    unsigned long first = index * SCALE_CHUNK_SIZE;
+    unsigned long last = first + SCALE_CHUNK_SIZE;
+    unsigned long k;
+    float scale_f32 = (float) (1.0 / job->scale);
 
-    for (k=1; k<bits; k++) {
-        result *= 2;
+    if (last > job->num_samples) {
+        last = job->num_samples;
     }
 
-    result--;
-    return result;
+    if (job->dst != NULL) {
+        for (k=first; k<last; k++) {
+            job->dst[k] = ((double) job->src[k]) / job->scale;
+        }
+    } else {
+        for (k=first; k<last; k++) {
+            job->dst_f32[k] = (float) job->src[k] * scale_f32;
+        }
+    }
 }
 
-WavFile read_frames(FILE * fp) {
-    /*
-    * reads the wav file headers as well as
-    * the raw audio data from the file
-    */
-    WavHeaders headers = read_wav_headers(fp);
+static void scale_frames(const WavFile * wav_file, double * dst, float * dst_f32) {
+    ScaleJob job;
+
+    job.src = wav_file->unscaled_frames;
+    job.dst = dst;
+    job.dst_f32 = dst_f32;
+    job.num_samples = wav_file->num_frames;
+    job.scale = wav_file->scale;
+    parallel_for(
+        (job.num_samples + SCALE_CHUNK_SIZE - 1) / SCALE_CHUNK_SIZE,
+        scale_chunk, &job
+    );
+}
+
+double * get_scaled_frames(WavFile * wav_file) {
     /*
-    char * raw_audio_data = read_str_slice(fp, start_index + 8, headers.filesize);
-    */
-    /* long is at least 32 bits */
-    long max_signed_int_val;
-    int sample_size;
+     * returns the audio amplitude values scaled from -1 to 1,
+     * computing them on the first call only. The scaled copy is
+     * 4x the size of the raw samples so nothing in the looping
+     * path should need it
+     */
     unsigned long num_samples;
     double * frames;
-    short * unscaled_frames;
-    unsigned long data_start_idx;
-    WavFile wav_file;
-    int k;
 
-    sample_size = (int) headers.bits_per_sample / 8;
-
-    switch (headers.bits_per_sample) {
-        case 8:
-            max_signed_int_val = get_max_int(8);
-            break;
-        case 16:
-            max_signed_int_val = get_max_int(16);
-            break;
-        default:
-            printf("INVALID_BITS_PER_SAMPLE %ld\n", headers.bits_per_sample);
-            exit(1);
+    if (wav_file->frames != NULL) {
+        return wav_file->frames;
     }
-    
-    printf("MAX_INT_VAL: %ld\n", max_signed_int_val);
-    printf("RAW_DATA_START_IDX: %d\n", 70);
-    printf("RAW_DATA_CHUNK_SIZE: %ld\n", headers.chunk_size);
-
-    /* printf("FILE_SIZE: %ld\n", headers.filesize); */
-    num_samples = headers.data_chunk_size / sample_size;
-    printf("NUM_SAMPLES %ld\n", num_samples);
-
-    /* raw unscaled audio amplitude values */
-    unscaled_frames = (short*) malloc((num_samples + 1) * sizeof(short));
-    /* audio amplitude values scaled from -1 to 1 */
+
+    num_samples = wav_file->num_frames;
     frames = (double *) malloc((num_samples + 1) * sizeof(double));
+    frames[num_samples] = 0;
 
     /*
-    the 8 is for the data chunk name ("data")
-    and the 4 bytes for data chunk size
+     * In librosa the values are scaled to a range of -1 to 1
+     * so we do the same here as well
     */
-    data_start_idx = headers.header_size + 8;
-    unscaled_frames[num_samples] = 0;
-    frames[num_samples] = 0;
-
-    for (k=0; k<num_samples; k++) {
-        /*
-         * Each audio sample is a contiguous sequence of
-         * 1 / 2 / 4 bytes in the file containing an unsigned integer
-         * representing the raw amplitude of the audio sample.
-         * In librosa the values are scaled to a range of -1 to 1
-         * so we do the same here as well
-        */
-        unsigned long slice_start_idx, slice_end_idx;
-        short unscaled_frame;
-        double scaled_frame;
+    scale_frames(wav_file, frames, NULL);
 
-        /*
-        if (k % 10000 == 0) {
-            printf("SAMPLE %d/%ld\n", k, num_samples);
-        }
-        */
-        slice_start_idx = data_start_idx + k * sample_size;
-        slice_end_idx = data_start_idx + (k + 1) * sample_size;
-        if (k == 0) {
-            printf("SLICE_START: %ld\n", slice_start_idx);
-        }
-        unscaled_frame = (short) read_long_from_str_slice(
-            fp, slice_start_idx, slice_end_idx, 1
-        );
-        scaled_frame = (
-            ((double) unscaled_frame) / ((double) max_signed_int_val)
-        );
-
-        if (scaled_frame > 1) {
-            /* value has under flowed due to being negative */
-            scaled_frame -= 2;
-        }
-
-        if (slice_start_idx == DEBUG_INDEX) {
-            printf("DOUBLE %f, %d\n", scaled_frame, k);
-        }
-
-        frames[k] = scaled_frame;
-        unscaled_frames[k] = unscaled_frame;
-    }
+    wav_file->frames = frames;
+    return frames;
+}
 
-    printf("SLICE_END\n");
-    /* free(raw_audio_data); */
-    /* free_wav_headers(headers); */
-    wav_file.scale = (double) max_signed_int_val;
-    wav_file.headers = headers;
-    wav_file.frames = frames;
-    wav_file.num_frames = num_samples;
-    wav_file.unscaled_frames = unscaled_frames;
-    printf("NUM_FRAMES %lu\n", wav_file.num_frames);
-    return wav_file;
+void copy_scaled_frames_f32(const WavFile * wav_file, float * dst) {
+    /*
+     * writes the audio amplitude values scaled from -1 to 1
+     * as float32 (the dtype librosa returns) into dst,
+     * which must hold num_frames values
+     */
+    scale_frames(wav_file, NULL, dst);
 }
 
 WavParseResult read_wav_file(const char * filepath) {
@@ -502,18 +335,37 @@ WavParseResult read_wav_file(const char * filepath) {
      * formatted as a shape [num_channels, samples_per_channel]
      * array instead of a 1D array like in read_frames
      *
+     * The channels are laid out back to back in one contiguous
+     * block starting at samples[0], so it can be wrapped as a
+     * [num_channels, num_samples] array without copying
+     *
      * Note: right now this is only being used in the python testing
      * script
      */
     WavParseResult wav_parse_result;
     long num_channels;
     double ** samples;
+    double * block;
     unsigned long channel_length;
+    planarbuf planar;
     int k;
 
     FILE *fp = fopen(filepath, "r");
-    WavFile read_result = read_frames(fp);
-    printf("READ_FRAMES_COMPLETE\n");
+    WavFile read_result;
+
+    /* an unreadable file gives no channels and no samples */
+    wav_parse_result.samples = NULL;
+    wav_parse_result.num_frames = 0;
+    wav_parse_result.sample_rate = 0;
+    wav_parse_result.num_channels = 0;
+    wav_parse_result.num_samples = 0;
+    if (read_frames(fp, &read_result) != 0) {
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return wav_parse_result;
+    }
+    log_info("READ_FRAMES_COMPLETE\n");
 
     num_channels = read_result.headers.num_channels;
     samples = (double **) malloc(
@@ -522,33 +374,36 @@ WavParseResult read_wav_file(const char * filepath) {
 
     samples[num_channels] = 0;
     channel_length = read_result.num_frames / num_channels;
-    printf("CHANNEL_LENGTH: %ld\n", channel_length);
-    printf("NUM_CHANNELS: %ld\n", num_channels);
+    log_info("CHANNEL_LENGTH: %ld\n", channel_length);
+    log_info("NUM_CHANNELS: %ld\n", num_channels);
 
+    block = (double *) malloc(
+        (num_channels * channel_length + 1) * sizeof(double)
+    );
     for (k = 0; k < num_channels; k++) {
-        double * channel;
-        channel = (double *) malloc(
-            (channel_length + 1) * sizeof(double)
-        );
-
-        channel[channel_length] = 0;
-        samples[k] = channel;
+        samples[k] = block + k * channel_length;
     }
 
-    printf("PRE_FRAME_REASSIGN\n");
-    for (k=0; k < read_result.num_frames; k++) {
+    log_info("PRE_FRAME_REASSIGN\n");
+    /* deinterleave once with the SIMD kernels, then scale each channel contiguously */
+    if (make_planar(read_result.unscaled_frames, read_result.num_frames, num_channels, &planar) != 0) {
+        printf("ERROR: Failed to allocate the planar samples!\n");
+        free(block);
+        free(samples);
+        free_wav_file(read_result);
+        fclose(fp);
+        return wav_parse_result;
+    }
+    for (k = 0; k < num_channels; k++) {
         unsigned long step_idx;
-        unsigned long channel_idx;
+        short* src = planar.channels[k];
+        double* dst = samples[k];
 
-        step_idx = k / num_channels;
-        channel_idx = k % num_channels;
-        /*
-        if ((k == 0) || (k % 10000 == 0)) {
-            printf("ASSIGN %ld-%ld-%d\n", step_idx, channel_idx, k);
+        for (step_idx = 0; step_idx < channel_length; step_idx++) {
+            dst[step_idx] = ((double) src[step_idx]) / read_result.scale;
         }
-        */
-        samples[channel_idx][step_idx] = read_result.frames[k];
     }
+    free_planar(&planar);
 
     wav_parse_result.num_samples = channel_length;
     wav_parse_result.num_channels = num_channels;
@@ -556,42 +411,126 @@ WavParseResult read_wav_file(const char * filepath) {
     wav_parse_result.sample_rate = read_result.headers.sample_rate;
     wav_parse_result.num_frames = read_result.num_frames;
     free_wav_file(read_result);
+    fclose(fp);
     return wav_parse_result;
 }
 
-void write_wav(FILE * fp, WavFile file){
+void set_data_chunk_size(WavHeaders * headers, unsigned long data_chunk_size) {
+    /*
+     * sets the data chunk size along with the RIFF chunk size that
+     * depends on it: "WAVE", the fmt chunk header and its 16 standard
+     * bytes, the extra params, the data chunk header, the data and
+     * the pad byte that keeps chunks at even offsets
+     */
+    headers->data_chunk_size = (long) data_chunk_size;
+    headers->chunk_size = (long) (
+        4 + 8 + 16 + headers->extra_params_size + 8 +
+        data_chunk_size + (data_chunk_size & 1)
+    );
+}
+
+static void write_little_endian(FILE * fp, unsigned long value, int num_bytes) {
+    /* writes the lowest num_bytes bytes of value, least significant first */
+    unsigned char bytes[8];
+    int k;
+
+    for (k=0; k<num_bytes; k++) {
+        bytes[k] = (unsigned char) (value & 0xFF);
+        value >>= 8;
+    }
+    fwrite(bytes, 1, num_bytes, fp);
+}
+
+static int needs_rf64(WavHeaders headers) {
+    /* checks if the RIFF size (including a ds64 chunk) overflows 32 bits */
+    set_data_chunk_size(&headers, (unsigned long) headers.data_chunk_size);
+    return (unsigned long) headers.chunk_size + 8 + DS64_CHUNK_SIZE >= RIFF_MAX_CHUNK_SIZE;
+}
+
+unsigned long get_wav_header_size(WavHeaders headers) {
+    /*
+     * number of bytes write_wav_header writes, which is the offset
+     * of the first sample in the written file
+     */
+    return (
+        12 + /* RIFF/RF64 chunk header and WAVE */
+        (needs_rf64(headers) ? 8 + DS64_CHUNK_SIZE : 0) +
+        8 + 16 + /* fmt sub chunk header and fields */
+        headers.extra_params_size +
+        8 /* data chunk header */
+    );
+}
+
+void write_wav_header(FILE * fp, WavHeaders headers) {
+    /*
+     * writes the wav file headers up to and including the data chunk
+     * size, for headers.data_chunk_size bytes of samples. Files whose
+     * sizes do not fit the 32 bit RIFF fields are written as RF64
+     * (or BW64 if the input was BW64) with a ds64 chunk holding the
+     * 64 bit sizes
+     */
+    unsigned long data_size = (unsigned long) headers.data_chunk_size;
+    unsigned long riff_size;
+    int is_rf64;
+
+    set_data_chunk_size(&headers, data_size);
+    riff_size = (unsigned long) headers.chunk_size;
+    is_rf64 = needs_rf64(headers);
+
     /* WAVE Header Data */
-    fwrite(file.headers.chunk_id, 1, 4, fp);
-    fwrite(&file.headers.chunk_size, 4, 1, fp);
-    fwrite(file.headers.format, 1, 4, fp);
-    fwrite(file.headers.sub_chunk_id, 1, 4, fp);
-    fwrite(&file.headers.sub_chunk1_size, 4, 1, fp);
-    fwrite(&file.headers.audio_format, 2, 1, fp);
-    fwrite(&file.headers.num_channels, 2, 1, fp);
-    fwrite(&file.headers.sample_rate, 4, 1, fp);
-    fwrite(&file.headers.byte_rate, 4, 1, fp);
-    fwrite(&file.headers.block_align, 2, 1, fp);
-    fwrite(&file.headers.bits_per_sample, 2, 1, fp);
-    fwrite(file.headers.extra_params, 1, file.headers.extra_params_size, fp);
+    if (!is_rf64) {
+        fwrite("RIFF", 1, 4, fp);
+        write_little_endian(fp, riff_size, 4);
+    } else {
+        fwrite(is_str_equal(headers.chunk_id, "BW64") ? "BW64" : "RF64", 1, 4, fp);
+        write_little_endian(fp, RIFF_MAX_CHUNK_SIZE, 4);
+    }
+    fwrite(headers.format, 1, 4, fp);
+
+    if (is_rf64) {
+        fwrite("ds64", 1, 4, fp);
+        write_little_endian(fp, DS64_CHUNK_SIZE, 4);
+        write_little_endian(fp, riff_size + 8 + DS64_CHUNK_SIZE, 8);
+        write_little_endian(fp, data_size, 8);
+        /* sample count is in frames */
+        write_little_endian(fp, data_size / headers.block_align, 8);
+        /* no table entries for other oversized chunks */
+        write_little_endian(fp, 0, 4);
+    }
+
+    fwrite(headers.sub_chunk_id, 1, 4, fp);
+    write_little_endian(fp, headers.sub_chunk1_size, 4);
+    write_little_endian(fp, headers.audio_format, 2);
+    write_little_endian(fp, headers.num_channels, 2);
+    write_little_endian(fp, headers.sample_rate, 4);
+    write_little_endian(fp, headers.byte_rate, 4);
+    write_little_endian(fp, headers.block_align, 2);
+    write_little_endian(fp, headers.bits_per_sample, 2);
+    fwrite(headers.extra_params, 1, headers.extra_params_size, fp);
 
     /* Marks the start of the data */
-    fwrite(file.headers.data_header, 1, 4, fp);
-    fwrite(&file.headers.data_chunk_size, 4, 1, fp); 
-    fwrite(file.unscaled_frames,2,file.num_frames,fp); /* Data size */
-    /*
-    for (int i = 0; i < file.num_frames; i++) {
-        fwrite(&file.unscaled_frames[i] , sizeof(int16_t), 1, fp);
+    fwrite(headers.data_header, 1, 4, fp);
+    write_little_endian(fp, is_rf64 ? RIFF_MAX_CHUNK_SIZE : data_size, 4);
+}
+
+void write_wav(FILE * fp, WavFile file){
+    unsigned long data_size = (unsigned long) file.headers.data_chunk_size;
+
+    write_wav_header(fp, file.headers);
+    /* samples are written in the input's own format */
+    fwrite(file.raw_frames, 1, data_size, fp);
+    if (data_size & 1) {
+        fputc(0, fp);
     }
-    */
 }
 
 /*
 int main(int argc, char ** argv){
      // WavParseResult result= read_wav_file("recycling.wav");
      // FILE *fp = fopen("write.wav", "r");
-     // WavHeaders headers=read_wav_headers(fp);
      FILE *fp = fopen("recycling.wav", "r");
-     WavFile file=read_frames(fp);
+     WavFile file;
+     read_frames(fp, &file);
 
      printf("num_frames:%ld",file.num_frames);
      for(int i=100000;i<100200;i++){
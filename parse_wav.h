@@ -1,3 +1,8 @@
+/* RIFF size fields hold 32 bits, this value marks the real size as being in ds64 */
+#define RIFF_MAX_CHUNK_SIZE 0xFFFFFFFFUL
+/* ds64 chunk body: RIFF size, data size, sample count (64 bit each), table length */
+#define DS64_CHUNK_SIZE 28UL
+
 typedef struct {
     char * chunk_id; 
     long chunk_size;
@@ -29,13 +34,21 @@ typedef struct {
 
 typedef struct {
     WavHeaders headers;
+    /* scaled copy of unscaled_frames, NULL until get_scaled_frames is called */
     double * frames;
     unsigned long num_frames;
     double scale;
+    /* int16 samples used for analysis, converted from raw_frames if needed */
     short * unscaled_frames;
+    /* data chunk in the file's own sample format, used for output */
+    unsigned char * raw_frames;
+    /* read-only file mapping backing raw_frames, NULL if heap allocated */
+    void * mapping;
+    unsigned long mapping_size;
 } WavFile;
 
 typedef struct {
+    /* per channel pointers into one contiguous block starting at samples[0] */
     double ** samples;
     unsigned long num_frames;
     unsigned long sample_rate;
@@ -57,27 +70,26 @@ unsigned long byte_str_to_long (
 
 int is_str_equal (const char * string1, const char * string2);
 
-char * read_str_slice (
-    FILE *fp, unsigned long start_index, unsigned long end_index
-);
-
-unsigned long read_long_from_str_slice (
-    FILE *fp, unsigned long start_index, unsigned long end_index,
-    int is_little_endian
-);
-
 char * slice_str (const char * source_str, size_t start, size_t end);
 
 void print_wav_headers (WavHeaders headers);
 
-WavHeaders read_wav_headers (FILE * fp);
-
 long get_max_int (unsigned int bits);
 
-WavFile read_frames (FILE * fp);
+int read_frames (FILE * fp, WavFile * wav_file);
+
+double * get_scaled_frames (WavFile * wav_file);
+
+void copy_scaled_frames_f32 (const WavFile * wav_file, float * dst);
 
 WavParseResult read_wav_file (const char * filepath);
 
+void set_data_chunk_size (WavHeaders * headers, unsigned long data_chunk_size);
+
+unsigned long get_wav_header_size (WavHeaders headers);
+
+void write_wav_header (FILE * fp, WavHeaders headers);
+
 void write_wav (FILE * fp, WavFile file);
 
 
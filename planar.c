@@ -0,0 +1,109 @@
+/**
+ * @file planar.c
+ * @brief Conversion of interleaved audio samples into per-channel (planar) buffers
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "planar.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Splits stereo samples into left and right channels, 8 frames at a time with SSE2
+ * @param src - The interleaved samples
+ * @param left - The destination for the first channel
+ * @param right - The destination for the second channel
+ * @param num_frames - The number of frames
+ */
+static void deinterleave_stereo (const short* src, short* left, short* right, unsigned long num_frames) {
+    unsigned long k = 0;
+#if defined(__SSE2__)
+    __m128i a, b;
+
+    for (; k + 8 <= num_frames; k += 8) {
+        /* each 32 bit lane holds one frame, left in the low half and right in the high half */
+        a = _mm_loadu_si128((const __m128i*) (src + 2 * k));
+        b = _mm_loadu_si128((const __m128i*) (src + 2 * k + 8));
+        _mm_storeu_si128((__m128i*) (left + k), _mm_packs_epi32(
+            _mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16)
+        ));
+        _mm_storeu_si128((__m128i*) (right + k), _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+    }
+#endif
+    for (; k < num_frames; k++) {
+        left[k] = src[2 * k];
+        right[k] = src[2 * k + 1];
+    }
+}
+
+/**
+ * Splits interleaved samples into one array per channel
+ * @param src - The interleaved samples
+ * @param dst - The destination arrays, one per channel, each holding num_frames samples
+ * @param num_frames - The number of frames
+ * @param num_channels - The number of channels
+ */
+void deinterleave_samples (const short* src, short** dst, unsigned long num_frames, int num_channels) {
+    unsigned long k;
+    int c;
+
+    if (num_channels == 1) {
+        memcpy(dst[0], src, num_frames * sizeof(short));
+    } else if (num_channels == 2) {
+        deinterleave_stereo(src, dst[0], dst[1], num_frames);
+    } else {
+        for (k = 0; k < num_frames; k++) {
+            for (c = 0; c < num_channels; c++) {
+                dst[c][k] = src[k * num_channels + c];
+            }
+        }
+    }
+}
+
+/**
+ * Creates a planar copy of interleaved samples
+ * @param src - The interleaved samples
+ * @param num_samples - The number of samples over all channels
+ * @param num_channels - The number of channels
+ * @param buf - The pointer to the planar buffer to fill
+ * @return Whether the buffer was created (0 if success)
+ */
+int make_planar (const short* src, unsigned long num_samples, int num_channels, planarbuf* buf) {
+    short* data;
+    int c;
+
+    if (num_channels <= 0) {
+        return 1;
+    }
+
+    buf->num_channels = num_channels;
+    buf->length = num_samples / num_channels;
+    buf->channels = (short**) malloc(num_channels * sizeof(short*));
+    data = (short*) malloc((buf->length * num_channels + 1) * sizeof(short));
+    if (buf->channels == NULL || data == NULL) {
+        free(buf->channels);
+        free(data);
+        return 1;
+    }
+
+    for (c = 0; c < num_channels; c++) {
+        buf->channels[c] = data + c * buf->length;
+    }
+    deinterleave_samples(src, buf->channels, buf->length, num_channels);
+    return 0;
+}
+
+/**
+ * Frees a planar buffer created by make_planar
+ * @param buf - The pointer to the planar buffer
+ */
+void free_planar (planarbuf* buf) {
+    if (buf->channels != NULL) {
+        free(buf->channels[0]);
+        free(buf->channels);
+        buf->channels = NULL;
+    }
+}
@@ -0,0 +1,16 @@
+/**
+ * Audio samples split into one contiguous array per channel (structure of arrays)
+ */
+typedef struct planar_buffer {
+    /* num_channels pointers into a single allocation */
+    short** channels;
+    /* number of frames (samples per channel) */
+    unsigned long length;
+    int num_channels;
+} planarbuf;
+
+void deinterleave_samples (const short* src, short** dst, unsigned long num_frames, int num_channels);
+
+int make_planar (const short* src, unsigned long num_samples, int num_channels, planarbuf* buf);
+
+void free_planar (planarbuf* buf);
@@ -1,4 +1,5 @@
 import ctypes
+import weakref
 import numpy as np
 import librosa
 
@@ -27,16 +28,12 @@ def parse_wav(filepath: str) -> tuple[np.ndarray, int]:
     assert isinstance(filepath, str)
     c_str_filepath = ctypes.c_char_p(filepath.encode('utf-8'))
     result: WavParseResult = lib.read_wav_file(c_str_filepath)
-    samples_arr = np.empty(
-        (result.num_channels, result.num_samples), dtype=np.float16
+    # the channels are contiguous from samples[0], so wrap them in place
+    # and hand the block back to C once numpy no longer references it
+    samples_arr = np.ctypeslib.as_array(
+        result.samples[0], shape=(result.num_channels, result.num_samples)
     )
-
-
-    for k in range(result.num_channels):
-        for i in range(result.num_samples):
-            samples_arr[k, i] = result.samples[k][i]
-
-    lib.free_wav_parse_result(result)
+    weakref.finalize(samples_arr, lib.free_wav_parse_result, result)
     return samples_arr, result.sample_rate
 
 
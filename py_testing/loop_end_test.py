@@ -0,0 +1,60 @@
+import array
+import os
+import random
+import subprocess
+import tempfile
+import wave
+
+# Loops whose end time lies in the last 2 seconds of the track. The loop end search
+# must only score frames of the track: silence past the end of the file would match
+# a loop start in silence and move the loop end out of the track.
+MAIN = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'main')
+SAMPLE_RATE = 44100
+
+
+def write_wav(filepath: str, samples: array.array, num_channels: int) -> None:
+    with wave.open(filepath, 'wb') as f:
+        f.setnchannels(num_channels)
+        f.setsampwidth(2)
+        f.setframerate(SAMPLE_RATE)
+        f.writeframes(samples.tobytes())
+
+
+def make_track(seconds: float, num_channels: int) -> array.array:
+    rng = random.Random(7)
+    num_samples = int(seconds * SAMPLE_RATE) * num_channels
+    # silence at the start, which would match silence past the end
+    num_silent = 2 * SAMPLE_RATE * num_channels
+    samples = array.array('h', [0] * num_silent)
+    samples.extend(rng.randint(-8000, 8000) for _ in range(num_samples - num_silent))
+    return samples
+
+
+if __name__ == '__main__':
+    MIN_LENGTH = 60
+    START = 1
+    # track length and loop end time, both in seconds
+    CASES = [(19.5, 19), (20.5, 19), (20.0, 20)]
+
+    with tempfile.TemporaryDirectory() as tmp:
+        for num_channels in (1, 2):
+            for track_seconds, end in CASES:
+                in_path = os.path.join(tmp, 'in.wav')
+                out_path = os.path.join(tmp, 'out.wav')
+                write_wav(in_path, make_track(track_seconds, num_channels), num_channels)
+
+                res = subprocess.run(
+                    [MAIN, '--quiet', in_path, out_path, str(MIN_LENGTH), str(START), str(end)],
+                    capture_output=True, text=True
+                )
+                assert res.returncode == 0, res.stdout
+
+                with wave.open(out_path, 'rb') as f:
+                    out_frames = f.getnframes()
+                    assert f.getnchannels() == num_channels
+                # the ending never wraps: the output is at least the min length and
+                # at most one loop and one track longer
+                assert out_frames >= MIN_LENGTH * SAMPLE_RATE
+                assert out_frames <= (MIN_LENGTH + 2 * track_seconds) * SAMPLE_RATE
+                assert os.path.getsize(out_path) == 44 + out_frames * 2 * num_channels
+                print('OK', num_channels, 'channels', track_seconds, 'seconds', out_frames, 'frames')
@@ -0,0 +1,164 @@
+/**
+ * @file pyramid.c
+ * @brief Anti-aliased decimation pyramid of the mono mix, for coarse-to-fine loop searches
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "pyramid.h"
+
+#define PYRAMID_PI 3.14159265358979323846
+
+/* taps of the low-pass filter applied before each decimation, odd so it has a centre tap */
+#define PYRAMID_TAPS 63
+/* cutoff of the low-pass filter in cycles per input sample, a little below the
+   0.5 / PYRAMID_FACTOR Nyquist frequency of the decimated level */
+#define PYRAMID_CUTOFF 0.05
+
+/**
+ * Fills in a Blackman windowed sinc low-pass filter with unity gain at DC
+ * @param taps - The PYRAMID_TAPS filter coefficients to fill
+ */
+static void make_lowpass (double* taps) {
+    double sum = 0.0;
+    double x;
+    int half = PYRAMID_TAPS / 2;
+    int k;
+
+    for (k = 0; k < PYRAMID_TAPS; k++) {
+        x = 2.0 * PYRAMID_PI * PYRAMID_CUTOFF * (k - half);
+        taps[k] = k == half ? 1.0 : sin(x) / x;
+        taps[k] *= 0.42 - 0.5 * cos(2.0 * PYRAMID_PI * k / (PYRAMID_TAPS - 1)) + 0.08 * cos(4.0 * PYRAMID_PI * k / (PYRAMID_TAPS - 1));
+        sum += taps[k];
+    }
+    for (k = 0; k < PYRAMID_TAPS; k++) {
+        taps[k] /= sum;
+    }
+}
+
+/**
+ * Rounds a filtered value back to an int16 sample
+ * @param x - The value
+ * @return The nearest sample, clamped to the int16 range
+ */
+static short to_sample (double x) {
+    x = floor(x + 0.5);
+    if (x > 32767.0) {
+        return 32767;
+    }
+    if (x < -32768.0) {
+        return -32768;
+    }
+    return (short) x;
+}
+
+/**
+ * Low-pass filters a signal and keeps every PYRAMID_FACTOR-th sample, treating
+ * samples past either end as silence
+ * @param src - The signal
+ * @param src_length - The number of samples in src
+ * @param taps - The low-pass filter
+ * @param dst - The destination for the src_length / PYRAMID_FACTOR decimated samples
+ */
+static void decimate (const double* src, unsigned long src_length, const double* taps, double* dst) {
+    unsigned long dst_length = src_length / PYRAMID_FACTOR;
+    unsigned long k;
+    unsigned long centre;
+    double acc;
+    int half = PYRAMID_TAPS / 2;
+    int t;
+
+    for (k = 0; k < dst_length; k++) {
+        centre = k * PYRAMID_FACTOR;
+        acc = 0.0;
+        for (t = 0; t < PYRAMID_TAPS; t++) {
+            if (centre + t >= (unsigned long) half && centre + t - half < src_length) {
+                acc += taps[t] * src[centre + t - half];
+            }
+        }
+        dst[k] = acc;
+    }
+}
+
+/**
+ * Builds the decimation pyramid of interleaved int16 audio, mixing the channels down to mono first
+ * @param samples - The interleaved samples
+ * @param num_frames - The number of frames
+ * @param num_channels - The number of channels
+ * @param sample_rate - The sample rate of the audio
+ * @param pyramid - The pointer to the pyramid to fill, freed with free_pyramid
+ * @return Whether the pyramid was built (0 if success)
+ */
+int build_pyramid (const short* samples, unsigned long num_frames, int num_channels, unsigned long sample_rate, Pyramid* pyramid) {
+    double taps[PYRAMID_TAPS];
+    double* signal;
+    double* next;
+    double sum;
+    unsigned long length = num_frames;
+    unsigned long k;
+    int c;
+    int level;
+
+    pyramid->num_levels = 0;
+    if (num_channels <= 0) {
+        return 1;
+    }
+
+    signal = (double*) malloc((num_frames + 1) * sizeof(double));
+    next = (double*) malloc((num_frames / PYRAMID_FACTOR + 1) * sizeof(double));
+    if (signal == NULL || next == NULL) {
+        free(signal);
+        free(next);
+        return 1;
+    }
+
+    for (k = 0; k < num_frames; k++) {
+        sum = 0.0;
+        for (c = 0; c < num_channels; c++) {
+            sum += samples[k * num_channels + c];
+        }
+        signal[k] = sum / num_channels;
+    }
+
+    make_lowpass(taps);
+    for (level = 0; level < PYRAMID_LEVELS; level++) {
+        if (level > 0) {
+            decimate(signal, length, taps, next);
+            length /= PYRAMID_FACTOR;
+            for (k = 0; k < length; k++) {
+                signal[k] = next[k];
+            }
+        }
+
+        pyramid->levels[level].samples = (short*) malloc((length + 1) * sizeof(short));
+        if (pyramid->levels[level].samples == NULL) {
+            free(signal);
+            free(next);
+            free_pyramid(pyramid);
+            return 1;
+        }
+        for (k = 0; k < length; k++) {
+            pyramid->levels[level].samples[k] = to_sample(signal[k]);
+        }
+        pyramid->levels[level].length = length;
+        pyramid->levels[level].sample_rate = level == 0 ? sample_rate : pyramid->levels[level - 1].sample_rate / PYRAMID_FACTOR;
+        pyramid->num_levels++;
+    }
+
+    free(signal);
+    free(next);
+    return 0;
+}
+
+/**
+ * Frees the levels of a pyramid
+ * @param pyramid - The pointer to the pyramid
+ */
+void free_pyramid (Pyramid* pyramid) {
+    int level;
+
+    for (level = 0; level < pyramid->num_levels; level++) {
+        free(pyramid->levels[level].samples);
+    }
+    pyramid->num_levels = 0;
+}
@@ -0,0 +1,26 @@
+/* number of levels of the decimation pyramid, the full rate mono mix included */
+#define PYRAMID_LEVELS 3
+/* rate reduction between neighbouring levels, 44.1 kHz -> 5.5 kHz -> 690 Hz */
+#define PYRAMID_FACTOR 8
+
+/**
+ * One level of a decimation pyramid: the mono mix of the audio at a reduced sample rate
+ */
+typedef struct pyramid_level {
+    short* samples;
+    unsigned long length;
+    unsigned long sample_rate;
+} PyramidLevel;
+
+/**
+ * Anti-aliased, progressively decimated copies of the mono mix of the audio,
+ * levels[0] being the full rate and each further level PYRAMID_FACTOR times slower
+ */
+typedef struct pyramid {
+    PyramidLevel levels[PYRAMID_LEVELS];
+    int num_levels;
+} Pyramid;
+
+int build_pyramid (const short* samples, unsigned long num_frames, int num_channels, unsigned long sample_rate, Pyramid* pyramid);
+
+void free_pyramid (Pyramid* pyramid);
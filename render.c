@@ -0,0 +1,368 @@
+/**
+ * @file render.c
+ * @brief Streams the extended audio to the output file without ever materializing it
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include "parse_wav.h"
+#include "planar.h"
+#include "loop.h"
+#include "render.h"
+#include "report.h"
+
+/* Largest block size worth padding the output header with a JUNK chunk for */
+#define MAX_ALIGN_BLOCK_SIZE (1UL << 16)
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * Writes out a batch of buffers, resuming after partial writes and interrupts
+ * @param fd - The file descriptor to write to
+ * @param iov - The buffers to write, which are consumed in place
+ * @param count - The number of buffers
+ * @return Whether all buffers were written (0 if success)
+ */
+static int write_iovecs (int fd, struct iovec* iov, int count) {
+    ssize_t written;
+
+    while (count > 0) {
+        written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+
+        /* Skip the buffers that were written in full and trim the partial one */
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Queues a buffer for writing, flushing the batch once it is full
+ * @param fd - The file descriptor to write to
+ * @param iov - The batch of buffers
+ * @param count - The pointer to the number of buffers in the batch
+ * @param data - The start of the buffer
+ * @param size - The number of bytes in the buffer
+ * @return Whether flushing succeeded (0 if success)
+ */
+static int queue_iovec (int fd, struct iovec* iov, int* count, unsigned char* data, unsigned long size) {
+    if (size == 0) {
+        return 0;
+    }
+
+    iov[*count].iov_base = data;
+    iov[*count].iov_len = size;
+    (*count)++;
+
+    if (*count == IOV_MAX) {
+        *count = 0;
+        return write_iovecs(fd, iov, IOV_MAX);
+    }
+    return 0;
+}
+
+/**
+ * Writes the extended audio described by a loop plan: the header with the final sizes, then
+ * the intro, the loop repeated num_loops times and the ending, streamed with writev straight
+ * from the input's data chunk. Memory use does not depend on the length of the output
+ * @param fp - The output wav file stream
+ * @param f - The pointer to the input wav file
+ * @param plan - The pointer to the loop ranges from plan_loop
+ * @return Whether the file was written successfully (0 if success)
+ */
+int write_loop_wav (FILE* fp, WavFile* f, LoopPlan* plan) {
+    struct iovec iov[IOV_MAX];
+    int count = 0;
+    int res = 0;
+    int fd;
+    unsigned long frame_size = f->headers.block_align;
+    unsigned long total_size = f->headers.data_chunk_size / frame_size * frame_size;
+    unsigned long intro_size = plan->start_offset * frame_size;
+    unsigned long loop_size = (plan->end_offset - plan->start_offset) * frame_size;
+    unsigned long ending_size = total_size - plan->end_offset * frame_size;
+    unsigned long data_size = intro_size + loop_size * plan->num_loops + ending_size;
+    unsigned long loop_ctr;
+    WavHeaders headers = f->headers;
+    PhaseTimer timer;
+
+    set_data_chunk_size(&headers, data_size);
+    write_wav_header(fp, headers);
+    if (fflush(fp) != 0) {
+        return 1;
+    }
+    fd = fileno(fp);
+
+    start_phase(&timer);
+    res |= queue_iovec(fd, iov, &count, f->raw_frames, intro_size);
+    for (loop_ctr = 0; loop_ctr < plan->num_loops && res == 0; loop_ctr++) {
+        res |= queue_iovec(fd, iov, &count, f->raw_frames + intro_size, loop_size);
+    }
+    res |= queue_iovec(fd, iov, &count, f->raw_frames + plan->end_offset * frame_size, ending_size);
+    if (res == 0 && count > 0) {
+        res = write_iovecs(fd, iov, count);
+    }
+
+    /* Keep the next chunk at an even offset */
+    if (res == 0 && (data_size & 1)) {
+        res = fputc(0, fp) == EOF;
+    }
+    end_phase("write", &timer);
+
+    if (res) {
+        printf("ERROR: Failed to write the extended audio!\n");
+    } else {
+        count_bytes_written(get_wav_header_size(headers) + data_size + (data_size & 1));
+    }
+    return res;
+}
+
+/**
+ * Copies bytes between files with pread/pwrite, for when the kernel cannot copy them itself
+ * @param in_fd - The file descriptor to copy from
+ * @param src - The offset to copy from
+ * @param out_fd - The file descriptor to copy to
+ * @param dst - The offset to copy to
+ * @param size - The number of bytes to copy
+ * @return Whether all bytes were copied (0 if success)
+ */
+static int bounce_range (int in_fd, unsigned long src, int out_fd, unsigned long dst, unsigned long size) {
+    char* buffer = (char*) malloc(COPY_BUFFER_SIZE);
+    ssize_t count;
+
+    if (buffer == NULL) {
+        printf("ERROR: Failed to allocate the copy buffer!\n");
+        return 1;
+    }
+    while (size > 0) {
+        count = pread(in_fd, buffer, size < COPY_BUFFER_SIZE ? size : COPY_BUFFER_SIZE, (off_t) src);
+        if (count <= 0 || pwrite(out_fd, buffer, count, (off_t) dst) != count) {
+            free(buffer);
+            return 1;
+        }
+        src += count;
+        dst += count;
+        size -= count;
+    }
+
+    free(buffer);
+    return 0;
+}
+
+/**
+ * Copies bytes between files inside the kernel with copy_file_range
+ * @param in_fd - The file descriptor to copy from
+ * @param src - The offset to copy from
+ * @param out_fd - The file descriptor to copy to
+ * @param dst - The offset to copy to
+ * @param size - The number of bytes to copy
+ * @return Whether all bytes were copied (0 if success)
+ */
+static int copy_range (int in_fd, unsigned long src, int out_fd, unsigned long dst, unsigned long size) {
+    loff_t in_off = (loff_t) src;
+    loff_t out_off = (loff_t) dst;
+    ssize_t count;
+
+    while (size > 0) {
+        count = copy_file_range(in_fd, &in_off, out_fd, &out_off, size, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            /* unsupported between these files (or the source ended), finish in user space */
+            return bounce_range(in_fd, (unsigned long) in_off, out_fd, (unsigned long) out_off, size);
+        }
+        size -= count;
+    }
+    return 0;
+}
+
+/**
+ * Copies bytes between files, sharing the filesystem blocks (reflink) where source and
+ * destination are equally aligned and falling back to copy_file_range for the rest
+ * @param in_fd - The file descriptor to copy from
+ * @param src - The offset to copy from
+ * @param out_fd - The file descriptor to copy to
+ * @param dst - The offset to copy to
+ * @param size - The number of bytes to copy
+ * @param block_size - The filesystem block size that clones must be aligned to
+ * @param can_clone - The pointer to whether cloning is still worth trying, cleared once it fails
+ * @return Whether all bytes were copied (0 if success)
+ */
+static int clone_range (int in_fd, unsigned long src, int out_fd, unsigned long dst, unsigned long size, unsigned long block_size, int* can_clone) {
+    struct file_clone_range clone;
+    unsigned long head;
+    unsigned long body;
+
+    if (!*can_clone || src % block_size != dst % block_size) {
+        return copy_range(in_fd, src, out_fd, dst, size);
+    }
+
+    /* Only whole blocks can be shared, the unaligned head and tail are copied */
+    head = (block_size - src % block_size) % block_size;
+    if (head >= size) {
+        return copy_range(in_fd, src, out_fd, dst, size);
+    }
+    body = (size - head) / block_size * block_size;
+
+    if (copy_range(in_fd, src, out_fd, dst, head) != 0) {
+        return 1;
+    }
+
+    if (body > 0) {
+        clone.src_fd = in_fd;
+        clone.src_offset = src + head;
+        clone.src_length = body;
+        clone.dest_offset = dst + head;
+        if (ioctl(out_fd, FICLONERANGE, &clone) != 0) {
+            /* the filesystem does not share blocks (or not between these files), stop trying */
+            *can_clone = 0;
+            if (copy_range(in_fd, src + head, out_fd, dst + head, body) != 0) {
+                return 1;
+            }
+        }
+    }
+
+    return copy_range(in_fd, src + head + body, out_fd, dst + head + body, size - head - body);
+}
+
+/**
+ * Adds a JUNK chunk after the extra params so that the first output sample lands at
+ * the same offset modulo block_size as the first input sample, which lets the intro
+ * (and any loop repetition that happens to line up) be shared with the input's blocks
+ * @param headers - The pointer to the output headers, whose extra_params are replaced
+ * @param data_offset - The offset of the first sample in the input file
+ * @param block_size - The filesystem block size
+ */
+static void align_wav_header (WavHeaders* headers, unsigned long data_offset, unsigned long block_size) {
+    unsigned long header_size = get_wav_header_size(*headers);
+    unsigned long junk_size = (data_offset % block_size + block_size - header_size % block_size) % block_size;
+    char* extra_params;
+
+    /* a chunk needs at least its 8 byte header, and chunks must stay at even offsets */
+    if (junk_size == 0 || junk_size % 2 != 0 || block_size > MAX_ALIGN_BLOCK_SIZE) {
+        return;
+    }
+    if (junk_size < 8) {
+        junk_size += block_size;
+    }
+
+    extra_params = (char*) malloc(headers->extra_params_size + junk_size + 1);
+    if (extra_params == NULL) {
+        /* the output is still valid, only its blocks cannot be shared */
+        return;
+    }
+    memcpy(extra_params, headers->extra_params, headers->extra_params_size);
+    memcpy(extra_params + headers->extra_params_size, "JUNK", 4);
+    extra_params[headers->extra_params_size + 4] = (char) ((junk_size - 8) & 0xFF);
+    extra_params[headers->extra_params_size + 5] = (char) (((junk_size - 8) >> 8) & 0xFF);
+    extra_params[headers->extra_params_size + 6] = (char) (((junk_size - 8) >> 16) & 0xFF);
+    extra_params[headers->extra_params_size + 7] = (char) (((junk_size - 8) >> 24) & 0xFF);
+    memset(extra_params + headers->extra_params_size + 8, 0, junk_size - 8 + 1);
+
+    headers->extra_params = extra_params;
+    headers->extra_params_size += junk_size;
+}
+
+/**
+ * Writes the extended audio described by a loop plan without moving samples through
+ * user space: a fresh header is written, then the intro, loop repetitions and ending are
+ * assembled from byte ranges of the input's data chunk with FICLONERANGE where the
+ * filesystem supports it and the alignment allows, and copy_file_range otherwise.
+ * Falls back to write_loop_wav when either side is not a regular file
+ * @param fp - The output wav file stream
+ * @param fpin - The input wav file stream that f was read from
+ * @param f - The pointer to the input wav file
+ * @param plan - The pointer to the loop ranges from plan_loop
+ * @return Whether the file was written successfully (0 if success)
+ */
+int copy_loop_wav (FILE* fp, FILE* fpin, WavFile* f, LoopPlan* plan) {
+    struct stat out_info;
+    int in_fd = fileno(fpin);
+    int out_fd = fileno(fp);
+    int can_clone = 1;
+    int res = 0;
+    unsigned long block_size;
+    unsigned long frame_size = f->headers.block_align;
+    unsigned long total_size = f->headers.data_chunk_size / frame_size * frame_size;
+    unsigned long in_data = (unsigned long) (f->raw_frames - (unsigned char*) f->mapping);
+    unsigned long intro_size = plan->start_offset * frame_size;
+    unsigned long loop_size = (plan->end_offset - plan->start_offset) * frame_size;
+    unsigned long ending_size = total_size - plan->end_offset * frame_size;
+    unsigned long data_size = intro_size + loop_size * plan->num_loops + ending_size;
+    unsigned long out_data;
+    unsigned long loop_ctr;
+    WavHeaders headers = f->headers;
+    PhaseTimer timer;
+
+    /* Only samples that live in a regular input file can be copied by the kernel */
+    if (f->mapping == NULL || fstat(out_fd, &out_info) != 0 || !S_ISREG(out_info.st_mode)) {
+        log_info("Output ranges cannot be copied between these files, writing samples instead\n");
+        return write_loop_wav(fp, f, plan);
+    }
+    block_size = out_info.st_blksize > 0 ? (unsigned long) out_info.st_blksize : 4096;
+
+    set_data_chunk_size(&headers, data_size);
+    align_wav_header(&headers, in_data, block_size);
+    out_data = get_wav_header_size(headers);
+    write_wav_header(fp, headers);
+    if (headers.extra_params != f->headers.extra_params) {
+        free(headers.extra_params);
+    }
+    if (fflush(fp) != 0) {
+        return 1;
+    }
+
+    start_phase(&timer);
+    res |= clone_range(in_fd, in_data, out_fd, out_data, intro_size, block_size, &can_clone);
+    for (loop_ctr = 0; loop_ctr < plan->num_loops && res == 0; loop_ctr++) {
+        res |= clone_range(
+            in_fd, in_data + intro_size,
+            out_fd, out_data + intro_size + loop_ctr * loop_size,
+            loop_size, block_size, &can_clone
+        );
+    }
+    if (res == 0) {
+        res = clone_range(
+            in_fd, in_data + plan->end_offset * frame_size,
+            out_fd, out_data + data_size - ending_size,
+            ending_size, block_size, &can_clone
+        );
+    }
+
+    /* Keep the next chunk at an even offset */
+    if (res == 0 && (data_size & 1)) {
+        res = pwrite(out_fd, "", 1, (off_t) (out_data + data_size)) != 1;
+    }
+    end_phase("write", &timer);
+
+    if (res) {
+        printf("ERROR: Failed to copy the extended audio!\n");
+    } else {
+        count_bytes_written(out_data + data_size + (data_size & 1));
+    }
+    return res;
+}
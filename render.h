@@ -0,0 +1,6 @@
+/* Bounce buffer size for filesystems without copy_file_range support */
+#define COPY_BUFFER_SIZE (1UL << 20)
+
+int write_loop_wav (FILE* fp, WavFile* f, LoopPlan* plan);
+
+int copy_loop_wav (FILE* fp, FILE* fpin, WavFile* f, LoopPlan* plan);
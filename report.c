@@ -0,0 +1,194 @@
+/**
+ * @file report.c
+ * @brief Progress logging that honours quiet mode, and the per-phase telemetry report
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "report.h"
+#include "settings.h"
+#include "threadpool.h"
+#include "simd.h"
+
+Report report;
+/* guards the phases, which the jobs of a batch end from their own threads */
+static pthread_mutex_t phase_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @return Whether informational output should be printed
+ */
+int should_log (void) {
+    return !settings.quiet;
+}
+
+/**
+ * printf for progress and diagnostic output, silenced by --quiet. Errors keep using printf
+ * @param format - The printf format string
+ */
+void log_info (const char* format, ...) {
+    va_list args;
+
+    if (settings.quiet) {
+        return;
+    }
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+/**
+ * @return Seconds on a monotonic clock
+ */
+static double get_wall_time (void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * @return CPU seconds used by all threads of the process
+ */
+static double get_cpu_time (void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ * Starts measuring a phase
+ * @param timer - The timer to start
+ */
+void start_phase (PhaseTimer* timer) {
+    timer->wall_time = get_wall_time();
+    timer->cpu_time = get_cpu_time();
+}
+
+/**
+ * @param timer - The timer passed to start_phase
+ * @return Wall seconds since start_phase
+ */
+double get_elapsed_time (PhaseTimer* timer) {
+    return get_wall_time() - timer->wall_time;
+}
+
+/**
+ * Adds the time since start_phase to the named phase
+ * @param name - The name of the phase, runs with the same name are summed
+ * @param timer - The timer passed to start_phase
+ */
+void end_phase (const char* name, PhaseTimer* timer) {
+    ReportPhase* phase = NULL;
+    double wall_time = get_wall_time() - timer->wall_time;
+    double cpu_time = get_cpu_time() - timer->cpu_time;
+    int k;
+
+    pthread_mutex_lock(&phase_lock);
+    for (k = 0; k < report.num_phases; k++) {
+        if (strcmp(report.phases[k].name, name) == 0) {
+            phase = &report.phases[k];
+            break;
+        }
+    }
+
+    if (phase == NULL) {
+        if (report.num_phases == REPORT_MAX_PHASES) {
+            pthread_mutex_unlock(&phase_lock);
+            return;
+        }
+        phase = &report.phases[report.num_phases++];
+        strncpy(phase->name, name, REPORT_NAME_SIZE - 1);
+        phase->name[REPORT_NAME_SIZE - 1] = '\0';
+    }
+
+    phase->wall_time += wall_time;
+    phase->cpu_time += cpu_time;
+    phase->num_runs++;
+    pthread_mutex_unlock(&phase_lock);
+}
+
+/**
+ * Adds to a counter, atomically where the compiler allows since workers report too
+ * @param counter - The counter
+ * @param count - The amount to add
+ */
+static void add_count (unsigned long* counter, unsigned long count) {
+#if defined(__GNUC__)
+    __sync_fetch_and_add(counter, count);
+#else
+    *counter += count;
+#endif
+}
+
+/**
+ * @param count - Number of (start, end) pairs scored
+ */
+void count_candidates (unsigned long count) {
+    add_count(&report.candidates, count);
+}
+
+/**
+ * @param count - Number of scored pairs given up on early because they could no longer win
+ */
+void count_abandoned (unsigned long count) {
+    add_count(&report.abandoned, count);
+}
+
+/**
+ * @param count - Number of input bytes read or mapped
+ */
+void count_bytes_read (unsigned long count) {
+    add_count(&report.bytes_read, count);
+}
+
+/**
+ * @param count - Number of output bytes written, copied or cloned
+ */
+void count_bytes_written (unsigned long count) {
+    add_count(&report.bytes_written, count);
+}
+
+/**
+ * @param count - Number of loop searches that returned before scoring every candidate
+ */
+void count_searches_stopped (unsigned long count) {
+    add_count(&report.searches_stopped, count);
+}
+
+/**
+ * Writes the report as a single JSON object
+ * @param fp - The file to write to
+ * @param exit_code - The exit code of the run
+ * @return Whether the report was written (0 if success)
+ */
+int write_report (FILE* fp, int exit_code) {
+    struct rusage usage;
+    long peak_rss = 0;
+    int k;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        /* kilobytes on Linux */
+        peak_rss = usage.ru_maxrss;
+    }
+
+    fprintf(fp, "{\n  \"exit_code\": %d,\n  \"threads\": %d,\n  \"simd\": \"%s\",\n  \"phases\": [", exit_code, get_num_threads(), get_simd_name());
+    for (k = 0; k < report.num_phases; k++) {
+        fprintf(
+            fp, "%s\n    {\"name\": \"%s\", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"runs\": %lu}",
+            k == 0 ? "" : ",", report.phases[k].name, report.phases[k].wall_time, report.phases[k].cpu_time, report.phases[k].num_runs
+        );
+    }
+    fprintf(fp, "%s],\n", report.num_phases == 0 ? "" : "\n  ");
+    fprintf(fp, "  \"candidates\": %lu,\n", report.candidates);
+    fprintf(fp, "  \"candidates_abandoned\": %lu,\n", report.abandoned);
+    fprintf(fp, "  \"bytes_read\": %lu,\n", report.bytes_read);
+    fprintf(fp, "  \"bytes_written\": %lu,\n", report.bytes_written);
+    fprintf(fp, "  \"search_exhaustive\": %s,\n", report.searches_stopped == 0 ? "true" : "false");
+    fprintf(fp, "  \"peak_rss_kb\": %ld\n}\n", peak_rss);
+    return fflush(fp) != 0 || ferror(fp);
+}
@@ -0,0 +1,59 @@
+/* maximum number of distinct phases in a report */
+#define REPORT_MAX_PHASES 32
+#define REPORT_NAME_SIZE 32
+
+/**
+ * Start times of a phase being measured
+ */
+typedef struct {
+    double wall_time;
+    double cpu_time;
+} PhaseTimer;
+
+/**
+ * Accumulated time of every run of one named phase
+ */
+typedef struct {
+    char name[REPORT_NAME_SIZE];
+    double wall_time;
+    double cpu_time;
+    unsigned long num_runs;
+} ReportPhase;
+
+/**
+ * Telemetry of one run, written out as JSON by write_report
+ */
+typedef struct {
+    ReportPhase phases[REPORT_MAX_PHASES];
+    int num_phases;
+    unsigned long candidates;
+    unsigned long abandoned;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    /* loop searches stopped by a deadline, cancellation or an accepted score */
+    unsigned long searches_stopped;
+} Report;
+
+extern Report report;
+
+void log_info (const char* format, ...);
+
+int should_log (void);
+
+void start_phase (PhaseTimer* timer);
+
+double get_elapsed_time (PhaseTimer* timer);
+
+void end_phase (const char* name, PhaseTimer* timer);
+
+void count_candidates (unsigned long count);
+
+void count_abandoned (unsigned long count);
+
+void count_bytes_read (unsigned long count);
+
+void count_bytes_written (unsigned long count);
+
+void count_searches_stopped (unsigned long count);
+
+int write_report (FILE* fp, int exit_code);
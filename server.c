@@ -0,0 +1,398 @@
+/**
+ * @file server.c
+ * @brief Resident mode extending tracks for clients of a Unix domain socket, keeping the
+ * thread pool and FFT plans warm between requests
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "parse_wav.h"
+#include "planar.h"
+#include "loop.h"
+#include "settings.h"
+#include "report.h"
+#include "threadpool.h"
+#include "batch.h"
+#include "server.h"
+
+/**
+ * Connections accepted but not yet served, and the state shared with the job runners
+ */
+typedef struct {
+    /* ring of queue_depth connections */
+    int* conns;
+    int queue_depth;
+    int first;
+    int count;
+    int stopping;
+    unsigned long num_requests;
+    pthread_mutex_t lock;
+    /* signalled when a connection is queued or the server stops */
+    pthread_cond_t ready;
+} Server;
+
+static volatile sig_atomic_t server_stopping = 0;
+
+/**
+ * SIGINT and SIGTERM handler, stops accepting and lets the queued requests finish
+ * @param sig - The signal
+ */
+static void stop_server (int sig) {
+    (void) sig;
+    server_stopping = 1;
+}
+
+/**
+ * Reads the request line of a connection, with the file descriptors passed along with it
+ * @param conn - The connection
+ * @param line - Buffer for BATCH_LINE_SIZE characters, returned nul terminated
+ * @param fds - Buffer for SERVER_MAX_FDS passed file descriptors, further ones are closed
+ * @param num_fds - Int buffer in which the number of passed file descriptors is returned
+ * @return Whether a request was read (0 if success)
+ */
+static int read_request (int conn, char* line, int* fds, int* num_fds) {
+    union {
+        char buf[CMSG_SPACE(SERVER_MAX_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    size_t length = 0;
+    ssize_t n;
+    int* passed;
+    int k, count;
+
+    *num_fds = 0;
+    while (length < BATCH_LINE_SIZE - 1) {
+        iov.iov_base = line + length;
+        iov.iov_len = BATCH_LINE_SIZE - 1 - length;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        n = recvmsg(conn, &msg, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+                continue;
+            }
+            passed = (int*) CMSG_DATA(cmsg);
+            count = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            for (k = 0; k < count; k++) {
+                if (*num_fds < SERVER_MAX_FDS) {
+                    fds[(*num_fds)++] = passed[k];
+                } else {
+                    close(passed[k]);
+                }
+            }
+        }
+
+        length += n;
+        line[length] = '\0';
+        if (strchr(line, '\n') != NULL) {
+            return 0;
+        }
+    }
+    /* a client may also end its request by shutting down its side */
+    line[length] = '\0';
+    return length == 0;
+}
+
+/**
+ * Serves one request: INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME END_TIME] on one line, where
+ * an INPUT_FILE or OUTPUT_FILE of - is the next file descriptor passed with SCM_RIGHTS. Replies
+ * "ok START_FRAME END_FRAME NUM_LOOPS" or "failed EXIT_CODE" on one line
+ * @param server - The server
+ * @param conn - The connection, closed by the call
+ */
+static void serve_request (Server* server, int conn) {
+    char line[BATCH_LINE_SIZE];
+    char reply[128];
+    char* args[BATCH_MAX_ARGS];
+    int fds[SERVER_MAX_FDS];
+    int num_fds, num_args, next_fd = 0;
+    unsigned long request;
+    LoopPlan plan;
+    PhaseTimer timer;
+    FILE* fp = NULL;
+    FILE* fpout = NULL;
+    int res = 1;
+    int k;
+
+    start_phase(&timer);
+    if (read_request(conn, line, fds, &num_fds) != 0) {
+        printf("ERROR: Incomplete request!\n");
+        num_args = 0;
+    } else {
+        num_args = split_job_line(line + strspn(line, " \t\r\n"), args);
+    }
+
+    if (num_args == 3 || num_args == 5) {
+        res = 0;
+        if (strcmp(args[0], "-") == 0) {
+            fp = next_fd < num_fds ? fdopen(fds[next_fd], "r") : NULL;
+            next_fd += fp != NULL;
+            res = fp == NULL;
+        }
+        if (res == 0 && strcmp(args[1], "-") == 0) {
+            fpout = next_fd < num_fds ? fdopen(fds[next_fd], "w") : NULL;
+            next_fd += fpout != NULL;
+            res = fpout == NULL;
+        }
+        if (res != 0) {
+            printf("ERROR: A - file needs a file descriptor passed with the request!\n");
+            if (fp != NULL) {
+                fclose(fp);
+            }
+        } else {
+            res = run_job_files(args, num_args, fp, fpout, &plan);
+        }
+    } else if (num_args != 0) {
+        printf("ERROR: A request needs INPUT_FILE OUTPUT_FILE MIN_LENGTH [START_TIME END_TIME]!\n");
+    }
+    /* close the descriptors that were not handed over to a FILE */
+    for (k = next_fd; k < num_fds; k++) {
+        close(fds[k]);
+    }
+
+    if (res == 0) {
+        sprintf(reply, "ok %lu %lu %lu\n", plan.start_offset, plan.end_offset, plan.num_loops);
+    } else {
+        sprintf(reply, "failed %d\n", res);
+    }
+    if (send(conn, reply, strlen(reply), 0) < 0) {
+        printf("WARNING: Failed to reply to a client!\n");
+    }
+    close(conn);
+
+    pthread_mutex_lock(&server->lock);
+    request = ++server->num_requests;
+    printf("%lu\t%s\t%d\t%.3f\t%s\t%s\n", request, res == 0 ? "ok" : "failed", res, get_elapsed_time(&timer),
+           num_args >= 3 ? args[0] : "-", num_args >= 3 ? args[1] : "-");
+    fflush(stdout);
+    pthread_mutex_unlock(&server->lock);
+}
+
+/**
+ * Job runner body: serves queued connections until the server stops and the queue is empty
+ * @param arg - The pointer to the Server
+ */
+static void* serve_requests (void* arg) {
+    Server* server = (Server*) arg;
+    int conn;
+
+    pthread_mutex_lock(&server->lock);
+    for (;;) {
+        while (server->count == 0 && !server->stopping) {
+            pthread_cond_wait(&server->ready, &server->lock);
+        }
+        if (server->count == 0) {
+            break;
+        }
+        conn = server->conns[server->first];
+        server->first = (server->first + 1) % server->queue_depth;
+        server->count--;
+        pthread_mutex_unlock(&server->lock);
+
+        serve_request(server, conn);
+        pthread_mutex_lock(&server->lock);
+    }
+    pthread_mutex_unlock(&server->lock);
+    return NULL;
+}
+
+/**
+ * Binds the listening socket, replacing a socket file left behind by a server that is gone.
+ * The socket is only open to its owner: a client names paths the daemon reads and writes
+ * with the owner's rights
+ * @param path - The path of the socket
+ * @param backlog - The number of connections the kernel may hold before they are accepted
+ * @return The listening socket, or -1 if it could not be bound
+ */
+static int listen_on (const char* path, int backlog) {
+    struct sockaddr_un addr;
+    mode_t mask;
+    int fd, probe, res;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("ERROR: The socket path %s is too long!\n", path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("ERROR: Failed to create a socket!\n");
+        return -1;
+    }
+    /* created 0600 from the start, no other thread creates files yet */
+    mask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+    res = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+    if (res != 0) {
+        /* only take the path over if nothing answers on it */
+        if (errno == EADDRINUSE) {
+            probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (probe >= 0 && connect(probe, (struct sockaddr*) &addr, sizeof(addr)) != 0 && errno == ECONNREFUSED) {
+                unlink(path);
+            }
+            if (probe >= 0) {
+                close(probe);
+            }
+        }
+        res = bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+    }
+    umask(mask);
+    if (res != 0) {
+        printf("ERROR: Failed to bind %s, is another server running?\n", path);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) != 0) {
+        printf("ERROR: Failed to listen on %s!\n", path);
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Extends tracks for the clients of a Unix domain socket until SIGINT or SIGTERM. Up to
+ * settings.num_jobs requests run at once on the shared thread pool, up to settings.queue_depth
+ * more wait, and further clients are answered "busy" straight away
+ * @param path - The path of the socket
+ * @return Whether the server ran (0 if success)
+ */
+int run_server (const char* path) {
+    Server server;
+    pthread_t* runners;
+    struct sigaction action;
+    struct timeval timeout;
+    struct pollfd listener;
+    int quiet;
+    int num_runners, started, k;
+    int listen_fd, conn;
+
+    server.queue_depth = settings.queue_depth > 0 ? settings.queue_depth : SERVER_QUEUE_DEPTH;
+    num_runners = settings.num_jobs > 0 ? settings.num_jobs : get_num_threads();
+    server.conns = (int*) malloc(server.queue_depth * sizeof(int));
+    runners = (pthread_t*) malloc(num_runners * sizeof(pthread_t));
+    if (server.conns == NULL || runners == NULL) {
+        printf("ERROR: Failed to allocate the server!\n");
+        free(server.conns);
+        free(runners);
+        return 1;
+    }
+
+    listen_fd = listen_on(path, server.queue_depth);
+    if (listen_fd < 0) {
+        free(server.conns);
+        free(runners);
+        return 1;
+    }
+
+    /* A client hanging up must not kill the server, SIGINT and SIGTERM stop it cleanly */
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+    action.sa_handler = stop_server;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    server.first = 0;
+    server.count = 0;
+    server.stopping = 0;
+    server.num_requests = 0;
+    pthread_mutex_init(&server.lock, NULL);
+    pthread_cond_init(&server.ready, NULL);
+
+    log_info("Listening on %s\n", path);
+
+    quiet = silence_progress();
+    for (started = 0; started < num_runners; started++) {
+        if (pthread_create(&runners[started], NULL, serve_requests, &server) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        /* serve on this thread between accepts */
+        printf("WARNING: Unable to start job runners, serving one request at a time!\n");
+    }
+
+    listener.fd = listen_fd;
+    listener.events = POLLIN;
+    timeout.tv_sec = SERVER_RECV_TIMEOUT;
+    timeout.tv_usec = 0;
+    while (!server_stopping) {
+        /* wake up now and then to notice a stop signal delivered to another thread */
+        if (poll(&listener, 1, SERVER_POLL_MS) <= 0) {
+            continue;
+        }
+        conn = accept(listen_fd, NULL, NULL);
+        if (conn < 0) {
+            continue;
+        }
+        /* a client that never finishes its request must not hold a runner forever */
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        if (started == 0) {
+            serve_request(&server, conn);
+            continue;
+        }
+        pthread_mutex_lock(&server.lock);
+        if (server.count == server.queue_depth) {
+            pthread_mutex_unlock(&server.lock);
+            if (send(conn, "busy\n", 5, 0) < 0) {
+                printf("WARNING: Failed to reply to a client!\n");
+            }
+            close(conn);
+            continue;
+        }
+        server.conns[(server.first + server.count) % server.queue_depth] = conn;
+        server.count++;
+        pthread_cond_signal(&server.ready);
+        pthread_mutex_unlock(&server.lock);
+    }
+
+    /* Stop accepting, the queued requests are still served */
+    close(listen_fd);
+    unlink(path);
+    pthread_mutex_lock(&server.lock);
+    server.stopping = 1;
+    pthread_cond_broadcast(&server.ready);
+    pthread_mutex_unlock(&server.lock);
+    for (k = 0; k < started; k++) {
+        pthread_join(runners[k], NULL);
+    }
+    restore_progress(quiet);
+
+    log_info("Server stopped after %lu requests\n", server.num_requests);
+
+    pthread_cond_destroy(&server.ready);
+    pthread_mutex_destroy(&server.lock);
+    free(server.conns);
+    free(runners);
+    return 0;
+}
@@ -0,0 +1,10 @@
+/* file descriptors a request may pass, its input and its output */
+#define SERVER_MAX_FDS 2
+/* requests waiting for a job runner, unless set with --queue-depth */
+#define SERVER_QUEUE_DEPTH 16
+/* seconds a client has to send its request line */
+#define SERVER_RECV_TIMEOUT 10
+/* milliseconds between checks for a stop signal while no client connects */
+#define SERVER_POLL_MS 200
+
+int run_server (const char* path);
@@ -0,0 +1,53 @@
+/**
+ * @file settings.c
+ * @brief Run-wide options shared by the parsing, searching and rendering stages
+ */
+#include <stdio.h>
+#include "settings.h"
+#include "simd.h"
+
+Settings settings = { 0, 0, 0, 0, SIMD_AVX512, 0, NULL, -1, ENGINE_WINDOW, 0.0, 0, NULL, NULL, 0, 0, NULL, 0 };
+
+/**
+ * Resets the options to their defaults
+ * @param s - The pointer to the options to initialise
+ */
+void init_settings (Settings* s) {
+    s->copy_range = 0;
+    s->num_threads = 0;
+    s->brute_force = 0;
+    s->exhaustive = 0;
+    s->simd_level = SIMD_AVX512;
+    s->quiet = 0;
+    s->report_path = NULL;
+    s->report_fd = -1;
+    s->engine = ENGINE_WINDOW;
+    s->deadline = 0.0;
+    s->accept_score = 0;
+    s->cache_dir = NULL;
+    s->batch_path = NULL;
+    s->num_jobs = 0;
+    s->memory_budget = 0;
+    s->server_path = NULL;
+    s->queue_depth = 0;
+}
+
+/**
+ * Silences the progress output while several tracks are extended at once, as their lines would
+ * interleave. Errors, warnings and the status line of each track are still printed
+ * @return The previous quiet option, to be given back to restore_progress
+ */
+int silence_progress (void) {
+    int quiet = settings.quiet;
+
+    settings.quiet = 1;
+    return quiet;
+}
+
+/**
+ * Restores the progress output once the concurrent tracks are done
+ * @param quiet - The quiet option returned by silence_progress
+ */
+void restore_progress (int quiet) {
+    settings.quiet = quiet;
+}
@@ -0,0 +1,53 @@
+/* loop point search engines */
+#define ENGINE_WINDOW 0
+#define ENGINE_PYRAMID 1
+#define ENGINE_FEATURES 2
+#define ENGINE_FINGERPRINT 3
+
+/**
+ * Run-wide options, set once from the command line before any work starts
+ */
+typedef struct {
+    /* assemble the output with copy_file_range and reflinks instead of writing samples */
+    int copy_range;
+    /* number of threads to decode and search with, 0 for one per online CPU */
+    int num_threads;
+    /* score every loop end offset directly instead of through the FFT correlation */
+    int brute_force;
+    /* score every candidate in full instead of abandoning ones that can no longer win */
+    int exhaustive;
+    /* highest instruction set for the scoring kernels, SIMD_SCALAR to SIMD_AVX512 */
+    int simd_level;
+    /* only print errors and warnings */
+    int quiet;
+    /* file to write the JSON report to, NULL for none */
+    const char* report_path;
+    /* file descriptor to write the JSON report to, -1 for none */
+    int report_fd;
+    /* loop point search engine for the automatic mode, ENGINE_WINDOW, ENGINE_PYRAMID, ENGINE_FEATURES or ENGINE_FINGERPRINT */
+    int engine;
+    /* seconds after which the loop search returns its best loop so far, 0 for none */
+    double deadline;
+    /* stop the loop search once a loop scores below this, 0 for never */
+    unsigned long accept_score;
+    /* directory of the cache of loop points found by the automatic mode, NULL for none */
+    const char* cache_dir;
+    /* manifest of tracks to extend in one run, NULL for a single track */
+    const char* batch_path;
+    /* tracks extended at once in batch and server mode, 0 for one per thread */
+    int num_jobs;
+    /* megabytes the tracks extended at once in batch mode may use, 0 for no limit */
+    unsigned long memory_budget;
+    /* Unix domain socket to serve requests on, NULL to extend the tracks of the command line */
+    const char* server_path;
+    /* requests waiting for a job runner in server mode, 0 for SERVER_QUEUE_DEPTH */
+    int queue_depth;
+} Settings;
+
+extern Settings settings;
+
+void init_settings (Settings* s);
+
+int silence_progress (void);
+
+void restore_progress (int quiet);
@@ -0,0 +1,374 @@
+/**
+ * @file simd.c
+ * @brief int16 sum of absolute and squared difference kernels, picked at runtime from the
+ *        instruction sets the CPU supports. Every kernel is bit-exact with the scalar reference
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "simd.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define SIMD_HAS_X86 1
+#endif
+
+/* vector iterations between flushes of the 32 bit absolute difference lanes, each lane
+   grows by at most 2 * 65535 per iteration so this stays below 2^32 */
+#define SAD_FLUSH_ITERATIONS 16384UL
+
+/* samples scored between the checks of the bounded sums */
+#define BOUNDED_BLOCK_SIZE 1024UL
+
+/**
+ * A vector kernel, which handles a prefix of the input
+ * @return The number of samples handled, the caller finishes the tail with the scalar code
+ */
+typedef unsigned long (*diff_kernel) (const short* a, const short* b, unsigned long n, unsigned long* sum);
+
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+static int simd_max_level = SIMD_AVX512;
+static int simd_level = SIMD_SCALAR;
+static diff_kernel sad_kernel = NULL;
+static diff_kernel ssd_kernel = NULL;
+
+/**
+ * Reference sum of absolute differences
+ * @param a - The first samples
+ * @param b - The second samples
+ * @param n - The number of samples
+ * @return The sum of |a[k] - b[k]|
+ */
+unsigned long sum_abs_diff_s16_scalar (const short* a, const short* b, unsigned long n) {
+    unsigned long sum = 0;
+    unsigned long k;
+    long d;
+
+    for (k = 0; k < n; k++) {
+        d = (long) a[k] - (long) b[k];
+        sum += d < 0 ? -d : d;
+    }
+    return sum;
+}
+
+/**
+ * Reference sum of squared differences
+ * @param a - The first samples
+ * @param b - The second samples
+ * @param n - The number of samples
+ * @return The sum of (a[k] - b[k])^2
+ */
+unsigned long sum_sq_diff_s16_scalar (const short* a, const short* b, unsigned long n) {
+    unsigned long sum = 0;
+    unsigned long k;
+    long d;
+
+    for (k = 0; k < n; k++) {
+        d = (long) a[k] - (long) b[k];
+        sum += d * d;
+    }
+    return sum;
+}
+
+#if defined(SIMD_HAS_X86)
+/*
+ * All kernels take |a - b| as max(a, b) - min(a, b) in 16 bit lanes, which wraps to the
+ * exact unsigned difference, then widen it with zeros before accumulating
+ */
+
+/**
+ * SSE2 sum of absolute differences
+ */
+static unsigned long sad_s16_sse2 (const short* a, const short* b, unsigned long n, unsigned long* sum) {
+    unsigned long k = 0;
+    unsigned long block_end;
+    unsigned long lanes[2];
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc64 = _mm_setzero_si128();
+    __m128i acc32, x, y, u;
+
+    while (k + 8 <= n) {
+        block_end = n - k > 8 * SAD_FLUSH_ITERATIONS ? k + 8 * SAD_FLUSH_ITERATIONS : n;
+        acc32 = _mm_setzero_si128();
+        for (; k + 8 <= block_end; k += 8) {
+            x = _mm_loadu_si128((const __m128i*) (a + k));
+            y = _mm_loadu_si128((const __m128i*) (b + k));
+            u = _mm_sub_epi16(_mm_max_epi16(x, y), _mm_min_epi16(x, y));
+            acc32 = _mm_add_epi32(acc32, _mm_add_epi32(_mm_unpacklo_epi16(u, zero), _mm_unpackhi_epi16(u, zero)));
+        }
+        acc64 = _mm_add_epi64(acc64, _mm_add_epi64(_mm_unpacklo_epi32(acc32, zero), _mm_unpackhi_epi32(acc32, zero)));
+    }
+
+    _mm_storeu_si128((__m128i*) lanes, acc64);
+    *sum = lanes[0] + lanes[1];
+    return k;
+}
+
+/**
+ * SSE2 sum of squared differences, squaring the unsigned differences into 64 bit lanes
+ */
+static unsigned long ssd_s16_sse2 (const short* a, const short* b, unsigned long n, unsigned long* sum) {
+    unsigned long k = 0;
+    unsigned long lanes[2];
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc64 = _mm_setzero_si128();
+    __m128i x, y, u, lo, hi;
+
+    for (; k + 8 <= n; k += 8) {
+        x = _mm_loadu_si128((const __m128i*) (a + k));
+        y = _mm_loadu_si128((const __m128i*) (b + k));
+        u = _mm_sub_epi16(_mm_max_epi16(x, y), _mm_min_epi16(x, y));
+        lo = _mm_unpacklo_epi16(u, zero);
+        hi = _mm_unpackhi_epi16(u, zero);
+        acc64 = _mm_add_epi64(acc64, _mm_mul_epu32(lo, lo));
+        acc64 = _mm_add_epi64(acc64, _mm_mul_epu32(hi, hi));
+        lo = _mm_srli_epi64(lo, 32);
+        hi = _mm_srli_epi64(hi, 32);
+        acc64 = _mm_add_epi64(acc64, _mm_mul_epu32(lo, lo));
+        acc64 = _mm_add_epi64(acc64, _mm_mul_epu32(hi, hi));
+    }
+
+    _mm_storeu_si128((__m128i*) lanes, acc64);
+    *sum = lanes[0] + lanes[1];
+    return k;
+}
+
+/**
+ * AVX2 sum of absolute differences
+ */
+__attribute__((target("avx2")))
+static unsigned long sad_s16_avx2 (const short* a, const short* b, unsigned long n, unsigned long* sum) {
+    unsigned long k = 0;
+    unsigned long block_end;
+    unsigned long lanes[4];
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc64 = _mm256_setzero_si256();
+    __m256i acc32, x, y, u;
+
+    while (k + 16 <= n) {
+        block_end = n - k > 16 * SAD_FLUSH_ITERATIONS ? k + 16 * SAD_FLUSH_ITERATIONS : n;
+        acc32 = _mm256_setzero_si256();
+        for (; k + 16 <= block_end; k += 16) {
+            x = _mm256_loadu_si256((const __m256i*) (a + k));
+            y = _mm256_loadu_si256((const __m256i*) (b + k));
+            u = _mm256_sub_epi16(_mm256_max_epi16(x, y), _mm256_min_epi16(x, y));
+            acc32 = _mm256_add_epi32(acc32, _mm256_add_epi32(_mm256_unpacklo_epi16(u, zero), _mm256_unpackhi_epi16(u, zero)));
+        }
+        acc64 = _mm256_add_epi64(acc64, _mm256_add_epi64(_mm256_unpacklo_epi32(acc32, zero), _mm256_unpackhi_epi32(acc32, zero)));
+    }
+
+    _mm256_storeu_si256((__m256i*) lanes, acc64);
+    *sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return k;
+}
+
+/**
+ * AVX2 sum of squared differences
+ */
+__attribute__((target("avx2")))
+static unsigned long ssd_s16_avx2 (const short* a, const short* b, unsigned long n, unsigned long* sum) {
+    unsigned long k = 0;
+    unsigned long lanes[4];
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc64 = _mm256_setzero_si256();
+    __m256i x, y, u, lo, hi;
+
+    for (; k + 16 <= n; k += 16) {
+        x = _mm256_loadu_si256((const __m256i*) (a + k));
+        y = _mm256_loadu_si256((const __m256i*) (b + k));
+        u = _mm256_sub_epi16(_mm256_max_epi16(x, y), _mm256_min_epi16(x, y));
+        lo = _mm256_unpacklo_epi16(u, zero);
+        hi = _mm256_unpackhi_epi16(u, zero);
+        acc64 = _mm256_add_epi64(acc64, _mm256_mul_epu32(lo, lo));
+        acc64 = _mm256_add_epi64(acc64, _mm256_mul_epu32(hi, hi));
+        lo = _mm256_srli_epi64(lo, 32);
+        hi = _mm256_srli_epi64(hi, 32);
+        acc64 = _mm256_add_epi64(acc64, _mm256_mul_epu32(lo, lo));
+        acc64 = _mm256_add_epi64(acc64, _mm256_mul_epu32(hi, hi));
+    }
+
+    _mm256_storeu_si256((__m256i*) lanes, acc64);
+    *sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return k;
+}
+
+/**
+ * AVX-512 (BW) sum of absolute differences
+ */
+__attribute__((target("avx512f,avx512bw")))
+static unsigned long sad_s16_avx512 (const short* a, const short* b, unsigned long n, unsigned long* sum) {
+    unsigned long k = 0;
+    unsigned long block_end;
+    __m512i zero = _mm512_setzero_si512();
+    __m512i acc64 = _mm512_setzero_si512();
+    __m512i acc32, x, y, u;
+
+    while (k + 32 <= n) {
+        block_end = n - k > 32 * SAD_FLUSH_ITERATIONS ? k + 32 * SAD_FLUSH_ITERATIONS : n;
+        acc32 = _mm512_setzero_si512();
+        for (; k + 32 <= block_end; k += 32) {
+            x = _mm512_loadu_si512((const void*) (a + k));
+            y = _mm512_loadu_si512((const void*) (b + k));
+            u = _mm512_sub_epi16(_mm512_max_epi16(x, y), _mm512_min_epi16(x, y));
+            acc32 = _mm512_add_epi32(acc32, _mm512_add_epi32(_mm512_unpacklo_epi16(u, zero), _mm512_unpackhi_epi16(u, zero)));
+        }
+        acc64 = _mm512_add_epi64(acc64, _mm512_add_epi64(_mm512_unpacklo_epi32(acc32, zero), _mm512_unpackhi_epi32(acc32, zero)));
+    }
+
+    *sum = (unsigned long) _mm512_reduce_add_epi64(acc64);
+    return k;
+}
+
+/**
+ * AVX-512 (BW) sum of squared differences
+ */
+__attribute__((target("avx512f,avx512bw")))
+static unsigned long ssd_s16_avx512 (const short* a, const short* b, unsigned long n, unsigned long* sum) {
+    unsigned long k = 0;
+    __m512i zero = _mm512_setzero_si512();
+    __m512i acc64 = _mm512_setzero_si512();
+    __m512i x, y, u, lo, hi;
+
+    for (; k + 32 <= n; k += 32) {
+        x = _mm512_loadu_si512((const void*) (a + k));
+        y = _mm512_loadu_si512((const void*) (b + k));
+        u = _mm512_sub_epi16(_mm512_max_epi16(x, y), _mm512_min_epi16(x, y));
+        lo = _mm512_unpacklo_epi16(u, zero);
+        hi = _mm512_unpackhi_epi16(u, zero);
+        acc64 = _mm512_add_epi64(acc64, _mm512_mul_epu32(lo, lo));
+        acc64 = _mm512_add_epi64(acc64, _mm512_mul_epu32(hi, hi));
+        lo = _mm512_srli_epi64(lo, 32);
+        hi = _mm512_srli_epi64(hi, 32);
+        acc64 = _mm512_add_epi64(acc64, _mm512_mul_epu32(lo, lo));
+        acc64 = _mm512_add_epi64(acc64, _mm512_mul_epu32(hi, hi));
+    }
+
+    *sum = (unsigned long) _mm512_reduce_add_epi64(acc64);
+    return k;
+}
+#endif
+
+/**
+ * Picks the best kernels the CPU supports up to simd_max_level, runs exactly once
+ */
+static void resolve_simd_kernels (void) {
+    int level = SIMD_SCALAR;
+
+#if defined(SIMD_HAS_X86)
+    __builtin_cpu_init();
+    if (simd_max_level >= SIMD_AVX512 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        sad_kernel = sad_s16_avx512;
+        ssd_kernel = ssd_s16_avx512;
+        level = SIMD_AVX512;
+    } else if (simd_max_level >= SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+        sad_kernel = sad_s16_avx2;
+        ssd_kernel = ssd_s16_avx2;
+        level = SIMD_AVX2;
+    } else if (simd_max_level >= SIMD_SSE2) {
+        /* part of the x86-64 baseline */
+        sad_kernel = sad_s16_sse2;
+        ssd_kernel = ssd_s16_sse2;
+        level = SIMD_SSE2;
+    }
+#endif
+    simd_level = level;
+}
+
+/**
+ * Picks the best kernels the CPU supports. Call once at startup, before any worker thread runs;
+ * the kernels otherwise initialise themselves with no limit on first use, and only the first
+ * initialisation takes effect
+ * @param max_level - The highest instruction set to use (SIMD_SCALAR to SIMD_AVX512)
+ * @return The level picked
+ */
+int init_simd_kernels (int max_level) {
+    simd_max_level = max_level;
+    pthread_once(&simd_once, resolve_simd_kernels);
+    return simd_level;
+}
+
+/**
+ * @return The name of the instruction set the kernels use
+ */
+const char* get_simd_name (void) {
+    static const char* names[] = { "scalar", "sse2", "avx2", "avx512" };
+
+    pthread_once(&simd_once, resolve_simd_kernels);
+    return names[simd_level];
+}
+
+/**
+ * Sum of absolute differences with the fastest available kernel
+ * @param a - The first samples
+ * @param b - The second samples
+ * @param n - The number of samples
+ * @return The sum of |a[k] - b[k]|
+ */
+unsigned long sum_abs_diff_s16 (const short* a, const short* b, unsigned long n) {
+    unsigned long sum = 0;
+    unsigned long k = 0;
+
+    pthread_once(&simd_once, resolve_simd_kernels);
+    if (sad_kernel != NULL) {
+        k = sad_kernel(a, b, n, &sum);
+    }
+    return sum + sum_abs_diff_s16_scalar(a + k, b + k, n - k);
+}
+
+/**
+ * Sum of squared differences with the fastest available kernel
+ * @param a - The first samples
+ * @param b - The second samples
+ * @param n - The number of samples
+ * @return The sum of (a[k] - b[k])^2
+ */
+unsigned long sum_sq_diff_s16 (const short* a, const short* b, unsigned long n) {
+    unsigned long sum = 0;
+    unsigned long k = 0;
+
+    pthread_once(&simd_once, resolve_simd_kernels);
+    if (ssd_kernel != NULL) {
+        k = ssd_kernel(a, b, n, &sum);
+    }
+    return sum + sum_sq_diff_s16_scalar(a + k, b + k, n - k);
+}
+
+/**
+ * Sum of absolute differences that stops early once it exceeds a limit
+ * @param a - The first samples
+ * @param b - The second samples
+ * @param n - The number of samples
+ * @param limit - The largest sum of interest
+ * @return The sum of |a[k] - b[k]| if it is at most limit, otherwise a partial sum above limit
+ */
+unsigned long sum_abs_diff_s16_bounded (const short* a, const short* b, unsigned long n, unsigned long limit) {
+    unsigned long sum = 0;
+    unsigned long k;
+    unsigned long size;
+
+    for (k = 0; k < n && sum <= limit; k += size) {
+        size = n - k < BOUNDED_BLOCK_SIZE ? n - k : BOUNDED_BLOCK_SIZE;
+        sum += sum_abs_diff_s16(a + k, b + k, size);
+    }
+    return sum;
+}
+
+/**
+ * Sum of squared differences that stops early once it exceeds a limit
+ * @param a - The first samples
+ * @param b - The second samples
+ * @param n - The number of samples
+ * @param limit - The largest sum of interest
+ * @return The sum of (a[k] - b[k])^2 if it is at most limit, otherwise a partial sum above limit
+ */
+unsigned long sum_sq_diff_s16_bounded (const short* a, const short* b, unsigned long n, unsigned long limit) {
+    unsigned long sum = 0;
+    unsigned long k;
+    unsigned long size;
+
+    for (k = 0; k < n && sum <= limit; k += size) {
+        size = n - k < BOUNDED_BLOCK_SIZE ? n - k : BOUNDED_BLOCK_SIZE;
+        sum += sum_sq_diff_s16(a + k, b + k, size);
+    }
+    return sum;
+}
@@ -0,0 +1,21 @@
+/* instruction sets the scoring kernels can use, in increasing order */
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+#define SIMD_AVX512 3
+
+int init_simd_kernels (int max_level);
+
+const char* get_simd_name (void);
+
+unsigned long sum_abs_diff_s16_scalar (const short* a, const short* b, unsigned long n);
+
+unsigned long sum_sq_diff_s16_scalar (const short* a, const short* b, unsigned long n);
+
+unsigned long sum_abs_diff_s16 (const short* a, const short* b, unsigned long n);
+
+unsigned long sum_sq_diff_s16 (const short* a, const short* b, unsigned long n);
+
+unsigned long sum_abs_diff_s16_bounded (const short* a, const short* b, unsigned long n, unsigned long limit);
+
+unsigned long sum_sq_diff_s16_bounded (const short* a, const short* b, unsigned long n, unsigned long limit);
@@ -0,0 +1,242 @@
+/**
+ * @file stream_wav.c
+ * @brief Forward-only wav reader for pipes and other unseekable streams
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "parse_wav.h"
+#include "stream_wav.h"
+#include "report.h"
+
+/* Number of bytes requested from the stream per read of the data chunk */
+#define STREAM_BLOCK_SIZE (1UL << 20)
+
+/* Data chunk size written by encoders that cannot seek back to patch the header */
+#define STREAM_UNKNOWN_SIZE 0xFFFFFFFFUL
+
+/* Most fmt extension bytes kept, WAVE_FORMAT_EXTENSIBLE needs 24 */
+#define STREAM_MAX_FMT_EXTENSION 256UL
+
+/**
+ * Reads exactly size bytes from the stream
+ * @param fp - The stream to read from
+ * @param dst - The buffer to read into
+ * @param size - The number of bytes to read
+ * @return Whether all bytes were read (0 if success)
+ */
+static int read_exact (FILE* fp, void* dst, unsigned long size) {
+    unsigned long count = fread(dst, 1, size, fp);
+
+    count_bytes_read(count);
+    return count != size;
+}
+
+/**
+ * Discards bytes from the stream without seeking
+ * @param fp - The stream to read from
+ * @param size - The number of bytes to discard
+ * @return Whether all bytes were discarded (0 if success)
+ */
+static int skip_bytes (FILE* fp, unsigned long size) {
+    char scratch[4096];
+    unsigned long request;
+
+    while (size > 0) {
+        request = size < sizeof(scratch) ? size : sizeof(scratch);
+        if (read_exact(fp, scratch, request) != 0) {
+            return 1;
+        }
+        size -= request;
+    }
+    return 0;
+}
+
+/**
+ * Reads the data chunk in large blocks until size bytes are read or the stream ends.
+ * The buffer grows as blocks arrive, so a corrupt size never allocates more than the stream holds.
+ * @param fp - The stream positioned at the start of the data chunk body
+ * @param size - The declared size of the data chunk, or STREAM_UNKNOWN_SIZE to read until the end
+ * @param num_bytes - The pointer in which the number of bytes read is returned
+ * @return The buffer holding the data chunk, or NULL if it could not be allocated
+ */
+static unsigned char * read_data_chunk (FILE* fp, unsigned long size, unsigned long* num_bytes) {
+    unsigned long capacity = 16 * STREAM_BLOCK_SIZE;
+    unsigned long length = 0;
+    unsigned long request;
+    size_t count;
+    unsigned char* data;
+    unsigned char* grown;
+
+    if (size != STREAM_UNKNOWN_SIZE && size < capacity) {
+        capacity = size;
+    }
+    /* at least one byte, so an empty data chunk still yields a buffer */
+    data = (unsigned char*) malloc(capacity > 0 ? capacity : 1);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    while (length < size) {
+        if (length == capacity) {
+            capacity *= 2;
+            if (size != STREAM_UNKNOWN_SIZE && capacity > size) {
+                capacity = size;
+            }
+            grown = (unsigned char*) realloc(data, capacity);
+            if (grown == NULL) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+        }
+
+        request = capacity - length < STREAM_BLOCK_SIZE ? capacity - length : STREAM_BLOCK_SIZE;
+        count = fread(data + length, 1, request, fp);
+        length += count;
+        count_bytes_read(count);
+        if (count < request) {
+            break;
+        }
+    }
+
+    *num_bytes = length;
+    return data;
+}
+
+/**
+ * Reads a wav (or RF64/BW64) file from a stream without ever seeking, so it works on pipes and stdin.
+ * The header chunks are consumed in order and the data chunk is read in large blocks.
+ * A data chunk size of 0xFFFFFFFF, as written by streaming encoders such as ffmpeg,
+ * means the samples run until the end of the stream.
+ * Call decode_wav_frames afterwards to fill in the int16 analysis samples.
+ * @param fp - The wav file stream, positioned at the start of the RIFF header
+ * @param wav_file - The pointer in which the parsed wav file is returned
+ * @return Whether the stream was parsed successfully (0 if success)
+ */
+int stream_wav_frames (FILE* fp, WavFile* wav_file) {
+    unsigned char riff[12];
+    unsigned char chunk[8];
+    unsigned char fmt[16];
+    unsigned char ds64[16];
+    unsigned long ds64_data_size = 0;
+    unsigned char* extra_params = NULL;
+    unsigned long extra_params_size = 0;
+    unsigned long chunk_size;
+    unsigned long fmt_size = 0;
+    unsigned long num_bytes;
+    unsigned char* data;
+    WavHeaders headers;
+
+    if (fp == NULL || read_exact(fp, riff, 12) != 0) {
+        return 1;
+    }
+    if (
+        (memcmp(riff, "RIFF", 4) != 0 && memcmp(riff, "RF64", 4) != 0 && memcmp(riff, "BW64", 4) != 0) ||
+        memcmp(riff + 8, "WAVE", 4) != 0
+    ) {
+        return 1;
+    }
+
+    while (1) {
+        if (read_exact(fp, chunk, 8) != 0) {
+            free(extra_params);
+            return 1;
+        }
+        chunk_size = byte_str_to_long((char*) chunk + 4, 1, 4);
+
+        if (memcmp(chunk, "data", 4) == 0) {
+            if (chunk_size == RIFF_MAX_CHUNK_SIZE && ds64_data_size > 0) {
+                chunk_size = ds64_data_size;
+            }
+            break;
+        }
+
+        if (memcmp(chunk, "ds64", 4) == 0 && chunk_size >= 16) {
+            /* RF64/BW64 keep the 64 bit data size in ds64, after the 64 bit RIFF size */
+            if (read_exact(fp, ds64, 16) != 0 || skip_bytes(fp, chunk_size - 16 + (chunk_size & 1)) != 0) {
+                free(extra_params);
+                return 1;
+            }
+            ds64_data_size = byte_str_to_long((char*) ds64 + 8, 1, 4) |
+                (byte_str_to_long((char*) ds64 + 12, 1, 4) << 32);
+            continue;
+        }
+
+        if (memcmp(chunk, "fmt ", 4) != 0 || fmt_size != 0) {
+            /* other chunks have no place in the written header, skip them without trusting their size */
+            if (skip_bytes(fp, chunk_size + (chunk_size & 1)) != 0) {
+                free(extra_params);
+                return 1;
+            }
+            continue;
+        }
+
+        if (chunk_size < 16 || read_exact(fp, fmt, 16) != 0) {
+            return 1;
+        }
+        /* keep the fmt extension up to STREAM_MAX_FMT_EXTENSION bytes, a longer one is cut */
+        extra_params_size = chunk_size - 16 < STREAM_MAX_FMT_EXTENSION ? chunk_size - 16 : STREAM_MAX_FMT_EXTENSION;
+        fmt_size = 16 + extra_params_size;
+        extra_params = (unsigned char*) malloc(extra_params_size + (extra_params_size & 1) + 1);
+        if (
+            extra_params == NULL ||
+            read_exact(fp, extra_params, extra_params_size) != 0 ||
+            skip_bytes(fp, chunk_size - fmt_size + (chunk_size & 1)) != 0
+        ) {
+            free(extra_params);
+            return 1;
+        }
+        /* the written fmt chunk is padded to an even size like the one read */
+        if (extra_params_size & 1) {
+            extra_params[extra_params_size++] = 0;
+        }
+    }
+
+    if (fmt_size == 0) {
+        free(extra_params);
+        return 1;
+    }
+
+    data = read_data_chunk(fp, chunk_size, &num_bytes);
+    if (data == NULL) {
+        free(extra_params);
+        return 1;
+    }
+
+    extra_params[extra_params_size] = 0;
+
+    headers.chunk_id = slice_str((char*) riff, 0, 4);
+    headers.chunk_size = (long) byte_str_to_long((char*) riff + 4, 1, 4);
+    headers.format = slice_str((char*) riff, 8, 12);
+    headers.sub_chunk_id = slice_str("fmt ", 0, 4);
+    headers.sub_chunk1_size = (long) fmt_size;
+    headers.audio_format = (long) byte_str_to_long((char*) fmt, 1, 2);
+    headers.num_channels = (long) byte_str_to_long((char*) fmt + 2, 1, 2);
+    headers.sample_rate = (long) byte_str_to_long((char*) fmt + 4, 1, 4);
+    headers.byte_rate = (long) byte_str_to_long((char*) fmt + 8, 1, 4);
+    headers.block_align = (long) byte_str_to_long((char*) fmt + 12, 1, 2);
+    headers.bits_per_sample = (long) byte_str_to_long((char*) fmt + 14, 1, 2);
+    headers.extra_params = (char*) extra_params;
+    headers.extra_params_size = (long) extra_params_size;
+    headers.sub_chunk2_size = 0;
+    headers.list_chunk_data = NULL;
+    headers.data_header = slice_str("data", 0, 4);
+    headers.header_size = (long) (36 + extra_params_size);
+    headers.data_chunk_size = (long) num_bytes;
+    if (headers.chunk_id == NULL || headers.format == NULL || headers.sub_chunk_id == NULL || headers.data_header == NULL) {
+        free_wav_headers(headers);
+        free(headers.data_header);
+        free(data);
+        return 1;
+    }
+
+    wav_file->headers = headers;
+    wav_file->frames = NULL;
+    wav_file->num_frames = 0;
+    wav_file->unscaled_frames = NULL;
+    wav_file->raw_frames = data;
+    wav_file->mapping = NULL;
+    wav_file->mapping_size = 0;
+    return 0;
+}
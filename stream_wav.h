@@ -0,0 +1 @@
+int stream_wav_frames (FILE* fp, WavFile* wav_file);
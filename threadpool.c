@@ -0,0 +1,228 @@
+/**
+ * @file threadpool.c
+ * @brief A fixed pool of worker threads running batches of independent indexed tasks
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+/**
+ * One parallel_for call. Indices are handed out in order under pool_lock
+ */
+typedef struct pool_batch {
+    pool_task_fn fn;
+    void* arg;
+    unsigned long count;
+    /* next index to hand out */
+    unsigned long next;
+    /* number of indices that finished running */
+    unsigned long done;
+    struct pool_batch* next_batch;
+} PoolBatch;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+/* batches that still have indices to hand out */
+static PoolBatch* pool_batches = NULL;
+static pthread_t* pool_threads = NULL;
+/* number of threads running tasks, including the caller of parallel_for */
+static int pool_size = 1;
+static int pool_stopping = 0;
+
+/**
+ * Claims the next index of the oldest batch with work left. Must hold pool_lock
+ * @param index - The buffer in which the claimed index is returned
+ * @return The batch the index belongs to, or NULL if there is no work
+ */
+static PoolBatch* claim_task (unsigned long* index) {
+    PoolBatch* batch = pool_batches;
+
+    if (batch == NULL) {
+        return NULL;
+    }
+
+    *index = batch->next++;
+    if (batch->next == batch->count) {
+        /* fully handed out, only the submitter still waits on it */
+        pool_batches = batch->next_batch;
+    }
+    return batch;
+}
+
+/**
+ * Runs a claimed index and reports it as done. Must hold pool_lock, which is released while running
+ * @param batch - The batch the index belongs to
+ * @param index - The claimed index
+ */
+static void run_task (PoolBatch* batch, unsigned long index) {
+    pthread_mutex_unlock(&pool_lock);
+    batch->fn(batch->arg, index);
+    pthread_mutex_lock(&pool_lock);
+
+    batch->done++;
+    if (batch->done == batch->count) {
+        pthread_cond_broadcast(&pool_done);
+    }
+}
+
+/**
+ * Worker thread body, runs tasks until the pool shuts down
+ * @param unused - Unused
+ */
+static void* pool_worker (void* unused) {
+    PoolBatch* batch;
+    unsigned long index;
+
+    (void) unused;
+    pthread_mutex_lock(&pool_lock);
+    while (!pool_stopping) {
+        batch = claim_task(&index);
+        if (batch == NULL) {
+            pthread_cond_wait(&pool_work, &pool_lock);
+            continue;
+        }
+        run_task(batch, index);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+/**
+ * Starts the worker threads. Without a pool every parallel_for runs serially in the caller
+ * @param num_threads - The total number of threads to run tasks on, or 0 for one per online CPU
+ * @return Whether the pool could be started (0 if success)
+ */
+int init_thread_pool (int num_threads) {
+    long num_cpus;
+    int k;
+
+    if (pool_threads != NULL) {
+        return 0;
+    }
+
+    if (num_threads <= 0) {
+        num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = num_cpus > 0 ? (int) num_cpus : 1;
+    }
+    if (num_threads == 1) {
+        return 0;
+    }
+
+    /* the caller of parallel_for is one of the threads */
+    pool_threads = (pthread_t*) malloc((num_threads - 1) * sizeof(pthread_t));
+    if (pool_threads == NULL) {
+        return 1;
+    }
+
+    pool_stopping = 0;
+    for (k = 0; k < num_threads - 1; k++) {
+        if (pthread_create(&pool_threads[k], NULL, pool_worker, NULL) != 0) {
+            break;
+        }
+    }
+    pool_size = k + 1;
+
+    if (k == 0) {
+        free(pool_threads);
+        pool_threads = NULL;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @return The number of threads tasks are spread over, including the calling thread
+ */
+int get_num_threads (void) {
+    return pool_size;
+}
+
+/**
+ * Runs fn(arg, index) for every index in [0, count) on the pool and waits for all of them.
+ * The caller runs tasks as well, so it is safe to call from inside a task
+ * @param count - The number of indices
+ * @param fn - The task to run
+ * @param arg - The argument passed to every task
+ */
+void parallel_for (unsigned long count, pool_task_fn fn, void* arg) {
+    PoolBatch batch;
+    PoolBatch* tail;
+    PoolBatch* claimed;
+    unsigned long index;
+
+    if (pool_size <= 1 || count <= 1) {
+        for (index = 0; index < count; index++) {
+            fn(arg, index);
+        }
+        return;
+    }
+
+    batch.fn = fn;
+    batch.arg = arg;
+    batch.count = count;
+    batch.next = 0;
+    batch.done = 0;
+    batch.next_batch = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_batches == NULL) {
+        pool_batches = &batch;
+    } else {
+        for (tail = pool_batches; tail->next_batch != NULL; tail = tail->next_batch);
+        tail->next_batch = &batch;
+    }
+    pthread_cond_broadcast(&pool_work);
+
+    /* help with our own batch first, so nested calls always make progress */
+    while (batch.next < batch.count) {
+        index = batch.next++;
+        if (batch.next == batch.count) {
+            /* unlink it, it may not be at the head if other batches were queued first */
+            if (pool_batches == &batch) {
+                pool_batches = batch.next_batch;
+            } else {
+                for (tail = pool_batches; tail->next_batch != &batch; tail = tail->next_batch);
+                tail->next_batch = batch.next_batch;
+            }
+        }
+        run_task(&batch, index);
+    }
+
+    /* the rest is running on the workers, help with other batches while waiting */
+    while (batch.done < batch.count) {
+        claimed = claim_task(&index);
+        if (claimed == NULL) {
+            pthread_cond_wait(&pool_done, &pool_lock);
+            continue;
+        }
+        run_task(claimed, index);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/**
+ * Stops and joins the worker threads
+ */
+void shutdown_thread_pool (void) {
+    int k;
+
+    if (pool_threads == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    pool_stopping = 1;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+
+    for (k = 0; k < pool_size - 1; k++) {
+        pthread_join(pool_threads[k], NULL);
+    }
+    free(pool_threads);
+    pool_threads = NULL;
+    pool_size = 1;
+}
@@ -0,0 +1,12 @@
+/**
+ * A task run once for each index of a parallel_for batch
+ */
+typedef void (*pool_task_fn) (void* arg, unsigned long index);
+
+int init_thread_pool (int num_threads);
+
+int get_num_threads (void);
+
+void parallel_for (unsigned long count, pool_task_fn fn, void* arg);
+
+void shutdown_thread_pool (void);